@@ -32,6 +32,12 @@ bool AlcEnabler::init() {
 
 void AlcEnabler::deinit() {
 	patcher.deinit();
+	Buffer::deleter(plannedPatches);
+	plannedPatches = nullptr;
+	Buffer::deleter(plannedGroups);
+	plannedGroups = nullptr;
+	Buffer::deleter(patchBuckets);
+	patchBuckets = nullptr;
 	controllers.deinit();
 	codecs.deinit();
 }
@@ -73,7 +79,7 @@ bool AlcEnabler::loadKexts() {
 			return false;
 		}
 		
-		auto handler = KernelPatcher::KextHandler::create(kextList[i].id, kextList[i].loadIndex,
+		auto handler = KernelPatcher::KextHandler::create(kextList[i].id, i,
 		[](KernelPatcher::KextHandler *h) {
 			if (h && that) {
 				that->processKext(h->index, h->address, h->size);
@@ -98,63 +104,67 @@ bool AlcEnabler::loadKexts() {
 	
 	}
 	
+	// All the symbols are copied out, so the prelinked image is no longer needed
+	patcher.freePrelinkedImage();
+	
 	that = this;
 	return true;
 }
 
-void AlcEnabler::processKext(size_t index, mach_vm_address_t address, size_t size) {
+void AlcEnabler::processKext(size_t kext, mach_vm_address_t address, size_t size) {
+	auto index = kextList[kext].loadIndex;
+	
+	// Released kinfos have nothing planned
+	if (index == KernelPatcher::KextInfo::Unloaded) {
+		DBGLOG("alc @ skipped %s with a released kinfo", kextList[kext].id);
+		return;
+	}
+	
 	patcher.updateRunningInfo(index, address, size);
 	
 	if (patcher.getError() == KernelPatcher::Error::NoError) {
 		if (!(progressState & ProcessingState::ControllersLoaded)) {
 			grabControllers();
 			progressState |= ProcessingState::ControllersLoaded;
+			planPatches();
 		} else if (!(progressState & ProcessingState::CodecsLoaded)) {
-			for (size_t i = 0; i < kextListSize; i++) {
-				if (kextList[i].loadIndex == index) {
-					if (kextList[i].detectCodecs && grabCodecs()) {
-						progressState |= ProcessingState::CodecsLoaded;
-						break;
-					}
-					DBGLOG("alc @ failed to find a suitable codec, we have nothing to do");
-					// Continue to patch controllers
-				}
+			if (kextList[kext].detectCodecs && grabCodecs()) {
+				progressState |= ProcessingState::CodecsLoaded;
+				planPatches();
+				// Codec patches were the last ones to plan
+				if (lowMemory)
+					releaseUnpatchedKinfos();
+			} else {
+				DBGLOG("alc @ failed to find a suitable codec, we have nothing to do");
+				// Continue to patch controllers
 			}
 		}
 	
-		if (progressState & ProcessingState::ControllersLoaded) {
-			for (size_t i = 0, num = controllers.size(); i < num; i++) {
-				auto &info = controllers[i]->info;
-				if (!info) {
-					DBGLOG("alc @ missing ControllerModInfo for %zu controller", i);
-					continue;
-				}
-				
-				applyPatches(index, info->patches, info->patchNum);
-			}
-		}
-		
 		if (progressState & ProcessingState::CodecsLoaded) {
 			for (size_t i = 0, num = codecs.size(); i < num; i++) {
 				auto &info = codecs[i]->info;
-				if (!info) {
-					SYSLOG("alc @ missing CodecModInfo for %zu codec", i);
-					continue;
-				}
-				
-				if (info->platforms > 0 && info->layoutNum > 0) {
+				if (info && codecs[i]->platform && codecs[i]->layout) {
 					DBGLOG("alc @ will route callbacks resource loading callbacks");
 					progressState |= ProcessingState::CallbacksWantRouting;
 				}
-				
-				applyPatches(index, info->patches, info->patchNum);
 			}
 		}
 		
+		applyPatches(kext);
+		
 		if ((progressState & ProcessingState::CallbacksWantRouting) && !(progressState & ProcessingState::CallbacksRouted)) {
-			auto layout = patcher.solveSymbol(index, "__ZN14AppleHDADriver18layoutLoadCallbackEjiPKvjPv");
-			auto platform = patcher.solveSymbol(index, "__ZN14AppleHDADriver20platformLoadCallbackEjiPKvjPv");
+			const char *symbols[] {
+				"__ZN14AppleHDADriver18layoutLoadCallbackEjiPKvjPv",
+				"__ZN14AppleHDADriver20platformLoadCallbackEjiPKvjPv"
+			};
+			mach_vm_address_t addresses[arrsize(symbols)];
+			patcher.solveSymbols(index, symbols, arrsize(symbols), addresses);
+			auto layout = addresses[0];
+			auto platform = addresses[1];
 
+			// Both callbacks are hooked in a single kernel write window
+			patcher.beginTransaction();
+			
 			if (!layout || !platform) {
 				SYSLOG("alc @ failed to find AppleHDA layout or platform callback symbols (%llX, %llX)", layout, platform);
 			} else if (orgLayoutLoadCallback = reinterpret_cast<t_callback>(patcher.routeFunction(layout, reinterpret_cast<mach_vm_address_t>(layoutLoadCallback), true)),
@@ -163,9 +173,15 @@ void AlcEnabler::processKext(size_t index, mach_vm_address_t address, size_t siz
 			} else if (orgPlatformLoadCallback = reinterpret_cast<t_callback>(patcher.routeFunction(platform, reinterpret_cast<mach_vm_address_t>(platformLoadCallback), true)),
 					   patcher.getError() != KernelPatcher::Error::NoError) {
 				SYSLOG("alc @ failed to hook platform callback");
+			} else if (!patcher.commitTransaction()) {
+				SYSLOG("alc @ failed to write callback hooks");
 			} else {
 				progressState |= ProcessingState::CallbacksRouted;
 			}
+			
+			// Nothing is written on failure
+			if (!(progressState & ProcessingState::CallbacksRouted))
+				patcher.abortTransaction();
 		}
 	} else {
 		SYSLOG("alc @ failed to update kext running info");
@@ -176,32 +192,12 @@ void AlcEnabler::processKext(size_t index, mach_vm_address_t address, size_t siz
 }
 
 void AlcEnabler::updateResource(Resource type, kern_return_t &result, const void * &resourceData, uint32_t &resourceDataLength) {
-	DBGLOG("alc @ resource-request arrived %s", type == Resource::Platform ? "paltform" : "layout");
-	
-	for (size_t i = 0, s = codecs.size(); i < s; i++) {
-		DBGLOG("alc @ checking codec %X:%X:%X", codecs[i]->vendor, codecs[i]->codec, codecs[i]->revision);
-		
-		auto info = codecs[i]->info;
-		if (!info) {
-			SYSLOG("alc @ missing CodecModInfo for %zu codec at resource updating", i);
-			continue;
-		}
-		
-		if ((type == Resource::Platform && info->platforms) || (type == Resource::Layout && info->layouts)) {
-			size_t num = type == Resource::Platform ? info->platformNum : info->layoutNum;
-			DBGLOG("alc @ selecting from %zu files", num);
-			for (size_t f = 0; f < num; f++) {
-				auto &fi = (type == Resource::Platform ? info->platforms : info->layouts)[f];
-				DBGLOG("alc @ comparing %zu layout %X/%X", f, fi.layout, controllers[codecs[i]->controller]->layout);
-				if (controllers[codecs[i]->controller]->layout == fi.layout && patcher.compatibleKernel(fi.minKernel, fi.maxKernel)) {
-					DBGLOG("Found %s at %zu index", type == Resource::Platform ? "platform" : "layout", f);
-					resourceData = fi.data;
-					resourceDataLength = fi.dataLength;
-					result = kOSReturnSuccess;
-					break;
-				}
-			}
-		}
+	// Files are resolved in validateCodecs
+	auto file = type == Resource::Platform ? platformFile : layoutFile;
+	if (file) {
+		resourceData = file->data;
+		resourceDataLength = file->dataLength;
+		result = kOSReturnSuccess;
 	}
 }
 
@@ -322,36 +318,52 @@ bool AlcEnabler::grabCodecs() {
 void AlcEnabler::validateControllers() {
 	for (size_t i = 0, num = controllers.size(); i < num; i++) {
 		DBGLOG("alc @ validating %zu controller %X:%X:%X", i, controllers[i]->vendor, controllers[i]->device, controllers[i]->revision);
-		for (size_t mod = 0; mod < controllerModSize; mod++) {
+		
+		// Find the candidates for this vendor and device
+		uint32_t key = controllers[i]->vendor << 16 | controllers[i]->device;
+		size_t lo {0}, hi {controllerModIndexSize};
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (controllerModIndex[mid].key < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		
+		if (controllers[i]->vendor > 0xFFFF || controllers[i]->device > 0xFFFF ||
+			lo == controllerModIndexSize || controllerModIndex[lo].key != key) {
+			DBGLOG("alc @ no mods for %zu controller", i);
+			continue;
+		}
+		
+		auto &candidates = controllerModIndex[lo];
+		for (size_t c = 0; c < candidates.modNum; c++) {
+			size_t mod = candidates.mods[c];
 			DBGLOG("alc @ comparing to %zu mod %X:%X", mod, controllerMod[mod].vendor, controllerMod[mod].device);
-			if (controllers[i]->vendor == controllerMod[mod].vendor &&
-				controllers[i]->device == controllerMod[mod].device) {
-				
-				// Check revision if present
-				size_t rev {0};
-				while (rev < controllerMod[mod].revisionNum &&
-					   controllerMod[mod].revisions[rev] != controllers[i]->revision)
-					rev++;
-				
-				// Check AAPL,ig-platform-id if present
-				if (controllerMod[mod].platform != ControllerModInfo::PlatformAny &&
-					controllerMod[mod].platform != controllers[i]->platform) {
-					DBGLOG("alc @ not matching platform was found %X vs %X", controllerMod[mod].platform, controllers[i]->platform);
-					continue;
-				}
-				
-				// Check if computer model is suitable
-				if (!(computerModel & controllerMod[mod].computerModel)) {
-					DBGLOG("alc @ unsuitable computer model was found %X vs %X", controllerMod[mod].computerModel, computerModel);
-					continue;
-				}
+			// Check revision if present
+			size_t rev {0};
+			while (rev < controllerMod[mod].revisionNum &&
+				   controllerMod[mod].revisions[rev] != controllers[i]->revision)
+				rev++;
 			
-				if (rev != controllerMod[mod].revisionNum ||
-					controllerMod[mod].revisionNum == 0) {
-					DBGLOG("alc @ found mod for %zu controller", i);
-					controllers[i]->info = &controllerMod[mod];
-					break;
-				}
+			// Check AAPL,ig-platform-id if present
+			if (controllerMod[mod].platform != ControllerModInfo::PlatformAny &&
+				controllerMod[mod].platform != controllers[i]->platform) {
+				DBGLOG("alc @ not matching platform was found %X vs %X", controllerMod[mod].platform, controllers[i]->platform);
+				continue;
+			}
+			
+			// Check if computer model is suitable
+			if (!(computerModel & controllerMod[mod].computerModel)) {
+				DBGLOG("alc @ unsuitable computer model was found %X vs %X", controllerMod[mod].computerModel, computerModel);
+				continue;
+			}
+		
+			if (rev != controllerMod[mod].revisionNum ||
+				controllerMod[mod].revisionNum == 0) {
+				DBGLOG("alc @ found mod for %zu controller", i);
+				controllers[i]->info = &controllerMod[mod];
+				break;
 			}
 		}
 	}
@@ -363,41 +375,45 @@ bool AlcEnabler::validateCodecs() {
 	while (i < codecs.size()) {
 		bool suitable {false};
 		
-		// Check vendor
-		size_t vIdx {0};
-		while (vIdx < vendorModSize && vendorMod[vIdx].vendor != codecs[i]->vendor)
-			vIdx++;
+		// Check vendor and codec with a single probe
+		auto entry = findCodecMod(codecs[i]->vendor, codecs[i]->codec);
 		
-		if (vIdx != vendorModSize) {
-			// Check codec
-			size_t cIdx {0};
-			while (cIdx < vendorMod[vIdx].codecsNum &&
-				   vendorMod[vIdx].codecs[cIdx].codec != codecs[i]->codec)
-				cIdx++;
+		if (entry) {
+			// Check revision if present, they are sorted
+			auto codec = entry->codec;
+			size_t lo {0}, hi {codec->revisionNum};
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				if (codec->revisions[mid] < codecs[i]->revision)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
 			
-			if (cIdx != vendorMod[vIdx].codecsNum) {
-				// Check revision if present
-				size_t rIdx {0};
-				while (rIdx < vendorMod[vIdx].codecs[cIdx].revisionNum &&
-					   vendorMod[vIdx].codecs[cIdx].revisions[rIdx] != codecs[i]->revision)
-					rIdx++;
+			if (codec->revisionNum == 0 ||
+				(lo < codec->revisionNum && codec->revisions[lo] == codecs[i]->revision)) {
+				codecs[i]->info = codec;
+				suitable = true;
 				
-				if (rIdx != vendorMod[vIdx].codecs[cIdx].revisionNum ||
-					vendorMod[vIdx].codecs[cIdx].revisionNum == 0) {
-					codecs[i]->info = &vendorMod[vIdx].codecs[cIdx];
-					suitable = true;
-					
-				}
+				// Resolve the resources now, the controller layout and the kernel do not change
+				auto lid = controllers[codecs[i]->controller]->layout;
+				codecs[i]->platform = selectFile(codec->platforms, codec->platformNum, lid);
+				codecs[i]->layout = selectFile(codec->layouts, codec->layoutNum, lid);
+				DBGLOG("alc @ resolved platform %p and layout %p for layout-id %X", codecs[i]->platform, codecs[i]->layout, lid);
 				
-				DBGLOG("alc @ found %s %s %s codec revision 0x%X",
-					   suitable ? "supported" : "unsupported", vendorMod[vIdx].name,
-					   vendorMod[vIdx].codecs[cIdx].name, codecs[i]->revision);
-			} else {
-				DBGLOG("alc @ found unsupported %s codec 0x%X revision 0x%X", vendorMod[vIdx].name,
-					   codecs[i]->codec, codecs[i]->revision);
+				// The last codec providing a file wins
+				if (codecs[i]->platform)
+					platformFile = codecs[i]->platform;
+				if (codecs[i]->layout)
+					layoutFile = codecs[i]->layout;
 			}
+			
+			DBGLOG("alc @ found %s %s %s codec revision 0x%X",
+				   suitable ? "supported" : "unsupported", entry->vendor->name,
+				   codec->name, codecs[i]->revision);
 		} else {
-			DBGLOG("alc @ found unsupported codec vendor 0x%X", codecs[i]->vendor);
+			DBGLOG("alc @ found unsupported codec 0x%X:0x%X revision 0x%X", codecs[i]->vendor,
+				   codecs[i]->codec, codecs[i]->revision);
 		}
 		
 		if (suitable)
@@ -409,17 +425,136 @@ bool AlcEnabler::validateCodecs() {
 	return codecs.size() > 0;
 }
 
-void AlcEnabler::applyPatches(size_t index, const KextPatch *patches, size_t patchNum) {
-	DBGLOG("alc @ applying patches for %zu kext", index);
-	for (size_t p = 0; p < patchNum; p++) {
-		auto &patch = patches[p];
-		if (patch.patch.kext->loadIndex == index) {
-			if (patcher.compatibleKernel(patch.minKernel, patch.maxKernel)) {
-				DBGLOG("alc @ applying %zu patch for %zu kext", p, index);
-				patcher.applyLookupPatch(&patch.patch);
-				// Do not really care for the errors for now
-				patcher.clearError();
+const CodecModInfo::File *AlcEnabler::selectFile(const CodecModInfo::File *files, size_t num, uint32_t layout) {
+	for (size_t f = 0; files && f < num; f++) {
+		if (files[f].layout == layout && patcher.compatibleKernel(files[f].minKernel, files[f].maxKernel))
+			return &files[f];
+	}
+	
+	return nullptr;
+}
+
+void AlcEnabler::planPatches() {
+	auto buckets = Buffer::create<size_t>(kextListSize + 1);
+	if (!buckets) {
+		SYSLOG("alc @ failed to allocate patch buckets");
+		return;
+	}
+	
+	for (size_t i = 0; i <= kextListSize; i++)
+		buckets[i] = 0;
+	
+	// Walks the patches of the found controllers and codecs, they are counted first and placed next
+	// Every controller and codec makes its own patch group
+	auto visit = [&](bool place) {
+		uint32_t group {0};
+		auto handle = [&](const KextPatch *patches, size_t patchNum) {
+			for (size_t p = 0; p < patchNum; p++) {
+				auto &patch = patches[p];
+				if (!patcher.compatibleKernel(patch.minKernel, patch.maxKernel))
+					continue;
+				size_t kext = patch.patch.kext - kextList;
+				if (place) {
+					plannedGroups[buckets[kext]] = group;
+					plannedPatches[buckets[kext]++] = &patch.patch;
+				} else {
+					buckets[kext + 1]++;
+				}
 			}
+			group++;
+		};
+		
+		if (progressState & ProcessingState::ControllersLoaded) {
+			for (size_t i = 0, n = controllers.size(); i < n; i++) {
+				auto &info = controllers[i]->info;
+				if (info)
+					handle(info->patches, info->patchNum);
+				else if (!place)
+					DBGLOG("alc @ missing ControllerModInfo for %zu controller", i);
+			}
+		}
+		
+		if (progressState & ProcessingState::CodecsLoaded) {
+			for (size_t i = 0, n = codecs.size(); i < n; i++) {
+				auto &info = codecs[i]->info;
+				if (info)
+					handle(info->patches, info->patchNum);
+				else if (!place)
+					SYSLOG("alc @ missing CodecModInfo for %zu codec", i);
+			}
+		}
+	};
+	
+	visit(false);
+	for (size_t i = 0; i < kextListSize; i++)
+		buckets[i + 1] += buckets[i];
+	
+	size_t total = buckets[kextListSize];
+	Buffer::deleter(plannedPatches);
+	Buffer::deleter(plannedGroups);
+	plannedPatches = total > 0 ? Buffer::create<const KernelPatcher::LookupPatch *>(total) : nullptr;
+	plannedGroups = total > 0 ? Buffer::create<uint32_t>(total) : nullptr;
+	if (total > 0 && (!plannedPatches || !plannedGroups)) {
+		SYSLOG("alc @ failed to allocate %zu planned patches", total);
+		Buffer::deleter(plannedPatches);
+		Buffer::deleter(plannedGroups);
+		plannedPatches = nullptr;
+		plannedGroups = nullptr;
+		Buffer::deleter(buckets);
+		Buffer::deleter(patchBuckets);
+		patchBuckets = nullptr;
+		return;
+	}
+	
+	// Placing moves every bucket start to the next bucket start, shift them back afterwards
+	visit(true);
+	for (size_t i = kextListSize; i > 0; i--)
+		buckets[i] = buckets[i - 1];
+	buckets[0] = 0;
+	
+	Buffer::deleter(patchBuckets);
+	patchBuckets = buckets;
+	DBGLOG("alc @ planned %zu patches for %zu kexts", total, kextListSize);
+}
+
+void AlcEnabler::releaseUnpatchedKinfos() {
+	size_t released {0}, bytes {0};
+	for (size_t i = 0; i < kextListSize; i++) {
+		// Codec detection kexts also provide the resource callbacks
+		bool planned = patchBuckets && patchBuckets[i] != patchBuckets[i + 1];
+		if (planned || kextList[i].detectCodecs || kextList[i].loadIndex == KernelPatcher::KextInfo::Unloaded)
+			continue;
+		
+		bytes += patcher.unloadKinfo(&kextList[i]);
+		if (patcher.getError() == KernelPatcher::Error::NoError)
+			released++;
+		patcher.clearError();
+	}
+	
+	DBGLOG("alc @ released %zu bytes of %zu of %zu kinfos without planned patches", bytes, released, kextListSize);
+}
+
+void AlcEnabler::applyPatches(size_t kext) {
+	if (!patchBuckets)
+		return;
+	
+	size_t num = patchBuckets[kext + 1] - patchBuckets[kext];
+	DBGLOG("alc @ applying %zu patches for %s", num, kextList[kext].id);
+	if (num == 0)
+		return;
+	
+	// A controller or codec is either patched completely or left untouched, the others do not depend on it
+	for (size_t start = patchBuckets[kext], end = patchBuckets[kext + 1]; start < end; ) {
+		size_t next = start + 1;
+		while (next < end && plannedGroups[next] == plannedGroups[start])
+			next++;
+		
+		patcher.applyLookupPatches(&plannedPatches[start], next - start);
+		if (patcher.getError() != KernelPatcher::Error::NoError) {
+			SYSLOG("alc @ failed to apply %zu patches of %u group for %s (%d)", next - start, plannedGroups[start], kextList[kext].id, patcher.getError());
+			// Do not really care for the errors for now
+			patcher.clearError();
 		}
+		start = next;
 	}
 }
\ No newline at end of file
@@ -29,11 +29,11 @@ private:
 	/**
 	 *  Patch AppleHDA or another kext if needed and prepare other patches
 	 *
-	 *  @param index   kinfo handle
+	 *  @param kext    kextList index
 	 *  @param address kinfo load address
 	 *  @param size    kinfo memory size
 	 */
-	void processKext(size_t index, mach_vm_address_t address, size_t size);
+	void processKext(size_t kext, mach_vm_address_t address, size_t size);
 	
 	/**
 	 *  ResourceLoad callback type
@@ -77,15 +77,43 @@ private:
 	 *  @return true if anything suitable found
 	 */
 	bool validateCodecs();
+	
+	/**
+	 *  Select a resource file for the layout compatible with the running kernel
+	 *
+	 *  @param files  resource files
+	 *  @param num    number of files
+	 *  @param layout controller layout-id
+	 *
+	 *  @return resource file or nullptr
+	 */
+	const CodecModInfo::File *selectFile(const CodecModInfo::File *files, size_t num, uint32_t layout);
 
 	/**
-	 *  Apply kext patches for loaded kext index
+	 *  Group the kernel compatible patches of the found controllers and codecs by kext
+	 */
+	void planPatches();
+
+	/**
+	 *  Apply all the planned patches of a loaded kext, a single pass per controller or codec patch group
 	 *
-	 *  @param index      kinfo index
-	 *  @param patches    patch list
-	 *  @param patchesNum patch number
+	 *  @param kext kextList index
 	 */
-	void applyPatches(size_t index, const KextPatch *patches, size_t patchesNum);
+	void applyPatches(size_t kext);
+	
+	/**
+	 *  Release the kinfos of the kexts left without planned patches, done in low memory mode
+	 *  Their files are read by loadKexts anyway, so only the memory is saved, not the I/O
+	 */
+	void releaseUnpatchedKinfos();
+	
+	/**
+	 *  Planned patches, kextList index i owns [patchBuckets[i], patchBuckets[i+1]) of plannedPatches,
+	 *  plannedGroups holds the controller or codec group of every planned patch
+	 */
+	const KernelPatcher::LookupPatch **plannedPatches {nullptr};
+	uint32_t *plannedGroups {nullptr};
+	size_t *patchBuckets {nullptr};
 
 	/**
 	 *  Supported resource types
@@ -147,12 +175,20 @@ private:
 		}
 		static void deleter(CodecInfo *info) { delete info; }
 		const CodecModInfo *info {nullptr};
+		const CodecModInfo::File *platform {nullptr};
+		const CodecModInfo::File *layout {nullptr};
 		size_t controller;
 		uint16_t vendor;
 		uint16_t codec;
 		uint32_t revision;
 	};
 	
+	/**
+	 *  Resource files handed to AppleHDA, resolved at codec validation
+	 */
+	const CodecModInfo::File *platformFile {nullptr};
+	const CodecModInfo::File *layoutFile {nullptr};
+	
 	/**
 	 *  Detected and validated codec infos
 	 */
@@ -32,7 +32,8 @@ static size_t decompress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint3
 		text_buf[i] = ' ';
 	r = N - F;
 	flags = 0;
-	for ( ; ; ) {
+	// stop as soon as the requested prefix is produced instead of skipping the remaining matches
+	while (dst < dstend) {
 		if (((flags >>= 1) & 0x100) == 0) {
 			if (src < srcend) c = *src++; else break;
 			flags = c | 0xFF00;  /* uses higher byte cleverly */
@@ -59,13 +60,13 @@ static size_t decompress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint3
 	return dst - dststart;
 }
 
-uint8_t *decompressData(uint32_t compression, uint32_t dstlen, uint8_t *src, uint32_t srclen) {
+uint8_t *decompressData(uint32_t compression, uint32_t dstlen, uint8_t *src, uint32_t srclen, uint8_t *buffer) {
 	if (lowMemory) {
 		SYSLOG("compression @ disabled due to low memory flag");
 		return nullptr;
 	}
 	
-	auto decompressedBuf = Buffer::create<uint8_t>(dstlen);
+	auto decompressedBuf = buffer ? buffer : Buffer::create<uint8_t>(dstlen);
 	if (decompressedBuf) {
 		size_t size {0};
 		switch (compression) {
@@ -88,6 +89,7 @@ uint8_t *decompressData(uint32_t compression, uint32_t dstlen, uint8_t *src, uin
 		SYSLOG("compression @ failed to allocate memory for decompression buffer");
 	}
 	
-	Buffer::deleter(decompressedBuf);
+	if (!buffer)
+		Buffer::deleter(decompressedBuf);
 	return 0;
 }
\ No newline at end of file
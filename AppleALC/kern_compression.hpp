@@ -32,14 +32,17 @@ struct CompressedHeader {
 
 /**
  *  Typed decompressing function
+ *  Decoding stops once dstlen bytes are produced, so passing less than the full
+ *  decompressed size decodes only the leading dstlen bytes of the data
  *
  *  @param compression compression type
- *  @param dstlen      decompression buffer size
+ *  @param dstlen      decompression buffer size or decoding limit
  *  @param src         compressed data
  *  @param srclen      compressed data size
+ *  @param buffer      preallocated buffer of dstlen bytes or nullptr to allocate a new one
  *
  *  @return decompressed buffer
  */
-uint8_t *decompressData(uint32_t compression, uint32_t dstlen, uint8_t *src, uint32_t srclen);
+uint8_t *decompressData(uint32_t compression, uint32_t dstlen, uint8_t *src, uint32_t srclen, uint8_t *buffer=nullptr);
 
 #endif /* kern_compression_hpp */
\ No newline at end of file
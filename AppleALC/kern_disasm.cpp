@@ -35,45 +35,53 @@ bool Disassembler::init(bool detailed) {
 		return false;
 	}
 	
-	initialised = true;
-	
+	// The instruction buffer only gets a detail area when the option is set beforehand
 	if (detailed) {
 		err = cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
 		if (err != CS_ERR_OK) {
 			SYSLOG("disasm @ capstone instruction detalisation unsupported (%d)", err);
+			cs_close(&handle);
 			return false;
 		}
 	}
 	
+	insn = cs_malloc(handle);
+	if (!insn) {
+		SYSLOG("disasm @ capstone failed to allocate an instruction buffer");
+		cs_close(&handle);
+		return false;
+	}
+	
+	initialised = true;
+	
 	return true;
 }
 
 void Disassembler::deinit() {
 	if (initialised) {
+		if (insn) {
+			cs_free(insn, 1);
+			insn = nullptr;
+		}
 		cs_close(&handle);
 		initialised = false;
 	}
 }
 
 size_t Disassembler::instructionSize(mach_vm_address_t addr, size_t min) {
-	cs_insn *result {nullptr};
-	size_t insts = cs_disasm(handle, reinterpret_cast<uint8_t *>(addr), min+MaxInstruction, 0, 0, &result);
-	
-	cs_err err = cs_errno(handle);
-	if (err != CS_ERR_OK) {
-		SYSLOG("disasm @ capstone failed to disasemble memory (%zu, %p)", insts, result);
-		if (insts != 0 && result)
-			kern_os_free(result);
-		return 0;
-	}
-	
+	auto code = reinterpret_cast<const uint8_t *>(addr);
+	size_t left = min+MaxInstruction;
+	uint64_t address = addr;
 	size_t size {0};
 	
-	for (size_t i = 0; i < insts && size < min; i++) {
-		size += result[i].size;
-	}
+	// Decode one instruction at a time into the preallocated buffer and stop once min is covered
+	while (size < min && cs_disasm_iter(handle, &code, &left, &address, insn))
+		size += insn->size;
 	
-	kern_os_free(result);
+	if (size < min && cs_errno(handle) != CS_ERR_OK) {
+		SYSLOG("disasm @ capstone failed to disasemble memory (%d)", cs_errno(handle));
+		return 0;
+	}
 	
 	if (size >= min) {
 		return size;
@@ -81,4 +89,223 @@ size_t Disassembler::instructionSize(mach_vm_address_t addr, size_t min) {
 	
 	SYSLOG("disasm @ capstone failed to disasemble enough memory (%zu), was %llX address valid?", min, addr);
 	return 0;
-}
\ No newline at end of file
+}
+
+// Shorthands for the opcode maps below
+#define N_ OpNone
+#define M_ OpModRM
+#define MB (OpModRM|OpImm8)
+#define MZ (OpModRM|OpImmZ)
+#define B_ OpImm8
+#define Z_ OpImmZ
+#define W_ OpImm16
+#define V_ OpImmV
+#define O_ OpMoffs
+#define GB (OpModRM|OpImm8|OpGroup)
+#define GZ (OpModRM|OpImmZ|OpGroup)
+#define EN (OpImm16|OpImm8)
+#define XX OpUnknown
+
+// Prefixes and escapes are handled before the lookup and are marked as unknown
+const uint8_t Disassembler::opcodeMap[256] {
+	/*        0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+	/* 0 */  M_, M_, M_, M_, B_, Z_, XX, XX, M_, M_, M_, M_, B_, Z_, XX, XX,
+	/* 1 */  M_, M_, M_, M_, B_, Z_, XX, XX, M_, M_, M_, M_, B_, Z_, XX, XX,
+	/* 2 */  M_, M_, M_, M_, B_, Z_, XX, XX, M_, M_, M_, M_, B_, Z_, XX, XX,
+	/* 3 */  M_, M_, M_, M_, B_, Z_, XX, XX, M_, M_, M_, M_, B_, Z_, XX, XX,
+	/* 4 */  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	/* 5 */  N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_,
+	/* 6 */  XX, XX, XX, M_, XX, XX, XX, XX, Z_, MZ, B_, MB, N_, N_, N_, N_,
+	/* 7 */  B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_, B_,
+	/* 8 */  MB, MZ, XX, MB, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 9 */  N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, XX, N_, N_, N_, N_, N_,
+	/* A */  O_, O_, O_, O_, N_, N_, N_, N_, B_, Z_, N_, N_, N_, N_, N_, N_,
+	/* B */  B_, B_, B_, B_, B_, B_, B_, B_, V_, V_, V_, V_, V_, V_, V_, V_,
+	/* C */  MB, MB, W_, N_, XX, XX, MB, MZ, EN, N_, W_, N_, N_, B_, XX, N_,
+	/* D */  M_, M_, M_, M_, XX, XX, XX, N_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* E */  B_, B_, B_, B_, B_, B_, B_, B_, Z_, Z_, XX, B_, N_, N_, N_, N_,
+	/* F */  XX, N_, XX, XX, N_, N_, GB, GZ, N_, N_, N_, N_, N_, N_, M_, M_
+};
+
+// 0F 38 and 0F 3A are escapes, all their opcodes have ModRM and 0F 3A ones have an 8-bit immediate
+const uint8_t Disassembler::opcodeMap0F[256] {
+	/*        0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+	/* 0 */  M_, M_, M_, M_, XX, N_, N_, N_, N_, N_, XX, N_, XX, M_, N_, MB,
+	/* 1 */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 2 */  M_, M_, M_, M_, XX, XX, XX, XX, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 3 */  N_, N_, N_, N_, N_, N_, XX, N_, XX, XX, XX, XX, XX, XX, XX, XX,
+	/* 4 */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 5 */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 6 */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* 7 */  MB, MB, MB, MB, M_, M_, M_, N_, M_, M_, XX, XX, M_, M_, M_, M_,
+	/* 8 */  Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_, Z_,
+	/* 9 */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* A */  N_, N_, N_, M_, MB, M_, XX, XX, N_, N_, N_, M_, MB, M_, M_, M_,
+	/* B */  M_, M_, M_, M_, M_, M_, M_, M_, M_, XX, MB, M_, M_, M_, M_, M_,
+	/* C */  M_, M_, MB, M_, MB, MB, MB, M_, N_, N_, N_, N_, N_, N_, N_, N_,
+	/* D */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* E */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+	/* F */  M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, XX
+};
+
+#undef N_
+#undef M_
+#undef MB
+#undef MZ
+#undef B_
+#undef Z_
+#undef W_
+#undef V_
+#undef O_
+#undef GB
+#undef GZ
+#undef EN
+#undef XX
+
+size_t Disassembler::instructionLength(const uint8_t *ptr) {
+	auto curr = ptr;
+	auto end = ptr + MaxInstruction;
+	bool operand16 {false}, address32 {false}, rex {false}, rexW {false};
+	
+	// Legacy prefixes, REX is only meaningful right before the opcode
+	for (; curr < end; curr++) {
+		uint8_t b = *curr;
+		if (b == 0x66) {
+			operand16 = true;
+		} else if (b == 0x67) {
+			address32 = true;
+		} else if (b == 0xF0 || b == 0xF2 || b == 0xF3 || b == 0x2E || b == 0x36 ||
+				   b == 0x3E || b == 0x26 || b == 0x64 || b == 0x65) {
+			// no effect on length
+		} else if ((b & 0xF0) == 0x40) {
+			rex = true;
+			rexW = (b & 0x08) != 0;
+			if (curr + 1 < end && ((curr[1] & 0xF0) == 0x40 || curr[1] == 0x66 || curr[1] == 0x67 ||
+				curr[1] == 0xF0 || curr[1] == 0xF2 || curr[1] == 0xF3))
+				return 0; // REX followed by a prefix is ignored by the CPU, let capstone handle it
+			curr++;
+			break;
+		} else {
+			break;
+		}
+	}
+	
+	// size overrides combined with REX are rare and decoded inconsistently, leave them to capstone
+	if (curr >= end || (rex && (operand16 || address32)))
+		return 0;
+	
+	uint8_t flags;
+	bool forceRegister {false};
+	uint8_t opcode = *curr++;
+	if (opcode == 0x0F) {
+		if (curr >= end)
+			return 0;
+		opcode = *curr++;
+		if (opcode == 0x38) {
+			curr++;
+			flags = OpModRM;
+		} else if (opcode == 0x3A) {
+			curr++;
+			flags = OpModRM|OpImm8;
+		} else {
+			flags = opcodeMap0F[opcode];
+			// control and debug register moves always use the register form
+			if (opcode >= 0x20 && opcode <= 0x23)
+				forceRegister = true;
+		}
+	} else if (opcode == 0xC4 || opcode == 0xC5) {
+		// VEX is always VEX in 64-bit mode, no legacy prefixes are allowed before it
+		if (operand16 || rex || curr >= end)
+			return 0;
+		uint8_t map {1};
+		if (opcode == 0xC4) {
+			map = *curr++ & 0x1F;
+			if (curr >= end)
+				return 0;
+			rexW = (*curr & 0x80) != 0;
+		}
+		curr++;
+		if (curr >= end)
+			return 0;
+		opcode = *curr++;
+		if (map == 1)
+			flags = opcodeMap0F[opcode];
+		else if (map == 2)
+			flags = OpModRM;
+		else if (map == 3)
+			flags = OpModRM|OpImm8;
+		else
+			return 0;
+	} else if (opcode == 0x8F && curr < end && (*curr & 0x38) != 0) {
+		// XOP
+		return 0;
+	} else {
+		flags = opcodeMap[opcode];
+	}
+	
+	if (flags & OpUnknown)
+		return 0;
+	
+	// near branch operand size with an override differs between vendors
+	if (operand16 && (opcode == 0xE8 || opcode == 0xE9 || (curr[-2] == 0x0F && (opcode & 0xF0) == 0x80)))
+		return 0;
+	
+	size_t imm {0};
+	if (flags & OpImm8)
+		imm += sizeof(uint8_t);
+	if (flags & OpImm16)
+		imm += sizeof(uint16_t);
+	if (flags & (OpImmZ|OpImmV))
+		imm += (flags & OpImmV) && rexW ? sizeof(uint64_t) : operand16 && !rexW ? sizeof(uint16_t) : sizeof(uint32_t);
+	if (flags & OpMoffs)
+		imm += address32 ? sizeof(uint32_t) : sizeof(uint64_t);
+	
+	if (flags & OpModRM) {
+		if (curr >= end)
+			return 0;
+		uint8_t modrm = *curr++;
+		uint8_t mod = modrm >> 6, reg = (modrm >> 3) & 7, rm = modrm & 7;
+		
+		if ((flags & OpGroup) && reg > 1)
+			imm = 0;
+		
+		if (mod != 3 && !forceRegister) {
+			if (rm == 4) {
+				if (curr >= end)
+					return 0;
+				// SIB with no base
+				if (mod == 0 && (*curr & 7) == 5)
+					curr += sizeof(uint32_t);
+				curr++;
+			} else if (mod == 0 && rm == 5) {
+				// RIP-relative
+				curr += sizeof(uint32_t);
+			}
+			
+			if (mod == 1)
+				curr += sizeof(uint8_t);
+			else if (mod == 2)
+				curr += sizeof(uint32_t);
+		}
+	}
+	
+	curr += imm;
+	if (curr > end)
+		return 0;
+	
+	return curr - ptr;
+}
+
+size_t Disassembler::quickInstructionSize(mach_vm_address_t addr, size_t min) {
+	auto ptr = reinterpret_cast<const uint8_t *>(addr);
+	size_t size {0};
+	
+	while (size < min) {
+		size_t len = instructionLength(ptr + size);
+		if (!len)
+			return 0;
+		size += len;
+	}
+	
+	return size;
+}
@@ -8,6 +8,8 @@
 #ifndef kern_disasm_hpp
 #define kern_disasm_hpp
 
+#include <mach/mach_types.h>
+
 #include <capstone.h>
 
 class Disassembler {
@@ -20,11 +22,46 @@ class Disassembler {
 	 *  Internal capstone handle
 	 */
 	csh handle;
+	
+	/**
+	 *  Instruction buffer reused by every decoding call
+	 */
+	cs_insn *insn {nullptr};
 
 	/**
 	 *  Max instruction size
 	 */
 	static constexpr size_t MaxInstruction {15};
+	
+	/**
+	 *  Opcode table flags for the length decoder
+	 */
+	enum OpcodeFlags : uint8_t {
+		OpNone    = 0,
+		OpModRM   = 1,   // ModRM byte (and SIB, displacement) follows
+		OpImm8    = 2,   // 8-bit immediate
+		OpImmZ    = 4,   // 16-bit with operand size override, 32-bit otherwise
+		OpImm16   = 8,   // 16-bit immediate
+		OpImmV    = 16,  // OpImmZ, but 64-bit with REX.W
+		OpMoffs   = 32,  // 64-bit address, 32-bit with address size override
+		OpGroup   = 64,  // immediate is only present for /0 and /1
+		OpUnknown = 128  // invalid or not supported by the decoder
+	};
+	
+	/**
+	 *  One-byte, 0F, 0F 38 and 0F 3A opcode maps
+	 */
+	static const uint8_t opcodeMap[256];
+	static const uint8_t opcodeMap0F[256];
+	
+	/**
+	 *  Decode a single instruction length without capstone
+	 *
+	 *  @param ptr instruction pointer, MaxInstruction bytes must be readable
+	 *
+	 *  @return instruction length or 0 if it cannot be decoded
+	 */
+	static size_t instructionLength(const uint8_t *ptr);
 public:
 
 	/**
@@ -50,6 +87,17 @@ public:
 	 *  @return instruction size >= min on success or 0
 	 */
 	size_t instructionSize(mach_vm_address_t ptr, size_t min);
+	
+	/**
+	 *  Return the real instruction size contained within min bytes with a table-driven decoder,
+	 *  which needs no initialisation and does not allocate
+	 *
+	 *  @param ptr instruction pointer
+	 *  @param min minimal possible size
+	 *
+	 *  @return instruction size >= min on success or 0 if capstone should be used instead
+	 */
+	static size_t quickInstructionSize(mach_vm_address_t ptr, size_t min);
 };
 
 #endif /* kern_disasm_hpp */
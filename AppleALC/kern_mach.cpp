@@ -9,6 +9,7 @@
 
 #include "kern_mach.hpp"
 #include "kern_compression.hpp"
+#include "kern_symcache.hpp"
 #include "kern_util.hpp"
 
 #include <sys/malloc.h>
@@ -20,11 +21,17 @@
 #include <mach-o/nlist.h>
 #include <mach/vm_param.h>
 #include <i386/proc_reg.h>
+#include <kern/clock.h>
 #include <kern/thread.h>
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSString.h>
+#include <libkern/c++/OSUnserialize.h>
 
 extern proc_t kernproc;
 
-kern_return_t MachInfo::init(const char * const paths[], size_t num) {
+kern_return_t MachInfo::init(const char * const paths[], size_t num, bool prelinked, const char *cache) {
     kern_return_t error = KERN_FAILURE;
   
     // Check if we have a proper credential, prevents a race-condition panic on 10.11.4 Beta
@@ -41,6 +48,7 @@ kern_return_t MachInfo::init(const char * const paths[], size_t num) {
 		SYSLOG("mach @ can't allocate header memory.");
 		return error;
 	}
+	accountMemory(HeaderSize);
 	
 	vnode_t vnode = NULLVP;
 	vfs_context_t ctxt = nullptr;
@@ -52,12 +60,25 @@ kern_return_t MachInfo::init(const char * const paths[], size_t num) {
 		
 		errno_t err = vnode_lookup(paths[i], 0, &vnode, ctxt);
 		if(!err) {
+#ifdef DEBUG
+			size_t probed = read_size;
+#endif
 			kern_return_t readError = readMachHeader(machHeader, vnode, ctxt);
-			if(readError == KERN_SUCCESS) {
-				if(isKernel && !isCurrentKernel(machHeader)) {
+#ifdef DEBUG
+			DBGLOG("mach @ probing %s read %zu bytes", paths[i], read_size - probed);
+#endif
+			if(readError == KERN_SUCCESS && !indexLoadCommands(machHeader, HeaderSize, header_index)) {
+				SYSLOG("mach @ %s has malformed load commands", paths[i]);
+				freeFileBuffer();
+				vnode_put(vnode);
+			} else if(readError == KERN_SUCCESS) {
+				if(isKernel && !isCurrentKernel()) {
+					// Do not keep decompressed data of a wrong kernel
+					freeFileBuffer();
 					vnode_put(vnode);
 				} else {
 					DBGLOG("mach @ Found executable at path: %s", paths[i]);
+					binary_path = paths[i];
 					found = true;
 					break;
 				}
@@ -70,15 +91,27 @@ kern_return_t MachInfo::init(const char * const paths[], size_t num) {
 	if(!found) {
 		DBGLOG("mach @ couldn't find a suitable executable");
 		Buffer::deleter(machHeader);
+		accountMemory(0, HeaderSize);
 		return error;
 	}
 	
-	processMachHeader(machHeader);
-	if (linkedit_fileoff && symboltable_fileoff) {
+	processMachHeader();
+	if (prelinked) {
+		// read the prelinked kexts to serve them from memory
+		error = readPrelinked(vnode, ctxt);
+		if (error != KERN_SUCCESS) {
+			SYSLOG("mach @ could not read the prelinked image");
+		}
+	} else if (cache && readSymbolCache(cache) == KERN_SUCCESS) {
+		// the cache was made for this very binary, no need to touch the symbol table
+		error = KERN_SUCCESS;
+	} else if (linkedit_fileoff && symboltable_fileoff) {
 		// read linkedit from filesystem
 		error = readLinkedit(vnode, ctxt);
 		if (error != KERN_SUCCESS) {
 			SYSLOG("mach @ could not read the linkedit segment");
+		} else {
+			buildSymbolIndex();
 		}
 	} else {
 		SYSLOG("mach @ couldn't find the necessary mach segments or sections (linkedit %llX, sym %X)",
@@ -90,46 +123,223 @@ kern_return_t MachInfo::init(const char * const paths[], size_t num) {
 	// we must do this or the machine gets stuck on shutdown/reboot
 	vnode_put(vnode);
 	
-	// We do not need the whole file buffer anymore
+	// We do not need the whole file buffer anymore unless it is a prelinked image
+	if (!prelinked || error != KERN_SUCCESS)
+		freeFileBuffer();
+	
+	Buffer::deleter(machHeader);
+	accountMemory(0, HeaderSize);
+	
+	DBGLOG("mach @ read %zu bytes from the filesystem in total", read_size);
+	DBGLOG("mach @ peak memory usage %zu bytes, %zu bytes stay resident", memory_peak, memory_used);
+	
+	return error;
+}
+
+void MachInfo::freeFileBuffer() {
 	if (file_buf) {
 		Buffer::deleter(file_buf);
+		accountMemory(0, file_buf_size);
 		file_buf = nullptr;
+		file_buf_size = 0;
 	}
 	
-	Buffer::deleter(machHeader);
+	freeCompressedBuffer();
+}
+
+void MachInfo::freeCompressedBuffer() {
+	if (compressed_buf) {
+		Buffer::deleter(compressed_buf);
+		accountMemory(0, compressed_size);
+		compressed_buf = nullptr;
+		compressed_size = 0;
+	}
+}
+
+bool MachInfo::decompressFileBuffer(size_t size) {
+	if (!compressed_buf || size > decompressed_size) {
+		SYSLOG("mach @ cannot decompress %zu bytes out of %u", size, decompressed_size);
+		return false;
+	}
 	
-	return error;
+	DBGLOG("mach @ decompressing %zu bytes out of %u bytes with %X compression mode", size, decompressed_size, compression_type);
+	
+	file_buf = decompressData(compression_type, static_cast<uint32_t>(size), compressed_buf, compressed_size);
+	if (!file_buf)
+		return false;
+	
+	file_buf_size = size;
+	accountMemory(file_buf_size);
+	return true;
+}
+
+kern_return_t MachInfo::initFromPrelinked(MachInfo *prelink, const char *id) {
+	mach_vm_address_t addr {0};
+	size_t size {0};
+	if (!prelink || !prelink->findPrelinkedKext(id, addr, size)) {
+		DBGLOG("mach @ %s executable is not present in the prelinked image", id);
+		return KERN_FAILURE;
+	}
+	
+	// the load commands locate the tables, only they are copied
+	auto header = Buffer::create<uint8_t>(HeaderSize);
+	if (!header) {
+		SYSLOG("mach @ can't allocate header memory.");
+		return KERN_FAILURE;
+	}
+	accountMemory(HeaderSize);
+	
+	PrelinkedRange headerRange {addr, size < HeaderSize ? size : HeaderSize, header};
+	bool indexed = prelink->copyPrelinked(&headerRange, 1) == KERN_SUCCESS &&
+		indexLoadCommands(header, headerRange.size, header_index);
+	Buffer::deleter(header);
+	accountMemory(0, HeaderSize);
+	
+	if (!indexed) {
+		SYSLOG("mach @ prelinked %s has an invalid mach header", id);
+		return KERN_FAILURE;
+	}
+	
+	processMachHeader();
+	
+	if (!header_index.hasUUID) {
+		SYSLOG("mach @ prelinked %s has no uuid", id);
+		return KERN_FAILURE;
+	}
+	prelinked_kext = true;
+	
+	// prelinked kext tables are addressed by __LINKEDIT vm address
+	uint64_t symbolSize = static_cast<uint64_t>(symboltable_nr_symbols) * sizeof(nlist_64);
+	if (!linkedit_vmaddr || symboltable_fileoff < linkedit_fileoff || stringtable_fileoff < linkedit_fileoff) {
+		SYSLOG("mach @ prelinked %s has no usable symbol table", id);
+		return KERN_FAILURE;
+	}
+	
+	linkedit_buf = Buffer::create<uint8_t>(symbolSize + stringtable_size);
+	if (!linkedit_buf) {
+		SYSLOG("mach @ Could not allocate enough memory (%lld) for prelinked %s tables", symbolSize + stringtable_size, id);
+		return KERN_FAILURE;
+	}
+	accountMemory(symbolSize + stringtable_size);
+	
+	PrelinkedRange tables[] {
+		{linkedit_vmaddr + (symboltable_fileoff - linkedit_fileoff), symbolSize, linkedit_buf},
+		{linkedit_vmaddr + (stringtable_fileoff - linkedit_fileoff), stringtable_size, linkedit_buf+symbolSize}
+	};
+	if (prelink->copyPrelinked(tables, arrsize(tables)) != KERN_SUCCESS) {
+		SYSLOG("mach @ prelinked %s symbol tables are out of the prelinked image", id);
+		Buffer::deleter(linkedit_buf);
+		accountMemory(0, symbolSize + stringtable_size);
+		linkedit_buf = nullptr;
+		return KERN_FAILURE;
+	}
+	
+	symbol_table = reinterpret_cast<nlist_64 *>(linkedit_buf);
+	string_table = reinterpret_cast<char *>(linkedit_buf+symbolSize);
+	
+	buildSymbolIndex();
+	
+	DBGLOG("mach @ loaded %s from the prelinked image with %u symbols", id, symboltable_nr_symbols);
+	
+	return KERN_SUCCESS;
 }
 
 void MachInfo::deinit() {
+	if (prelink_info) {
+		prelink_info->release();
+		prelink_info = nullptr;
+	}
+	
+	freeFileBuffer();
+	
 	if (linkedit_buf) {
 		Buffer::deleter(linkedit_buf);
 		linkedit_buf = nullptr;
+		symbol_table = nullptr;
+		string_table = nullptr;
+		symbol_cache_used = false;
 	}
+	
+	if (symbol_index) {
+		Buffer::deleter(symbol_index);
+		symbol_index = nullptr;
+		symbol_index_mask = 0;
+	}
+	
+	// every buffer is released
+	accountMemory(0, memory_used);
 }
 
-mach_vm_address_t MachInfo::findKernelBase() {
-	// calculate the address of the int80 handler
-	mach_vm_address_t tmp = calculateInt80Address();
+mach_vm_address_t MachInfo::lookupBaseBytewise(mach_vm_address_t start, size_t window, size_t &probes) {
+	mach_vm_address_t tmp = start;
 	
 	// search backwards for the kernel base address (mach-o header)
-	segment_command_64 *segmentCommand;
-	while (tmp > 0) {
+	while (tmp > 0 && (!window || start - tmp <= window)) {
+		probes++;
 		if (*(uint32_t*)(tmp) == MH_MAGIC_64) {
 			// make sure it's the header and not some reference to the MAGIC number
-			segmentCommand = reinterpret_cast<segment_command_64 *>(tmp + sizeof(mach_header_64));
-			if (strncmp(segmentCommand->segname, "__TEXT", 16) == 0) {
-				DBGLOG("mach @ Found kernel mach-o header address at %p", (void*)(tmp));
+			auto segmentCommand = reinterpret_cast<segment_command_64 *>(tmp + sizeof(mach_header_64));
+			if (strncmp(segmentCommand->segname, "__TEXT", 16) == 0)
 				return tmp;
-			}
 		}
 		// overflow check
 		if (tmp - 1 > tmp) break;
 		tmp--;
 	}
+	
 	return 0;
 }
 
+mach_vm_address_t MachInfo::lookupBasePagewise(mach_vm_address_t start, size_t window, size_t &probes) {
+	mach_vm_address_t tmp = start & ~PAGE_MASK_64;
+	
+	// the header is page aligned, so only the page starts are checked
+	while (tmp > 0 && (!window || start - tmp <= window)) {
+		probes++;
+		if (*(uint32_t*)(tmp) == MH_MAGIC_64) {
+			auto segmentCommand = reinterpret_cast<segment_command_64 *>(tmp + sizeof(mach_header_64));
+			if (strncmp(segmentCommand->segname, "__TEXT", 16) == 0)
+				return tmp;
+		}
+		// overflow check
+		if (tmp - PAGE_SIZE_64 > tmp) break;
+		tmp -= PAGE_SIZE_64;
+	}
+	
+	return 0;
+}
+
+void MachInfo::setBaseLookup(t_baseLookup lookup, size_t window) {
+	base_lookup = lookup;
+	base_lookup_window = window;
+	kernel_base = 0;
+}
+
+mach_vm_address_t MachInfo::findKernelBase() {
+	if (kernel_base)
+		return kernel_base;
+	
+	// calculate the address of the int80 handler
+	mach_vm_address_t start = calculateInt80Address();
+	
+	size_t probes {0};
+#ifdef DEBUG
+	uint64_t begin = mach_absolute_time();
+#endif
+	kernel_base = (base_lookup ? base_lookup : lookupBasePagewise)(start, base_lookup_window, probes);
+	
+	if (kernel_base)
+		DBGLOG("mach @ Found kernel mach-o header address at %p", (void*)(kernel_base));
+#ifdef DEBUG
+	// the lookup is only timed for the log
+	uint64_t nanoseconds {0};
+	absolutetime_to_nanoseconds(mach_absolute_time() - begin, &nanoseconds);
+	DBGLOG("mach @ kernel base lookup took %zu probes and %llu ns", probes, nanoseconds);
+#endif
+	
+	return kernel_base;
+}
+
 kern_return_t MachInfo::setKernelWriting(bool enable) {
 	kern_return_t res = KERN_SUCCESS;
 	if (enable) __asm__ volatile("cli"); // disable interrupts
@@ -143,12 +353,32 @@ kern_return_t MachInfo::setKernelWriting(bool enable) {
 }
 
 mach_vm_address_t MachInfo::solveSymbol(const char *symbol) {
+	mach_vm_address_t address {0};
+	solveSymbols(&symbol, 1, &address);
+	return address;
+}
+
+size_t MachInfo::solveSymbols(const char * const symbols[], size_t num, mach_vm_address_t addresses[]) {
+	size_t found = solveLoadedSymbols(symbols, num, addresses);
+	
+	// the symbol table is not read here, solving may happen while kexts are being loaded
+	if (found < num && symbol_cache_used)
+		SYSLOG("mach @ %zu of %zu symbols are missing from the symbol cache of %s, it should be regenerated",
+			   num - found, num, binary_path ? binary_path : "a binary");
+	
+	return found;
+}
+
+size_t MachInfo::solveLoadedSymbols(const char * const symbols[], size_t num, mach_vm_address_t addresses[]) {
+	for (size_t s = 0; s < num; s++)
+		addresses[s] = 0;
+
 	if (!linkedit_buf) {
 		SYSLOG("mach @ no loaded linkedit buffer found");
 		return 0;
 	}
 	
-	if (!symboltable_fileoff) {
+	if (!symbol_table || !string_table) {
 		SYSLOG("mach @ no symtable offsets found");
 		return 0;
 	}
@@ -158,33 +388,103 @@ mach_vm_address_t MachInfo::solveSymbol(const char *symbol) {
 		return 0;
 	}
 	
-	// symbols and strings offsets into LINKEDIT
-	// we just read the __LINKEDIT but fileoff values are relative to the full /mach_kernel
-	// subtract the base of LINKEDIT to fix the value into our buffer
-	uint64_t symbolOff = symboltable_fileoff - (linkedit_fileoff);
-	if (symbolOff > symboltable_fileoff) return 0;
-	uint64_t stringOff = stringtable_fileoff - (linkedit_fileoff);
-	if (stringOff > stringtable_fileoff) return 0;
-	
 	nlist_64 *nlist64 = NULL;
-	// search for the symbol and get its location if found
-	for (uint32_t i = 0; i < symboltable_nr_symbols; i++) {
+	size_t found {0};
+	
+	if (symbol_index) {
+		for (size_t s = 0; s < num; s++) {
+			// probe the index, equal names keep their symbol table order within a probe sequence
+			for (uint32_t i = symbolHash(symbols[s], strlen(symbols[s])) & symbol_index_mask; symbol_index[i]; i = (i + 1) & symbol_index_mask) {
+				nlist64 = &symbol_table[symbol_index[i] - 1];
+				if (symbolEquals(symbols[s], nlist64->n_un.n_strx)) {
+					DBGLOG("mach @ Found indexed symbol %s at 0x%llx (non-aslr 0x%llx)", symbols[s], nlist64->n_value + kaslr_slide, nlist64->n_value);
+					addresses[s] = nlist64->n_value + kaslr_slide;
+					found++;
+					break;
+				}
+			}
+		}
+		return found;
+	}
+	
+	// search for the symbols in a single pass and stop once all of them are found
+	for (uint32_t i = 0; i < symboltable_nr_symbols && found < num; i++) {
 		// get the pointer to the symbol entry and extract its symbol string
-		nlist64 = (nlist_64*)(linkedit_buf + symbolOff + i * sizeof(nlist_64));
-		char *symbolStr = reinterpret_cast<char *>(linkedit_buf + stringOff + nlist64->n_un.n_strx);
-		// find if symbol matches
-		if (strncmp(symbol, symbolStr, strlen(symbol)+1) == 0) {
-			DBGLOG("mach @ Found symbol %s at 0x%llx (non-aslr 0x%llx)", symbol, nlist64->n_value + kaslr_slide, nlist64->n_value);
-			// the symbol values are without kernel ASLR so we need to add it
-			return nlist64->n_value + kaslr_slide;
+		nlist64 = &symbol_table[i];
+		if (nlist64->n_un.n_strx >= stringtable_size)
+			continue;
+		// solve every unsolved symbol that matches, a name may be requested more than once
+		for (size_t s = 0; s < num; s++) {
+			if (!addresses[s] && symbolEquals(symbols[s], nlist64->n_un.n_strx)) {
+				DBGLOG("mach @ Found symbol %s at 0x%llx (non-aslr 0x%llx)", symbols[s], nlist64->n_value + kaslr_slide, nlist64->n_value);
+				// the symbol values are without kernel ASLR so we need to add it
+				addresses[s] = nlist64->n_value + kaslr_slide;
+				found++;
+			}
 		}
 	}
-	// failure
-	return 0;
+	
+	return found;
+}
+
+uint32_t MachInfo::symbolHash(const char *symbol, size_t size) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < size && symbol[i]; i++) {
+		hash ^= static_cast<uint8_t>(symbol[i]);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+bool MachInfo::symbolEquals(const char *symbol, uint32_t strx) {
+	if (strx >= stringtable_size)
+		return false;
+	
+	// the last string may lack its terminator, such a name never matches
+	auto symbolStr = string_table + strx;
+	size_t left = stringtable_size - strx;
+	return strncmp(symbol, symbolStr, left) == 0 && memchr(symbolStr, '\0', left);
+}
+
+void MachInfo::buildSymbolIndex() {
+	if (lowMemory) {
+		DBGLOG("mach @ symbol index disabled due to low memory flag");
+		return;
+	}
+	
+	// keep the load factor below 1/2 so that probe sequences stay short
+	uint32_t slots = 1;
+	while (slots < symboltable_nr_symbols * 2 && slots < (1U << 31))
+		slots <<= 1;
+	
+	symbol_index = Buffer::create<uint32_t>(slots);
+	if (!symbol_index) {
+		SYSLOG("mach @ failed to allocate %u slot symbol index", slots);
+		return;
+	}
+	accountMemory(slots * sizeof(uint32_t));
+	
+	memset(symbol_index, 0, slots * sizeof(uint32_t));
+	symbol_index_mask = slots - 1;
+	
+	for (uint32_t i = 0; i < symboltable_nr_symbols; i++) {
+		uint32_t strx = symbol_table[i].n_un.n_strx;
+		if (strx == 0 || strx >= stringtable_size)
+			continue;
+		
+		uint32_t slot = symbolHash(string_table + strx, stringtable_size - strx) & symbol_index_mask;
+		while (symbol_index[slot])
+			slot = (slot + 1) & symbol_index_mask;
+		symbol_index[slot] = i + 1;
+	}
+	
+	DBGLOG("mach @ built symbol index of %u slots for %u symbols", slots, symboltable_nr_symbols);
 }
 
 int MachInfo::readFileData(void *buffer, off_t off, size_t sz, vnode_t vnode, vfs_context_t ctxt) {
 	int error = 0;
+	
+	read_size += sz;
 
 	uio_t uio = uio_create(1, off, UIO_SYSSPACE, UIO_READ);
 	if (!uio) {
@@ -223,123 +523,567 @@ size_t MachInfo::readFileSize(vnode_t vnode, vfs_context_t ctxt) {
 }
 
 kern_return_t MachInfo::readMachHeader(uint8_t *buffer, vnode_t vnode, vfs_context_t ctxt, off_t off) {
-	int error = readFileData(buffer, off, HeaderSize, vnode, ctxt);
+	// slice size is only known from a fat header
+	if (off == 0)
+		fat_size = 0;
+	
+	// read the smallest prefix first, the rest depends on the header kind
+	int error = readFileData(buffer, off, ProbeSize, vnode, ctxt);
 	if (error) {
 		SYSLOG("mach @ mach header read failed with %d error", error);
 		return KERN_FAILURE;
 	}
 	
-	while (1) {
-		auto magic = *reinterpret_cast<uint32_t *>(buffer);
-		switch (magic) {
-			case MH_MAGIC_64:
-				fat_offset = off;
-				return KERN_SUCCESS;
-			case FAT_MAGIC: {
-				uint32_t num = _OSSwapInt32(reinterpret_cast<fat_header *>(buffer)->nfat_arch);
-				for (uint32_t i = 0; i < num; i++) {
-					auto arch = reinterpret_cast<fat_arch *>(buffer + i*sizeof(fat_arch) + sizeof(fat_header));
-					if (_OSSwapInt32(arch->cputype) == CPU_TYPE_X86_64)
-						return readMachHeader(buffer, vnode, ctxt, _OSSwapInt32(arch->offset));
+	auto magic = *reinterpret_cast<uint32_t *>(buffer);
+	switch (magic) {
+		case MH_MAGIC_64: {
+			// load commands is all we need from the header
+			auto mh = reinterpret_cast<mach_header_64 *>(buffer);
+			if (mh->sizeofcmds > HeaderSize - sizeof(mach_header_64)) {
+				SYSLOG("mach @ mach header has too large load commands (%u)", mh->sizeofcmds);
+				return KERN_FAILURE;
+			}
+			
+			size_t size = sizeof(mach_header_64) + mh->sizeofcmds;
+			if (size > ProbeSize) {
+				error = readFileData(buffer + ProbeSize, off + ProbeSize, size - ProbeSize, vnode, ctxt);
+				if (error) {
+					SYSLOG("mach @ load commands read failed with %d error", error);
+					return KERN_FAILURE;
+				}
+			}
+			
+			fat_offset = off;
+			return KERN_SUCCESS;
+		}
+		case FAT_CIGAM: { // fat headers are big endian
+			uint32_t num = _OSSwapInt32(reinterpret_cast<fat_header *>(buffer)->nfat_arch);
+			if (num > (ProbeSize - sizeof(fat_header)) / sizeof(fat_arch)) {
+				SYSLOG("mach @ fat header has too many architectures (%u)", num);
+				return KERN_FAILURE;
+			}
+			
+			for (uint32_t i = 0; i < num; i++) {
+				auto arch = reinterpret_cast<fat_arch *>(buffer + i*sizeof(fat_arch) + sizeof(fat_header));
+				if (_OSSwapInt32(arch->cputype) == CPU_TYPE_X86_64) {
+					fat_size = _OSSwapInt32(arch->size);
+					return readMachHeader(buffer, vnode, ctxt, _OSSwapInt32(arch->offset));
 				}
-				SYSLOG("mach @ failed to find a x86_64 mach");
+			}
+			SYSLOG("mach @ failed to find a x86_64 mach");
+			return KERN_FAILURE;
+		}
+		case CompressedMagic: { // comp
+			// header will be overwritten by the decompressed data
+			auto header = reinterpret_cast<CompressedHeader *>(buffer);
+			uint32_t compression = header->compression;
+			uint32_t compressed = _OSSwapInt32(header->compressed);
+			uint32_t decompressed = _OSSwapInt32(header->decompressed);
+			off_t dataoff = off + sizeof(CompressedHeader);
+			
+			if (decompressed < HeaderSize) {
+				SYSLOG("mach @ compressed binary is too small (%u)", decompressed);
 				return KERN_FAILURE;
 			}
-			case CompressedMagic: { // comp
-				auto header = reinterpret_cast<CompressedHeader *>(buffer);
-				auto compressedBuf = Buffer::create<uint8_t>(_OSSwapInt32(header->compressed));
+			
+			// Only a prefix is necessary to decode the header, the rest is read once the binary is chosen
+			uint32_t prefix = compressed < ProbeCompressedSize ? compressed : ProbeCompressedSize;
+			for (uint32_t size = prefix; ; size = compressed) {
+				auto compressedBuf = Buffer::create<uint8_t>(size);
 				if (!compressedBuf) {
 					SYSLOG("mach @ failed to allocate memory for reading mach binary");
-				} else if (readFileData(compressedBuf, off+sizeof(CompressedHeader), _OSSwapInt32(header->compressed),
-										vnode, ctxt) != KERN_SUCCESS) {
+					return KERN_FAILURE;
+				}
+				accountMemory(size);
+				
+				DBGLOG("mach @ decompressing header from %u out of %u bytes (estimated %u bytes) with %X compression mode",
+					   size, compressed, decompressed, compression);
+				
+				if (readFileData(compressedBuf, dataoff, size, vnode, ctxt) != KERN_SUCCESS) {
 					SYSLOG("mach @ failed to read compressed binary");
-				} else {
-					DBGLOG("mach @ decompressing %d bytes (estimated %d bytes) with %X compression mode",
-						   _OSSwapInt32(header->compressed), _OSSwapInt32(header->decompressed), header->compression);
-					file_buf = decompressData(header->compression, _OSSwapInt32(header->decompressed),
-											  compressedBuf, _OSSwapInt32(header->compressed));
-					
-					// Try again
-					if (file_buf) {
-						memcpy(buffer, file_buf, HeaderSize);
-						Buffer::deleter(compressedBuf);
-						continue;
-					}
+				} else if (decompressData(compression, HeaderSize, compressedBuf, size, buffer) &&
+						   *reinterpret_cast<uint32_t *>(buffer) == MH_MAGIC_64) {
+					compressed_buf = compressedBuf;
+					compressed_size = size;
+					compressed_file_size = compressed;
+					compressed_fileoff = dataoff;
+					compression_type = compression;
+					decompressed_size = decompressed;
+					fat_offset = off;
+					return KERN_SUCCESS;
 				}
 				
 				Buffer::deleter(compressedBuf);
-				return KERN_FAILURE;
+				accountMemory(0, size);
+				
+				// the prefix may be insufficient for a poorly compressed header
+				if (size == compressed)
+					return KERN_FAILURE;
 			}
+		}
+		
+		default:
+			SYSLOG("mach @ read mach has unsupported %X magic", magic);
+			return KERN_FAILURE;
+	}
+}
+
+bool MachInfo::readCompressedData(vnode_t vnode, vfs_context_t ctxt) {
+	if (!compressed_buf || compressed_size == compressed_file_size)
+		return compressed_buf != nullptr;
+	
+	auto compressedBuf = Buffer::create<uint8_t>(compressed_file_size);
+	if (!compressedBuf) {
+		SYSLOG("mach @ failed to allocate %u bytes for compressed data", compressed_file_size);
+		return false;
+	}
+	accountMemory(compressed_file_size);
+	
+	if (readFileData(compressedBuf, compressed_fileoff, compressed_file_size, vnode, ctxt) != KERN_SUCCESS) {
+		SYSLOG("mach @ failed to read compressed data");
+		Buffer::deleter(compressedBuf);
+		accountMemory(0, compressed_file_size);
+		return false;
+	}
+	
+	freeCompressedBuffer();
+	compressed_buf = compressedBuf;
+	compressed_size = compressed_file_size;
+	return true;
+}
+
+kern_return_t MachInfo::readPrelinked(vnode_t vnode, vfs_context_t ctxt) {
+	// only the kext plist is parsed now, the kext executables are copied out on demand
+	auto sect = header_index.findSection("__PRELINK_INFO", "__info");
+	auto text = header_index.findSegment("__PRELINK_TEXT");
+	if (!sect || sect->size == 0 || !text || text->filesize == 0) {
+		SYSLOG("mach @ prelinked image has no __PRELINK_INFO or __PRELINK_TEXT");
+		return KERN_FAILURE;
+	}
+	
+	uint64_t infoEnd = static_cast<uint64_t>(sect->offset) + sect->size;
+	uint64_t textEnd = text->fileoff + text->filesize;
+	uint8_t *infoBuf {nullptr};
+	const char *info {nullptr};
+	
+	if (compressed_buf) {
+		// __LINKEDIT and anything else past the prelinked data is never decoded
+		uint64_t end = infoEnd > textEnd ? infoEnd : textEnd;
+		if (end > PrelinkedMaxDecoded) {
+			SYSLOG("mach @ prelinked image needs %llu decoded bytes, more than %zu allowed", end, PrelinkedMaxDecoded);
+			return KERN_FAILURE;
+		}
+		bool decompressed = end <= decompressed_size && readCompressedData(vnode, ctxt) && decompressFileBuffer(end);
+		freeCompressedBuffer();
+		
+		if (!decompressed) {
+			SYSLOG("mach @ failed to decompress the prelinked image up to %llu bytes", end);
+			return KERN_FAILURE;
+		}
+		
+		info = reinterpret_cast<const char *>(file_buf + sect->offset);
+	} else {
+		uint64_t size = fat_size ? fat_size : readFileSize(vnode, ctxt);
+		if (infoEnd > size || textEnd > size) {
+			SYSLOG("mach @ prelinked data is out of the image bounds (%llu)", size);
+			return KERN_FAILURE;
+		}
+		
+		infoBuf = Buffer::create<uint8_t>(sect->size);
+		if (!infoBuf) {
+			SYSLOG("mach @ Could not allocate enough memory (%llu) for __PRELINK_INFO", sect->size);
+			return KERN_FAILURE;
+		}
+		accountMemory(sect->size);
+		
+		int error = readFileData(infoBuf, fat_offset + sect->offset, sect->size, vnode, ctxt);
+		if (error) {
+			SYSLOG("mach @ __PRELINK_INFO read failed with %d error", error);
+		} else {
+			info = reinterpret_cast<const char *>(infoBuf);
+		}
+	}
+	
+	if (info && memchr(info, 0, sect->size)) {
+		auto obj = OSUnserializeXML(info);
+		prelink_info = OSDynamicCast(OSDictionary, obj);
+		if (!prelink_info && obj)
+			obj->release();
+	}
+	
+	if (infoBuf) {
+		Buffer::deleter(infoBuf);
+		accountMemory(0, sect->size);
+	}
+	
+	if (!prelink_info) {
+		SYSLOG("mach @ failed to parse __PRELINK_INFO");
+		return KERN_FAILURE;
+	}
+	
+	// plain images are read on demand, decoded data is kept as is, copying __PRELINK_TEXT out would double the peak
+	DBGLOG("mach @ loaded %zu bytes of prelinked image", file_buf_size);
+	
+	return KERN_SUCCESS;
+}
+
+kern_return_t MachInfo::copyPrelinked(const PrelinkedRange ranges[], size_t num) {
+	auto text = header_index.findSegment("__PRELINK_TEXT");
+	if (!prelink_info || !text)
+		return KERN_FAILURE;
+	
+	// validate every range before touching the file
+	for (size_t i = 0; i < num; i++) {
+		auto &range = ranges[i];
+		if (range.addr < text->vmaddr || range.size > text->filesize || range.addr - text->vmaddr > text->filesize - range.size) {
+			DBGLOG("mach @ prelinked range %llX of %zu bytes is out of __PRELINK_TEXT", range.addr, range.size);
+			return KERN_FAILURE;
+		}
+		if (file_buf && text->fileoff + (range.addr - text->vmaddr) + range.size > file_buf_size)
+			return KERN_FAILURE;
+	}
+	
+	if (file_buf) {
+		for (size_t i = 0; i < num; i++)
+			memcpy(ranges[i].dst, file_buf + text->fileoff + (ranges[i].addr - text->vmaddr), ranges[i].size);
+		return KERN_SUCCESS;
+	}
+	
+	vnode_t vnode = NULLVP;
+	vfs_context_t ctxt = vfs_context_create(nullptr);
+	if (!binary_path || vnode_lookup(binary_path, 0, &vnode, ctxt)) {
+		SYSLOG("mach @ cannot open the prelinked image to read a kext");
+		vfs_context_rele(ctxt);
+		return KERN_FAILURE;
+	}
+	
+	kern_return_t error = KERN_SUCCESS;
+	for (size_t i = 0; i < num && error == KERN_SUCCESS; i++) {
+		auto &range = ranges[i];
+		if (readFileData(range.dst, fat_offset + text->fileoff + (range.addr - text->vmaddr), range.size, vnode, ctxt)) {
+			SYSLOG("mach @ failed to read %zu bytes of a prelinked kext", range.size);
+			error = KERN_FAILURE;
+		}
+	}
+	
+	vfs_context_rele(ctxt);
+	vnode_put(vnode);
+	
+	return error;
+}
+
+bool MachInfo::findPrelinkedKext(const char *id, mach_vm_address_t &addr, size_t &size) {
+	if (!prelink_info)
+		return false;
+	
+	auto kexts = OSDynamicCast(OSArray, prelink_info->getObject("_PrelinkInfoDictionary"));
+	if (!kexts) {
+		SYSLOG("mach @ prelinked image has no kext list");
+		return false;
+	}
+	
+	for (unsigned int i = 0, num = kexts->getCount(); i < num; i++) {
+		auto kext = OSDynamicCast(OSDictionary, kexts->getObject(i));
+		if (!kext)
+			continue;
+		
+		auto kextId = OSDynamicCast(OSString, kext->getObject("CFBundleIdentifier"));
+		if (!kextId || !kextId->isEqualTo(id))
+			continue;
+		
+		auto source = OSDynamicCast(OSNumber, kext->getObject("_PrelinkExecutableSourceAddr"));
+		auto execSize = OSDynamicCast(OSNumber, kext->getObject("_PrelinkExecutableSize"));
+		if (!source || !execSize) {
+			DBGLOG("mach @ prelinked %s has no executable", id);
+			return false;
+		}
+		
+		addr = source->unsigned64BitValue();
+		size = execSize->unsigned64BitValue();
+		return true;
+	}
+	
+	return false;
+}
+
+kern_return_t MachInfo::readSymbolCache(const char *path) {
+	auto uuid = header_index.hasUUID ? header_index.uuid : nullptr;
+	if (!uuid) {
+		DBGLOG("mach @ no uuid to match %s against", path);
+		return KERN_FAILURE;
+	}
+	
+	vnode_t vnode = NULLVP;
+	vfs_context_t ctxt = vfs_context_create(nullptr);
+	if (vnode_lookup(path, 0, &vnode, ctxt)) {
+		DBGLOG("mach @ no symbol cache at %s", path);
+		vfs_context_rele(ctxt);
+		return KERN_FAILURE;
+	}
+	
+	kern_return_t error = KERN_FAILURE;
+	size_t size = readFileSize(vnode, ctxt);
+	if (size < sizeof(SymbolCacheHeader) || size > SymbolCacheHeader::MaxSize) {
+		SYSLOG("mach @ symbol cache %s has invalid size %zu", path, size);
+	} else if (!(linkedit_buf = Buffer::create<uint8_t>(size))) {
+		SYSLOG("mach @ Could not allocate enough memory (%zu) for symbol cache", size);
+	} else {
+		accountMemory(size);
+		auto cacheHeader = reinterpret_cast<SymbolCacheHeader *>(linkedit_buf);
+		
+		if (readFileData(linkedit_buf, 0, size, vnode, ctxt)) {
+			SYSLOG("mach @ symbol cache %s read failed", path);
+		} else if (cacheHeader->magic != SymbolCacheHeader::Magic || cacheHeader->version != SymbolCacheHeader::Version) {
+			SYSLOG("mach @ symbol cache %s has unsupported format", path);
+		} else if (memcmp(cacheHeader->uuid, uuid, sizeof(cacheHeader->uuid)) != 0 || cacheHeader->textAddr != disk_text_addr) {
+			DBGLOG("mach @ symbol cache %s uuid or base mismatch, falling back to a full scan", path);
+		} else if (static_cast<uint64_t>(cacheHeader->count) * sizeof(nlist_64) + cacheHeader->stringsSize + sizeof(SymbolCacheHeader) != size ||
+				   cacheHeader->stringsSize == 0 || linkedit_buf[size-1] != '\0') {
+			SYSLOG("mach @ symbol cache %s is malformed", path);
+		} else {
+			auto symbols = reinterpret_cast<nlist_64 *>(linkedit_buf + sizeof(SymbolCacheHeader));
+			uint32_t valid = 0;
+			while (valid < cacheHeader->count && isSymbolInSection(symbols[valid]))
+				valid++;
 			
-			default:
-				SYSLOG("mach @ read mach has unsupported %X magic", magic);
-				return KERN_FAILURE;
+			if (valid != cacheHeader->count) {
+				SYSLOG("mach @ symbol cache %s entry %u is out of its section", path, valid);
+			} else {
+				symbol_table = symbols;
+				string_table = reinterpret_cast<char *>(symbol_table + cacheHeader->count);
+				symboltable_nr_symbols = cacheHeader->count;
+				stringtable_size = cacheHeader->stringsSize;
+				symbol_cache_used = true;
+				DBGLOG("mach @ loaded %u symbols from cache %s", symboltable_nr_symbols, path);
+				error = KERN_SUCCESS;
+			}
+		}
+		
+		if (error != KERN_SUCCESS) {
+			Buffer::deleter(linkedit_buf);
+			accountMemory(0, size);
+			linkedit_buf = nullptr;
 		}
 	}
 	
-	return KERN_FAILURE;
+	vfs_context_rele(ctxt);
+	vnode_put(vnode);
+	
+	return error;
+}
+
+bool MachInfo::isSymbolInSection(const nlist_64 &symbol) {
+	if ((symbol.n_type & N_TYPE) != N_SECT || symbol.n_sect == NO_SECT)
+		return false;
+	
+	auto sect = header_index.findSection(symbol.n_sect);
+	return sect && symbol.n_value >= sect->addr && symbol.n_value < sect->addr + sect->size;
 }
 
 kern_return_t MachInfo::readLinkedit(vnode_t vnode, vfs_context_t ctxt) {
 	// we know the location of linkedit and offsets into symbols and their strings
-	// now we need to read linkedit into a buffer so we can process it later
-	// __LINKEDIT total size is around 1MB
+	// only the symbol and string tables are necessary to solve symbols, so we read just them
+	// __LINKEDIT total size is around 1MB, while the tables take a noticeably smaller part of it
 	// we should free this buffer later when we don't need anymore to solve symbols
-	linkedit_buf = Buffer::create<uint8_t>(linkedit_size);
-	if (!linkedit_buf) {
-		SYSLOG("mach @ Could not allocate enough memory (%lld) for __LINKEDIT segment", linkedit_size);
+	uint64_t symbolSize = static_cast<uint64_t>(symboltable_nr_symbols) * sizeof(nlist_64);
+	uint64_t linkeditEnd = linkedit_fileoff + linkedit_size;
+	if (symboltable_fileoff < linkedit_fileoff || symboltable_fileoff + symbolSize > linkeditEnd ||
+		stringtable_fileoff < linkedit_fileoff || stringtable_fileoff + stringtable_size > linkeditEnd) {
+		SYSLOG("mach @ symbol (%X, %llX) or string (%X, %X) tables do not fit __LINKEDIT segment",
+			   symboltable_fileoff, symbolSize, stringtable_fileoff, stringtable_size);
 		return KERN_FAILURE;
 	}
 	
-	if (!file_buf) {
-		int error = readFileData(linkedit_buf, fat_offset+linkedit_fileoff, linkedit_size, vnode, ctxt);
+	if (compressed_buf) {
+		// decode the data up to the end of the tables and drop the compressed data
+		uint64_t symbolsEnd = symboltable_fileoff + symbolSize;
+		uint64_t stringsEnd = static_cast<uint64_t>(stringtable_fileoff) + stringtable_size;
+		bool decompressed = readCompressedData(vnode, ctxt) &&
+			decompressFileBuffer(symbolsEnd > stringsEnd ? symbolsEnd : stringsEnd);
+		freeCompressedBuffer();
+		
+		if (!decompressed) {
+			SYSLOG("mach @ failed to decompress the binary up to the linkedit tables");
+			return KERN_FAILURE;
+		}
+	}
+	
+	if (file_buf) {
+		if (stringtable_fileoff + stringtable_size > file_buf_size || symboltable_fileoff + symbolSize > file_buf_size ||
+			(symboltable_fileoff < stringtable_fileoff + stringtable_size && stringtable_fileoff < symboltable_fileoff + symbolSize)) {
+			SYSLOG("mach @ symbol or string tables are out of decompressed data bounds or overlap");
+			return KERN_FAILURE;
+		}
+		
+		// copy the tables out and drop the decompressed data, both buffers are counted in the peak
+		auto tables = Buffer::create<uint8_t>(symbolSize + stringtable_size);
+		if (tables) {
+			accountMemory(symbolSize + stringtable_size, file_buf_size);
+			memcpy(tables, file_buf+symboltable_fileoff, symbolSize);
+			memcpy(tables+symbolSize, file_buf+stringtable_fileoff, stringtable_size);
+			Buffer::deleter(file_buf);
+			linkedit_buf = tables;
+			symbol_table = reinterpret_cast<nlist_64 *>(linkedit_buf);
+			string_table = reinterpret_cast<char *>(linkedit_buf+symbolSize);
+		} else {
+			SYSLOG("mach @ failed to allocate the linkedit tables, keeping %zu bytes of decompressed data", file_buf_size);
+			linkedit_buf = file_buf;
+			symbol_table = reinterpret_cast<nlist_64 *>(linkedit_buf+symboltable_fileoff);
+			string_table = reinterpret_cast<char *>(linkedit_buf+stringtable_fileoff);
+		}
+		
+		file_buf = nullptr;
+		file_buf_size = 0;
+	} else {
+		linkedit_buf = Buffer::create<uint8_t>(symbolSize + stringtable_size);
+		if (!linkedit_buf) {
+			SYSLOG("mach @ Could not allocate enough memory (%lld) for __LINKEDIT tables", symbolSize + stringtable_size);
+			return KERN_FAILURE;
+		}
+		accountMemory(symbolSize + stringtable_size);
+		
+		int error = readFileData(linkedit_buf, fat_offset+symboltable_fileoff, symbolSize, vnode, ctxt);
+		if (!error)
+			error = readFileData(linkedit_buf+symbolSize, fat_offset+stringtable_fileoff, stringtable_size, vnode, ctxt);
 		if (error) {
 			SYSLOG("mach @ linkedit read failed with %d error", error);
 			return KERN_FAILURE;
 		}
-	} else {
-		memcpy(linkedit_buf, file_buf+linkedit_fileoff, linkedit_size);
+		
+		symbol_table = reinterpret_cast<nlist_64 *>(linkedit_buf);
+		string_table = reinterpret_cast<char *>(linkedit_buf+symbolSize);
 	}
+	
+	DBGLOG("mach @ loaded %llu bytes of symbol and string tables out of %llu bytes of __LINKEDIT",
+		   symbolSize + stringtable_size, linkedit_size);
 
 	return KERN_SUCCESS;
 }
 
-//FIXME: Guard pointer access by HeaderSize
-void MachInfo::processMachHeader(void *header) {
-	mach_header_64 *mh = static_cast<mach_header_64 *>(header);
-	size_t headerSize = sizeof(mach_header_64);
+bool MachInfo::indexLoadCommands(void *header, size_t size, LoadCommandIndex &index) {
+	index.segmentNum = index.sectionNum = 0;
+	index.hasSymtab = index.hasDysymtab = index.hasUUID = false;
 	
-	// point to the first load command
-	char *addr = static_cast<char *>(header) + headerSize;
-	// iterate over all load cmds and retrieve required info to solve symbols
-	// __LINKEDIT location and symbol/string table location
-	for (uint32_t i = 0; i < mh->ncmds; i++) {
-		load_command *loadCmd = reinterpret_cast<load_command *>(addr);
-		if (loadCmd->cmd == LC_SEGMENT_64) {
-			segment_command_64 *segCmd = reinterpret_cast<segment_command_64 *>(loadCmd);
-			// use this one to retrieve the original vm address of __TEXT so we can compute kernel aslr slide
-			if (strncmp(segCmd->segname, "__TEXT", 16) == 0) {
-				DBGLOG("mach @ header processing found TEXT");
-				disk_text_addr = segCmd->vmaddr;
-			} else if (strncmp(segCmd->segname, "__LINKEDIT", 16) == 0) {
-				DBGLOG("mach @ header processing found LINKEDIT");
-				linkedit_fileoff = segCmd->fileoff;
-				linkedit_size    = segCmd->filesize;
+	// symbols refer to sections by their ordinal in the whole header, including the ones not indexed
+	uint32_t ordinal = 1;
+	
+	index.valid = walkLoadCommands(header, size, [&index, &ordinal](load_command *loadCmd) {
+		if (loadCmd->cmd == LC_SEGMENT_64 && loadCmd->cmdsize >= sizeof(segment_command_64)) {
+			auto segCmd = reinterpret_cast<segment_command_64 *>(loadCmd);
+			uint32_t first = ordinal;
+			ordinal += segCmd->nsects;
+			
+			if (index.segmentNum >= LoadCommandIndex::MaxSegments) {
+				DBGLOG("mach @ segment %.16s does not fit the index", segCmd->segname);
+				return true;
 			}
+			
+			uint32_t segment = index.segmentNum++;
+			auto &seg = index.segments[segment];
+			strncpy(seg.name, segCmd->segname, sizeof(seg.name));
+			seg.vmaddr   = segCmd->vmaddr;
+			seg.vmsize   = segCmd->vmsize;
+			seg.fileoff  = segCmd->fileoff;
+			seg.filesize = segCmd->filesize;
+			
+			// section headers must stay within the command
+			auto sect = reinterpret_cast<section_64 *>(segCmd + 1);
+			uint32_t nsects = static_cast<uint32_t>((loadCmd->cmdsize - sizeof(segment_command_64)) / sizeof(section_64));
+			if (segCmd->nsects < nsects)
+				nsects = segCmd->nsects;
+			
+			for (uint32_t i = 0; i < nsects && index.sectionNum < LoadCommandIndex::MaxSections; i++) {
+				auto &sec = index.sections[index.sectionNum++];
+				strncpy(sec.name, sect[i].sectname, sizeof(sec.name));
+				sec.segment = segment;
+				sec.ordinal = first + i;
+				sec.offset  = sect[i].offset;
+				sec.addr    = sect[i].addr;
+				sec.size    = sect[i].size;
+			}
+		} else if (loadCmd->cmd == LC_SYMTAB && loadCmd->cmdsize >= sizeof(symtab_command)) {
+			index.symtab = *reinterpret_cast<symtab_command *>(loadCmd);
+			index.hasSymtab = true;
+		} else if (loadCmd->cmd == LC_DYSYMTAB && loadCmd->cmdsize >= sizeof(dysymtab_command)) {
+			index.dysymtab = *reinterpret_cast<dysymtab_command *>(loadCmd);
+			index.hasDysymtab = true;
+		} else if (loadCmd->cmd == LC_UUID && loadCmd->cmdsize >= sizeof(uuid_command)) {
+			memcpy(index.uuid, reinterpret_cast<uuid_command *>(loadCmd)->uuid, sizeof(index.uuid));
+			index.hasUUID = true;
 		}
-		// table information available at LC_SYMTAB command
-		else if (loadCmd->cmd == LC_SYMTAB) {
-			DBGLOG("mach @ header processing found SYMTAB");
-			symtab_command *symtab_cmd = (symtab_command*)loadCmd;
-			symboltable_fileoff    = symtab_cmd->symoff;
-			symboltable_nr_symbols = symtab_cmd->nsyms;
-			stringtable_fileoff    = symtab_cmd->stroff;
-		}
-		addr += loadCmd->cmdsize;
+		return true;
+	});
+	
+	DBGLOG("mach @ indexed %u segments and %u sections (valid %d)", index.segmentNum, index.sectionNum, index.valid);
+	
+	return index.valid;
+}
+
+const MachInfo::LoadCommandIndex::Segment *MachInfo::LoadCommandIndex::findSegment(const char *name) const {
+	for (uint32_t i = 0; i < segmentNum; i++) {
+		if (strncmp(segments[i].name, name, sizeof(segments[i].name)) == 0)
+			return &segments[i];
+	}
+	return nullptr;
+}
+
+const MachInfo::LoadCommandIndex::Section *MachInfo::LoadCommandIndex::findSection(const char *segment, const char *section) const {
+	for (uint32_t i = 0; i < sectionNum; i++) {
+		if (strncmp(sections[i].name, section, sizeof(sections[i].name)) == 0 &&
+			strncmp(segments[sections[i].segment].name, segment, sizeof(segments[0].name)) == 0)
+			return &sections[i];
+	}
+	return nullptr;
+}
+
+const MachInfo::LoadCommandIndex::Section *MachInfo::LoadCommandIndex::findSection(uint32_t ordinal) const {
+	// ordinals grow with the index, so a section is never stored past its ordinal
+	for (uint32_t i = ordinal <= sectionNum ? ordinal : sectionNum; i > 0; i--) {
+		if (sections[i-1].ordinal == ordinal)
+			return &sections[i-1];
+		if (sections[i-1].ordinal < ordinal)
+			break;
 	}
+	return nullptr;
+}
+
+void MachInfo::processMachHeader() {
+	// use this one to retrieve the original vm address of __TEXT so we can compute kernel aslr slide
+	auto text = header_index.findSegment("__TEXT");
+	if (text) {
+		DBGLOG("mach @ header processing found TEXT");
+		disk_text_addr = text->vmaddr;
+	}
+	
+	// __LINKEDIT location and symbol/string table location
+	auto linkedit = header_index.findSegment("__LINKEDIT");
+	if (linkedit) {
+		DBGLOG("mach @ header processing found LINKEDIT");
+		linkedit_fileoff = linkedit->fileoff;
+		linkedit_vmaddr  = linkedit->vmaddr;
+		linkedit_size    = linkedit->filesize;
+	}
+	
+	// table information available at LC_SYMTAB command
+	if (header_index.hasSymtab) {
+		DBGLOG("mach @ header processing found SYMTAB");
+		symboltable_fileoff    = header_index.symtab.symoff;
+		symboltable_nr_symbols = header_index.symtab.nsyms;
+		stringtable_fileoff    = header_index.symtab.stroff;
+		stringtable_size       = header_index.symtab.strsize;
+	}
+}
+
+bool MachInfo::getSection(const char *segment, const char *section, mach_vm_address_t &addr, uint64_t &size) {
+	auto sect = header_index.findSection(segment, section);
+	if (!sect)
+		return false;
+	
+	addr = sect->addr + kaslr_slide;
+	size = sect->size;
+	return true;
 }
 
-//FIXME: Guard pointer access by HeaderSize
 kern_return_t MachInfo::getRunningAddresses(mach_vm_address_t slide, size_t size) {
 	if (kaslr_slide_set) return KERN_SUCCESS;
 	
@@ -350,22 +1094,26 @@ kern_return_t MachInfo::getRunningAddresses(mach_vm_address_t slide, size_t size
 	mach_vm_address_t base = slide ? slide : findKernelBase();
 	if (base != 0) {
 		// get the vm address of __TEXT segment
-		mach_header_64 *mh = reinterpret_cast<mach_header_64 *>(base);
-		size_t headerSize = sizeof(mach_header_64);
-		
-		load_command *loadCmd;
-		char *addr = reinterpret_cast<char *>(base) + headerSize;
-		for (uint32_t i = 0; i < mh->ncmds; i++) {
-			loadCmd = reinterpret_cast<load_command *>(addr);
-			if (loadCmd->cmd == LC_SEGMENT_64) {
-				segment_command_64 *segCmd = reinterpret_cast<segment_command_64 *>(loadCmd);
+		auto mh = reinterpret_cast<mach_header_64 *>(base);
+		walkLoadCommands(mh, memory_size < HeaderSize ? memory_size : HeaderSize, [this, mh](load_command *loadCmd) {
+			if (loadCmd->cmd == LC_SEGMENT_64 && loadCmd->cmdsize >= sizeof(segment_command_64)) {
+				auto segCmd = reinterpret_cast<segment_command_64 *>(loadCmd);
 				if (strncmp(segCmd->segname, "__TEXT", 16) == 0) {
 					running_text_addr = segCmd->vmaddr;
 					running_mh = mh;
-					break;
+					return false;
 				}
 			}
-			addr += loadCmd->cmdsize;
+			return true;
+		});
+	}
+	
+	// prelinked symbols are only valid for the very same binary
+	if (running_mh && prelinked_kext) {
+		auto uuid = getUUID(running_mh, memory_size < HeaderSize ? memory_size : HeaderSize);
+		if (!uuid || memcmp(uuid, header_index.uuid, sizeof(header_index.uuid)) != 0) {
+			SYSLOG("mach @ running kext does not match the prelinked one");
+			return KERN_FAILURE;
 		}
 	}
 	
@@ -373,6 +1121,9 @@ kern_return_t MachInfo::getRunningAddresses(mach_vm_address_t slide, size_t size
 	if (running_text_addr && running_mh) {
 		if (!slide) {
 			kaslr_slide = running_text_addr - disk_text_addr;
+		} else if (prelinked_kext) {
+			// prelinked symbol values are absolute to the prelinked __TEXT
+			kaslr_slide = slide - disk_text_addr;
 		} else {
 			kaslr_slide = slide;
 		}
@@ -393,33 +1144,31 @@ void MachInfo::getRunningPosition(uint8_t * &header, size_t &size) {
 	DBGLOG("mach @ getRunningPosition %p of memory %zu size", header, size);
 }
 
-//FIXME: Guard pointer access by HeaderSize
-uint64_t *MachInfo::getUUID(void *header) {
-	if (!header) return nullptr;
+uint64_t *MachInfo::getUUID(void *header, size_t size) {
+	uint64_t *uuid {nullptr};
 	
-	mach_header_64 *mh = static_cast<mach_header_64 *>(header);
-	size_t size = sizeof(struct mach_header_64);
-	
-	uint8_t *addr = static_cast<uint8_t *>(header) + size;
-	for (uint32_t i = 0; i < mh->ncmds; i++) {
-		load_command *loadCmd = reinterpret_cast<load_command *>(addr);
-		if (loadCmd->cmd == LC_UUID) {
-			return reinterpret_cast<uint64_t *>((reinterpret_cast<uuid_command *>(loadCmd))->uuid);
+	walkLoadCommands(header, size, [&uuid](load_command *loadCmd) {
+		if (loadCmd->cmd == LC_UUID && loadCmd->cmdsize >= sizeof(uuid_command)) {
+			uuid = reinterpret_cast<uint64_t *>((reinterpret_cast<uuid_command *>(loadCmd))->uuid);
+			return false;
 		}
-		
-		addr += loadCmd->cmdsize;
-	}
+		return true;
+	});
 	
-	return nullptr;
+	return uuid;
 }
 
-bool MachInfo::isCurrentKernel(void *kernelHeader) {
-	mach_vm_address_t kernelBase = findKernelBase();
+bool MachInfo::isCurrentKernel() {
+	// the running kernel does not change while probing the candidates
+	if (!running_kernel_uuid_set) {
+		auto uuid = getUUID(reinterpret_cast<void *>(findKernelBase()));
+		if (!uuid)
+			return false;
+		memcpy(running_kernel_uuid, uuid, sizeof(running_kernel_uuid));
+		running_kernel_uuid_set = true;
+	}
 	
-	uint64_t *uuid1 = getUUID(kernelHeader);
-	uint64_t *uuid2 = getUUID(reinterpret_cast<void *>(kernelBase));
-
-	return uuid1 && uuid2 && uuid1[0] == uuid2[0] && uuid1[1] == uuid2[1];
+	return header_index.hasUUID && memcmp(header_index.uuid, running_kernel_uuid, sizeof(running_kernel_uuid)) == 0;
 }
 
 mach_vm_address_t MachInfo::getIDTAddress() {
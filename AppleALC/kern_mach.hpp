@@ -16,23 +16,122 @@
 #include <sys/types.h>
 #include <sys/vnode.h>
 #include <mach-o/loader.h>
+#include <mach-o/nlist.h>
 #include <mach/vm_param.h>
 
+class OSDictionary;
+
 class MachInfo {
 	mach_vm_address_t running_text_addr {0}; // the address of running __TEXT segment
 	mach_vm_address_t disk_text_addr {0};    // the same address at from a file
 	mach_vm_address_t kaslr_slide {0};       // the kernel aslr slide, computed as the difference between above's addresses
 	uint8_t *file_buf {nullptr};             // read file data if decompression was used
-	uint8_t *linkedit_buf {nullptr};         // pointer to __LINKEDIT buffer containing symbols to solve
+	size_t file_buf_size {0};                // decompressed file data size
+	uint8_t *compressed_buf {nullptr};       // compressed file data awaiting range-limited decompression
+	uint32_t compressed_size {0};            // compressed file data size in compressed_buf
+	uint32_t compressed_file_size {0};       // full compressed data size in the file
+	off_t compressed_fileoff {0};            // compressed data offset in the file
+	uint32_t compression_type {0};           // compressed file data compression
+	uint32_t decompressed_size {0};          // full decompressed file data size
+	uint8_t *linkedit_buf {nullptr};         // pointer to __LINKEDIT symbol and string tables to solve symbols
+	nlist_64 *symbol_table {nullptr};        // symbol table within linkedit_buf
+	char *string_table {nullptr};            // string table within linkedit_buf
 	uint64_t linkedit_fileoff {0};           // __LINKEDIT file offset so we can read
+	mach_vm_address_t linkedit_vmaddr {0};   // __LINKEDIT vm address used to locate tables in prelinked images
 	uint64_t linkedit_size {0};
 	uint32_t symboltable_fileoff {0};        // file offset to symbol table - used to position inside the __LINKEDIT buffer
 	uint32_t symboltable_nr_symbols {0};
 	uint32_t stringtable_fileoff {0};        // file offset to string table
+	uint32_t stringtable_size {0};
+	uint32_t *symbol_index {nullptr};        // open-addressing hash of symbol numbers (+1), 0 is a free slot
+	uint32_t symbol_index_mask {0};          // symbol index slot count minus one
 	mach_header_64 *running_mh {nullptr};    // pointer to mach-o header of running kernel item
 	off_t fat_offset {0};                    // additional fat offset
+	uint64_t fat_size {0};                   // x86_64 slice size in a fat binary, 0 if not fat
 	size_t memory_size {HeaderSize};         // memory size
+	size_t read_size {0};                    // bytes read from the filesystem
+	size_t memory_used {0};                  // currently allocated buffer bytes
+	size_t memory_peak {0};                  // peak allocated buffer bytes
 	bool kaslr_slide_set {false};            // kaslr can be null, used for disambiguation
+	OSDictionary *prelink_info {nullptr};    // parsed __PRELINK_INFO of a prelinked image, decoded data is in file_buf if compressed
+	bool prelinked_kext {false};             // symbols were loaded from a prelinked image
+	mach_vm_address_t kernel_base {0};       // found kernel base address
+	mach_vm_address_t (*base_lookup)(mach_vm_address_t, size_t, size_t &) {nullptr}; // kernel base lookup strategy, pagewise if null
+	size_t base_lookup_window {0};           // kernel base search distance limit, 0 means unlimited
+	const char *binary_path {nullptr};       // path of the read binary, prelinked kexts are read from it
+	bool symbol_cache_used {false};          // symbols come from a symbol cache
+	uint8_t running_kernel_uuid[16] {};      // LC_UUID of the running kernel, valid with the flag below
+	bool running_kernel_uuid_set {false};    // running kernel uuid was already looked up
+	
+	/**
+	 *  Compact table of load commands collected in a single bounded pass
+	 */
+	struct LoadCommandIndex {
+		static constexpr size_t MaxSegments {24};
+		static constexpr size_t MaxSections {96};
+		
+		struct Segment {
+			char name[16];
+			mach_vm_address_t vmaddr;
+			uint64_t vmsize;
+			uint64_t fileoff;
+			uint64_t filesize;
+		};
+		
+		struct Section {
+			char name[16];
+			uint32_t segment;  // owning segment index
+			uint32_t ordinal;  // 1-based ordinal referenced by nlist n_sect
+			uint32_t offset;   // file offset
+			mach_vm_address_t addr;
+			uint64_t size;
+		};
+		
+		Segment segments[MaxSegments];
+		Section sections[MaxSections];
+		uint32_t segmentNum {0};
+		uint32_t sectionNum {0};
+		symtab_command symtab {};
+		dysymtab_command dysymtab {};
+		uint8_t uuid[16] {};
+		bool hasSymtab {false};
+		bool hasDysymtab {false};
+		bool hasUUID {false};
+		bool valid {false};
+		
+		/**
+		 *  Find a segment by name
+		 *
+		 *  @param name segment name
+		 *
+		 *  @return segment or nullptr
+		 */
+		const Segment *findSegment(const char *name) const;
+		
+		/**
+		 *  Find a section by segment and section names
+		 *
+		 *  @param segment segment name
+		 *  @param section section name
+		 *
+		 *  @return section or nullptr
+		 */
+		const Section *findSection(const char *segment, const char *section) const;
+		
+		/**
+		 *  Find a section by its ordinal, which also counts the sections left out of the index
+		 *
+		 *  @param ordinal 1-based section ordinal
+		 *
+		 *  @return section or nullptr
+		 */
+		const Section *findSection(uint32_t ordinal) const;
+	};
+	
+	/**
+	 *  load commands of the last processed mach header
+	 */
+	LoadCommandIndex header_index;
 	
 	/**
 	 *  16 byte IDT descriptor, used for 32 and 64 bits kernels (64 bit capable cpus!)
@@ -61,14 +160,90 @@ class MachInfo {
 	 */
 	mach_vm_address_t calculateInt80Address();
 	
+	/**
+	 *  account buffer allocations for peak memory statistics
+	 *
+	 *  @param allocated newly allocated bytes
+	 *  @param released  freed bytes
+	 */
+	void accountMemory(size_t allocated, size_t released=0) {
+		memory_used += allocated;
+		if (memory_used > memory_peak)
+			memory_peak = memory_used;
+		memory_used -= released;
+	}
+	
+	/**
+	 *  release compressed and decompressed file data if any
+	 */
+	void freeFileBuffer();
+	
+	/**
+	 *  release compressed file data if any
+	 */
+	void freeCompressedBuffer();
+	
+	/**
+	 *  decompress the leading part of compressed file data into file_buf
+	 *
+	 *  @param size bytes to decompress
+	 *
+	 *  @return true on success
+	 */
+	bool decompressFileBuffer(size_t size);
+	
+	/**
+	 *  walk load commands of a mach header without leaving its bounds
+	 *
+	 *  @param header  mach header pointer
+	 *  @param size    bytes available at header
+	 *  @param handler called for every load command, returns false to stop the walk
+	 *
+	 *  @return false if the header or any of the visited commands is malformed
+	 */
+	template <typename T>
+	static bool walkLoadCommands(void *header, size_t size, T handler) {
+		auto mh = static_cast<mach_header_64 *>(header);
+		if (!header || size < sizeof(mach_header_64) || mh->magic != MH_MAGIC_64 ||
+			mh->sizeofcmds > size - sizeof(mach_header_64))
+			return false;
+		
+		auto addr = static_cast<uint8_t *>(header) + sizeof(mach_header_64);
+		auto end = addr + mh->sizeofcmds;
+		for (uint32_t i = 0; i < mh->ncmds; i++) {
+			if (static_cast<size_t>(end - addr) < sizeof(load_command))
+				return false;
+			auto loadCmd = reinterpret_cast<load_command *>(addr);
+			if (loadCmd->cmdsize < sizeof(load_command) || loadCmd->cmdsize > static_cast<size_t>(end - addr))
+				return false;
+			if (!handler(loadCmd))
+				break;
+			addr += loadCmd->cmdsize;
+		}
+		
+		return true;
+	}
+	
+	/**
+	 *  collect segments, sections, symbol tables and uuid of a mach header
+	 *
+	 *  @param header mach header pointer
+	 *  @param size   bytes available at header
+	 *  @param index  index to fill
+	 *
+	 *  @return true if the header is well-formed
+	 */
+	static bool indexLoadCommands(void *header, size_t size, LoadCommandIndex &index);
+	
 	/**
 	 *  retrieve LC_UUID command value from a mach header
 	 *
 	 *  @param header mach header pointer
+	 *  @param size   bytes available at header
 	 *
 	 *  @return UUID or nullptr
 	 */
-	uint64_t *getUUID(void *header);
+	static uint64_t *getUUID(void *header, size_t size=HeaderSize);
 	
 	/**
 	 *  enable/disable the Write Protection bit in CR0 register
@@ -80,7 +255,18 @@ class MachInfo {
 	kern_return_t setWPBit(bool enable);
 	
 	/**
-	 *  retrieve the first pages of a binary at disk into a buffer
+	 *  Bytes read first when probing a binary, enough for fat, compressed and mach headers
+	 */
+	static constexpr size_t ProbeSize {512};
+	
+	/**
+	 *  Compressed bytes read to decode the mach header, twice HeaderSize covers the worst expansion of both compressors
+	 */
+	static constexpr size_t ProbeCompressedSize {PAGE_SIZE_64*4};
+	
+	/**
+	 *  retrieve the mach header with its load commands of a binary at disk into a buffer
+	 *  only the smallest necessary prefix is read, compressed data is fully read later on demand
 	 *  version that uses KPI VFS functions and a ripped uio_createwithbuffer() from XNU
 	 *
 	 *  @param buffer allocated buffer sized no less than HeaderSize
@@ -91,9 +277,20 @@ class MachInfo {
 	 *  @return KERN_SUCCESS if the read data contains 64-bit mach header
 	 */
 	kern_return_t readMachHeader(uint8_t *buffer, vnode_t vnode, vfs_context_t ctxt, off_t off=0);
+	
+	/**
+	 *  read the whole compressed data if only its header prefix was read at probing
+	 *
+	 *  @param vnode file node
+	 *  @param ctxt  filesystem context
+	 *
+	 *  @return true on success
+	 */
+	bool readCompressedData(vnode_t vnode, vfs_context_t ctxt);
 
 	/**
-	 *  retrieve the whole linkedit segment into target buffer from kernel binary at disk
+	 *  retrieve the symbol and string tables from __LINKEDIT segment into target buffer from kernel binary at disk
+	 *  relocations, code signature and other linkedit data are skipped
 	 *
 	 *  @param vnode file node
 	 *  @param ctxt  filesystem context
@@ -103,11 +300,114 @@ class MachInfo {
 	kern_return_t readLinkedit(vnode_t vnode, vfs_context_t ctxt);
 	
 	/**
-	 *  retrieve necessary mach-o header information from the mach header
+	 *  build a symbol index over the loaded __LINKEDIT symbol table
+	 *  the index is optional, symbol solving falls back to a linear lookup without it
+	 */
+	void buildSymbolIndex();
+	
+	/**
+	 *  calculate symbol name hash used by the symbol index
+	 *
+	 *  @param symbol symbol name
+	 *  @param size   maximum name length, hashing stops earlier at the terminator
+	 *
+	 *  @return FNV-1a hash value
+	 */
+	static uint32_t symbolHash(const char *symbol, size_t size);
+	
+	/**
+	 *  compare a symbol name with a string table entry without reading past the table
+	 *
+	 *  @param symbol symbol name
+	 *  @param strx   string table index
+	 *
+	 *  @return true if the entry holds the same terminated name
+	 */
+	bool symbolEquals(const char *symbol, uint32_t strx);
+	
+	/**
+	 *  Compressed prelinked images are decoded in one go up to __PRELINK_INFO, which follows __PRELINK_TEXT,
+	 *  so the decoded data stays resident till deinit, images decoding to more bytes are not used
+	 */
+	static constexpr size_t PrelinkedMaxDecoded {128*1024*1024};
+	
+	/**
+	 *  parse __PRELINK_INFO of a prelinked image
+	 *  plain images keep nothing else, the kexts are read from the file on demand,
+	 *  compressed images keep the data decoded up to __PRELINK_INFO, their kernel __LINKEDIT is never decoded
+	 *
+	 *  @param vnode file node
+	 *  @param ctxt  filesystem context
+	 *
+	 *  @return KERN_SUCCESS on success
+	 */
+	kern_return_t readPrelinked(vnode_t vnode, vfs_context_t ctxt);
+	
+	/**
+	 *  Part of a prelinked image to copy
+	 */
+	struct PrelinkedRange {
+		mach_vm_address_t addr;
+		size_t size;
+		uint8_t *dst;
+	};
+	
+	/**
+	 *  copy parts of a prelinked image by their vm addresses, only __PRELINK_TEXT is available
+	 *  plain images are read from the file with a single lookup
+	 *
+	 *  @param ranges parts to copy
+	 *  @param num    number of parts
+	 *
+	 *  @return KERN_SUCCESS if every part was copied
+	 */
+	kern_return_t copyPrelinked(const PrelinkedRange ranges[], size_t num);
+	
+	/**
+	 *  find a kext executable within a loaded prelinked image
+	 *
+	 *  @param id   kext bundle identifier
+	 *  @param addr executable vm address
+	 *  @param size executable size
 	 *
-	 *  @param header read header sized no less than HeaderSize
+	 *  @return true if the kext has an executable
 	 */
-	void processMachHeader(void *header);
+	bool findPrelinkedKext(const char *id, mach_vm_address_t &addr, size_t &size);
+	
+	/**
+	 *  load symbols from an on-disk symbol cache made for the indexed binary
+	 *  every cached symbol must lie within the section it refers to
+	 *
+	 *  @param path symbol cache path
+	 *
+	 *  @return KERN_SUCCESS if the cache matches the binary uuid and __TEXT address and is valid
+	 */
+	kern_return_t readSymbolCache(const char *path);
+	
+	/**
+	 *  check that a symbol refers to an indexed section and lies within it
+	 *
+	 *  @param symbol symbol entry
+	 *
+	 *  @return true if the symbol value is within its section
+	 */
+	bool isSymbolInSection(const nlist_64 &symbol);
+	
+	/**
+	 *  solve symbols with the loaded symbol or cache tables
+	 *
+	 *  @param symbols   symbols to solve
+	 *  @param num       number of symbols passed
+	 *  @param addresses running symbol addresses or 0, must fit num entries
+	 *
+	 *  @return number of solved symbols
+	 */
+	size_t solveLoadedSymbols(const char * const symbols[], size_t num, mach_vm_address_t addresses[]);
+	
+	/**
+	 *  retrieve necessary mach-o header information from the indexed load commands
+	 */
+	void processMachHeader();
 	
 	MachInfo(bool asKernel=false) : isKernel(asKernel) {
 		DBGLOG("mach @ MachInfo asKernel %d object constructed", asKernel);
@@ -140,12 +440,24 @@ public:
 	/**
 	 *  Resolve mach data in the kernel
 	 *
-	 *  @param enable filesystem paths for lookup
-	 *  @param num    the number of paths passed
+	 *  @param enable    filesystem paths for lookup
+	 *  @param num       the number of paths passed
+	 *  @param prelinked keep the prelinked kexts for initFromPrelinked instead of loading symbols
+	 *  @param cache     symbol cache path tried before reading the symbol table, it must hold every symbol to be solved
 	 *
 	 *  @return KERN_SUCCESS if loaded
 	 */
-	kern_return_t init(const char * const paths[], size_t num = 1);
+	kern_return_t init(const char * const paths[], size_t num = 1, bool prelinked = false, const char *cache = nullptr);
+	
+	/**
+	 *  Resolve mach data of a kext from a prelinked image
+	 *
+	 *  @param prelink MachInfo initialised with a prelinked image
+	 *  @param id      kext bundle identifier
+	 *
+	 *  @return KERN_SUCCESS if loaded
+	 */
+	kern_return_t initFromPrelinked(MachInfo *prelink, const char *id);
 	
 	/**
 	 *  Release the allocated memory, must be called regardless of the init error
@@ -169,6 +481,13 @@ public:
 	 *  @param size   file size
 	 */
 	void getRunningPosition(uint8_t * &header, size_t &size);
+	
+	/**
+	 *  retrieve the size of the allocated buffers, they stay resident until deinit
+	 *
+	 *  @return allocated bytes
+	 */
+	size_t getResidentSize() { return memory_used; }
 
 	/**
 	 *  solve a mach symbol (running addresses must be calculated)
@@ -178,6 +497,18 @@ public:
 	 *  @return running symbol address or 0
 	 */
 	mach_vm_address_t solveSymbol(const char *symbol);
+	
+	/**
+	 *  solve multiple mach symbols in one pass (running addresses must be calculated)
+	 *  symbols missing from a used symbol cache are not solved, nothing is read from the filesystem
+	 *
+	 *  @param symbols   symbols to solve, repeated names are solved at every position
+	 *  @param num       number of symbols passed
+	 *  @param addresses running symbol addresses or 0, must fit num entries
+	 *
+	 *  @return number of solved symbols
+	 */
+	size_t solveSymbols(const char * const symbols[], size_t num, mach_vm_address_t addresses[]);
 
 	/**
 	 *  Read file data from a vnode
@@ -202,9 +533,39 @@ public:
 	 */
 	size_t readFileSize(vnode_t vnode, vfs_context_t ctxt);
 
+	/**
+	 *  Kernel base lookup strategy, searches backwards for the kernel mach-o header
+	 *
+	 *  @param start  address to start searching from
+	 *  @param window maximum distance to search or 0 for no limit
+	 *  @param probes number of checked addresses, incremented by the strategy
+	 *
+	 *  @return kernel base address or 0
+	 */
+	using t_baseLookup = mach_vm_address_t (*)(mach_vm_address_t start, size_t window, size_t &probes);
+	
+	/**
+	 *  Check every byte, the original strategy
+	 */
+	static mach_vm_address_t lookupBaseBytewise(mach_vm_address_t start, size_t window, size_t &probes);
+	
+	/**
+	 *  Check page boundaries only, mach-o headers are always page aligned
+	 */
+	static mach_vm_address_t lookupBasePagewise(mach_vm_address_t start, size_t window, size_t &probes);
+	
+	/**
+	 *  Change the kernel base lookup strategy, resets the found base address
+	 *
+	 *  @param lookup strategy function
+	 *  @param window maximum distance to search or 0 for no limit
+	 */
+	void setBaseLookup(t_baseLookup lookup, size_t window=0);
+
 	/**
 	 *  find the kernel base address (mach-o header)
 	 *  by searching backwards using the int80 handler as starting point
+	 *  the found address is remembered for subsequent calls
 	 *
 	 *  @return kernel base address or 0
 	 */
@@ -220,13 +581,23 @@ public:
 	kern_return_t setKernelWriting(bool enable);
 	
 	/**
-	 *  Compare the loaded kernel with the passed kernel header
-	 *
-	 *  @param kernel_header 64-bit mach header of at least HeaderSize size
+	 *  Compare the loaded kernel with the last indexed mach header
 	 *
 	 *  @return true if the kernel uuids match
 	 */
-	bool isCurrentKernel(void *kernelHeader);
+	bool isCurrentKernel();
+	
+	/**
+	 *  Get section boundaries of the loaded binary
+	 *
+	 *  @param segment segment name
+	 *  @param section section name
+	 *  @param addr    section address, slid once the running addresses are known
+	 *  @param size    section size
+	 *
+	 *  @return true if the section is found
+	 */
+	bool getSection(const char *segment, const char *section, mach_vm_address_t &addr, uint64_t &size);
 };
 
 #endif /* kern_mach_hpp */
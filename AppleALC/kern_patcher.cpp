@@ -9,6 +9,7 @@
 #include "kern_patcher.hpp"
 
 #include <mach/mach_types.h>
+#include <kern/clock.h>
 
 //TODO: get rid of this
 static KernelPatcher *that {nullptr};
@@ -43,32 +44,81 @@ void KernelPatcher::deinit() {
 	// Deinitialise disassembler
 	disasm.deinit();
 	
-	// Remove the patches
+	// Revert the journaled writes and remove the patches
 	if (kinfos.size() > 0) {
-		if (kinfos[KernelID]->setKernelWriting(true) == KERN_SUCCESS) {
-			for (size_t i = 0, n = kpatches.size(); i < n; i++) {
-				kpatches[i]->restore();
+		if (!revertJournal(0))
+			SYSLOG("patcher @ failed to revert %zu journal bytes", journalSize);
+
+		DBGLOG("patcher @ restoring %zu patches stored with %zu allocations", kpatchesNum, kpatchesAllocs);
+		if (kpatchesNum == 0) {
+			// Nothing to restore
+		} else if (kinfos[KernelID]->setKernelWriting(true) == KERN_SUCCESS) {
+			for (size_t i = kpatchesNum; i-- > 0; ) {
+				kpatches[i].restore();
 			}
 			kinfos[KernelID]->setKernelWriting(false);
 		} else {
 			SYSLOG("patcher @ failed to change kernel protection at patch removal");
 		}
 	}
-	kpatches.deinit();
+	Buffer::deleter(kpatches);
+	kpatches = nullptr;
+	kpatchesNum = kpatchesCapacity = 0;
+	
+	// Drop the staged writes
+	abortTransaction();
+	Buffer::deleter(stageBuf);
+	stageBuf = nullptr;
+	stageCapacity = 0;
+	Buffer::deleter(journalBuf);
+	journalBuf = nullptr;
+	journalSize = journalCapacity = 0;
+	
+	// The listening route is removed with the patches
+	if (that == this)
+		that = nullptr;
 	
 	// Deallocate kinfos
 	kinfos.deinit();
+	freePrelinkedImage();
+	
+	// Drop the handlers that were never invoked
+	for (size_t i = 0; i < HandlerBuckets; i++) {
+		while (khandlers[i]) {
+			auto next = khandlers[i]->next;
+			KextHandler::deleter(khandlers[i]);
+			khandlers[i] = next;
+		}
+	}
+	khandlersNum = 0;
 	
 	// Deallocate pages
 	kpages.deinit();
+	slabUsed = 0;
+	slabSealed = true;
 }
 
 size_t KernelPatcher::loadKinfo(const char *id, const char * const paths[], size_t num, bool isKernel) {
+	if (!symbolCacheTried) {
+		symbolCacheTried = true;
+		vnode_t vnode = NULLVP;
+		vfs_context_t ctxt = vfs_context_create(nullptr);
+		if (!vnode_lookup(symbolCacheDir, 0, &vnode, ctxt)) {
+			symbolCacheFound = true;
+			vnode_put(vnode);
+		}
+		vfs_context_rele(ctxt);
+		DBGLOG("patcher @ symbol cache directory %s is %s", symbolCacheDir, symbolCacheFound ? "present" : "missing");
+	}
+	
+	char cache[symbolCachePathSize];
+	snprintf(cache, sizeof(cache), symbolCacheFormat, id);
+	
 	auto info = MachInfo::create(isKernel);
 	if (!info) {
 		SYSLOG("patcher @ failed to allocate MachInfo for %s", id);
 		code = Error::MemoryIssue;
-	} else if (info->init(paths, num) != KERN_SUCCESS) {
+	} else if (info->init(paths, num, false, symbolCacheFound ? cache : nullptr) != KERN_SUCCESS) {
 		if ((isKernel && debugEnabled) || !isKernel)
 			SYSLOG("patcher @ failed to init MachInfo for %s", id);
 		code = Error::NoKinfoFound;
@@ -87,6 +137,49 @@ size_t KernelPatcher::loadKinfo(const char *id, const char * const paths[], size
 	return INVALID;
 }
 
+size_t KernelPatcher::loadPrelinkedKinfo(const char *id) {
+	if (!prelinkTried) {
+		prelinkTried = true;
+		prelinkInfo = MachInfo::create(true);
+		if (!prelinkInfo) {
+			SYSLOG("patcher @ failed to allocate MachInfo for prelinked image");
+		} else if (prelinkInfo->init(prelinkedPaths, prelinkedPathsNum, true) != KERN_SUCCESS) {
+			DBGLOG("patcher @ no usable prelinked image, using kext files");
+			freePrelinkedImage();
+		}
+	}
+	
+	if (!prelinkInfo)
+		return INVALID;
+	
+	// symbol caches hold on-disk values, prelinked kexts are served from their own tables
+	auto info = MachInfo::create();
+	if (!info) {
+		SYSLOG("patcher @ failed to allocate MachInfo for %s", id);
+	} else if (info->initFromPrelinked(prelinkInfo, id) != KERN_SUCCESS) {
+		DBGLOG("patcher @ %s is not available in the prelinked image", id);
+	} else if (!kinfos.push_back(info)) {
+		SYSLOG("patcher @ unable to store loaded MachInfo for %s", id);
+	} else {
+		return kinfos.last();
+	}
+	
+	if (info) {
+		info->deinit();
+		MachInfo::deleter(info);
+	}
+	
+	return INVALID;
+}
+
+void KernelPatcher::freePrelinkedImage() {
+	if (prelinkInfo) {
+		prelinkInfo->deinit();
+		MachInfo::deleter(prelinkInfo);
+		prelinkInfo = nullptr;
+	}
+}
+
 size_t KernelPatcher::loadKinfo(KernelPatcher::KextInfo *info) {
 	if (!info) {
 		SYSLOG("patcher @ loadKinfo got a null info");
@@ -99,7 +192,11 @@ size_t KernelPatcher::loadKinfo(KernelPatcher::KextInfo *info) {
 		return info->loadIndex;
 	}
 	
-	auto idx = loadKinfo(info->id, info->paths, info->pathNum);
+	// Kexts present in the prelinked image avoid separate file reads
+	auto idx = loadPrelinkedKinfo(info->id);
+	if (idx == INVALID)
+		idx = loadKinfo(info->id, info->paths, info->pathNum);
+	
 	if (getError() == Error::NoError) {
 		info->loadIndex = idx;
 		DBGLOG("patcher @ loaded kinfo %s at %zu index", info->id, idx);
@@ -108,6 +205,22 @@ size_t KernelPatcher::loadKinfo(KernelPatcher::KextInfo *info) {
 	return idx;
 }
 
+size_t KernelPatcher::unloadKinfo(KernelPatcher::KextInfo *info) {
+	if (!info || info->loadIndex == KernelPatcher::KextInfo::Unloaded || info->loadIndex >= kinfos.size()) {
+		SYSLOG("patcher @ unloadKinfo got an unloaded info");
+		code = Error::NoKinfoFound;
+		return 0;
+	}
+	
+	// The slot stays, so that the other kinfo ids remain valid
+	auto kinfo = kinfos[info->loadIndex];
+	size_t released = kinfo->getResidentSize();
+	kinfo->deinit();
+	DBGLOG("patcher @ unloaded kinfo %s at %zu index releasing %zu bytes", info->id, info->loadIndex, released);
+	info->loadIndex = KernelPatcher::KextInfo::Unloaded;
+	return released;
+}
+
 void KernelPatcher::updateRunningInfo(size_t id, mach_vm_address_t slide, size_t size) {
 	if (id >= kinfos.size()) {
 		SYSLOG("patcher @ invalid kinfo id %zu for running info update", id);
@@ -134,11 +247,29 @@ mach_vm_address_t KernelPatcher::solveSymbol(size_t id, const char *symbol) {
 	return kinfos[id]->solveSymbol(symbol);
 }
 
+size_t KernelPatcher::solveSymbols(size_t id, const char * const symbols[], size_t num, mach_vm_address_t addresses[]) {
+	if (id >= kinfos.size()) {
+		SYSLOG("patcher @ invalid kinfo id %zu for %zu symbols lookup", id, num);
+		for (size_t i = 0; i < num; i++)
+			addresses[i] = 0;
+		return 0;
+	}
+	
+	return kinfos[id]->solveSymbols(symbols, num, addresses);
+}
+
 void KernelPatcher::setupKextListening() {
 	// We have already done this
 	if (that) return;
 	
-	mach_vm_address_t s = solveSymbol(KernelID, "_OSKextLoadedKextSummariesUpdated");
+	const char *symbols[] {
+		"_OSKextLoadedKextSummariesUpdated",
+		"_gLoadedKextSummaries"
+	};
+	mach_vm_address_t addresses[arrsize(symbols)];
+	solveSymbols(KernelID, symbols, arrsize(symbols), addresses);
+	
+	mach_vm_address_t s = addresses[0];
 	
 	if (s) {
 		DBGLOG("patcher @ _OSKextLoadedKextSummariesUpdated address %llX value %llX", s, *reinterpret_cast<uint64_t *>(s));
@@ -147,10 +278,19 @@ void KernelPatcher::setupKextListening() {
 		return;
 	}
 	
-	loadedKextSummaries = reinterpret_cast<OSKextLoadedKextSummaryHeader **>(solveSymbol(KernelID, "_gLoadedKextSummaries"));
+	loadedKextSummaries = reinterpret_cast<OSKextLoadedKextSummaryHeader **>(addresses[1]);
 
 	if (loadedKextSummaries) {
 		DBGLOG("patcher @ _gLoadedKextSummaries address %p", loadedKextSummaries);
+		// Only the kexts loaded from now on are of interest
+		kextLastLoadTag = 0;
+		if (*loadedKextSummaries) {
+			auto header = *loadedKextSummaries;
+			for (uint32_t i = 0; i < header->numSummaries; i++) {
+				if (header->summaries[i].loadTag > kextLastLoadTag)
+					kextLastLoadTag = header->summaries[i].loadTag;
+			}
+		}
 	} else {
 		code = Error::NoSymbolFound;
 		return;
@@ -171,52 +311,328 @@ void KernelPatcher::waitOnKext(KextHandler *handler) {
 		return;
 	}
 	
-	if (!khandlers.push_back(handler)) {
+	if (!handler) {
+		SYSLOG("patcher @ waitOnKext got a null handler");
 		code = Error::MemoryIssue;
+		return;
+	}
+	
+	handler->hash = hashKextId(handler->id);
+	handler->next = nullptr;
+	
+	auto slot = &khandlers[handler->hash % HandlerBuckets];
+	while (*slot)
+		slot = &(*slot)->next;
+	*slot = handler;
+	khandlersNum++;
+}
+
+uint32_t KernelPatcher::hashKextId(const char *id) {
+	// FNV-1a
+	uint32_t hash {0x811C9DC5};
+	for (size_t i = 0; i < KMOD_MAX_NAME && id[i]; i++) {
+		hash ^= static_cast<uint8_t>(id[i]);
+		hash *= 0x01000193;
 	}
+	return hash;
 }
 
 void KernelPatcher::applyLookupPatch(const LookupPatch *patch) {
-	if (!patch || !patch->kext || patch->kext->loadIndex == KextInfo::Unloaded) {
+	applyLookupPatches(&patch, 1);
+}
+
+void KernelPatcher::applyLookupPatches(const LookupPatch * const patches[], size_t num) {
+	auto kext = patches && num > 0 && patches[0] ? patches[0]->kext : nullptr;
+	for (size_t i = 0; kext && i < num; i++) {
+		if (!patches[i] || patches[i]->kext != kext || patches[i]->size == 0)
+			kext = nullptr;
+	}
+	
+	if (!kext || kext->loadIndex == KextInfo::Unloaded) {
 		SYSLOG("patcher @ an invalid lookup patch provided");
 		code = Error::MemoryIssue;
 		return;
 	}
 	
-	uint8_t *off, *curr;
+	auto next = Buffer::create<size_t>(num);
+	auto changes = Buffer::create<size_t>(num);
+	if (!next || !changes) {
+		SYSLOG("patcher @ failed to allocate lookup tables for %zu patches", num);
+		Buffer::deleter(next);
+		Buffer::deleter(changes);
+		code = Error::MemoryIssue;
+		return;
+	}
+	
+	// patches with a zero count replace every occurrence, so the whole kext is scanned for them
+	size_t pending {0};
+	bool unbounded {false};
+	for (size_t i = 0; i < num; i++) {
+		changes[i] = 0;
+		if (patches[i]->count > 0)
+			pending++;
+		else
+			unbounded = true;
+	}
+	
+	uint8_t *start;
 	size_t size;
-	auto kinfo = kinfos[patch->kext->loadIndex];
-	kinfo->getRunningPosition(off, size);
-	
-	curr = off;
-	off += size - patch->size;
-	size_t changes {0};
-	for (size_t i = 0; curr < off && (i < patch->count || patch->count == 0); i++) {
-		while (curr < off && memcmp(curr, patch->find, patch->size))
-			curr++;
-		
-		if (curr != off) {
-			if (kinfo->setKernelWriting(true) != KERN_SUCCESS) {
-				SYSLOG("patcher @ lookup patching failed to write to kernel");
-				code = Error::MemoryProtection;
-				return;
-			}
-			for (size_t j = 0; j < patch->size; j++) {
-				curr[j] = patch->replace[j];
+	auto kinfo = kinfos[kext->loadIndex];
+	kinfo->getRunningPosition(start, size);
+	
+	// a few patterns are found faster by findPattern one by one, then next holds their occurrences,
+	// otherwise every position is checked against the patches chained by its byte, 0 ends a chain
+	bool cursors = num <= LookupCursorPatches;
+	uint32_t heads[256] {};
+	for (size_t i = num; i-- > 0; ) {
+		if (cursors) {
+			auto found = findPattern(start, size, patches[i]->find, patches[i]->size);
+			next[i] = found ? found - start : size;
+		} else {
+			auto first = patches[i]->find[0];
+			next[i] = heads[first];
+			heads[first] = static_cast<uint32_t>(i + 1);
+		}
+	}
+	
+	// matches are staged and written at once after the pass
+	beginTransaction();
+	
+	// matching is done on the original bytes, so a patch never sees the replacements of another one,
+	// the nearest match is taken and the first listed patch wins at a position
+	for (size_t pos = 0; pos < size && (pending > 0 || unbounded); ) {
+		size_t match = size, best = num;
+		if (cursors) {
+			for (size_t i = 0; i < num; i++) {
+				auto patch = patches[i];
+				if (patch->count > 0 && changes[i] >= patch->count)
+					continue;
+				// an occurrence inside the replaced area is skipped
+				if (next[i] < pos) {
+					auto found = findPattern(start + pos, size - pos, patch->find, patch->size);
+					next[i] = found ? found - start : size;
+				}
+				if (next[i] < match) {
+					match = next[i];
+					best = i;
+				}
 			}
-			if (kinfo->setKernelWriting(false) != KERN_SUCCESS) {
-				SYSLOG("patcher @ lookup patching failed to disable kernel writing");
-				code = Error::MemoryProtection;
-				return;
+		} else {
+			for (size_t at = pos; at < size && best == num; at++) {
+				for (auto p = heads[start[at]]; p; p = static_cast<uint32_t>(next[p-1])) {
+					auto patch = patches[p-1];
+					if ((patch->count > 0 && changes[p-1] >= patch->count) || size - at < patch->size ||
+						memcmp(start + at + 1, patch->find + 1, patch->size - 1))
+						continue;
+					match = at;
+					best = p-1;
+					break;
+				}
 			}
-			changes++;
 		}
+		
+		if (best == num)
+			break;
+		
+		auto patch = patches[best];
+		if (!stageWrite(reinterpret_cast<mach_vm_address_t>(start + match), patch->replace, patch->size, true)) {
+			SYSLOG("patcher @ lookup patching failed to stage a write");
+			abortTransaction();
+			Buffer::deleter(next);
+			Buffer::deleter(changes);
+			return;
+		}
+		
+		if (++changes[best] == patch->count)
+			pending--;
+		pos = match + patch->size;
 	}
 	
-	if (changes != patch->count) {
-		SYSLOG("patcher @ lookup patching applied only %zu patches out of %zu", changes, patch->count);
-		code = Error::MemoryIssue;
+	bool complete {true};
+	for (size_t i = 0; i < num; i++) {
+		if (patches[i]->count > 0 && changes[i] != patches[i]->count) {
+			SYSLOG("patcher @ lookup patching found only %zu patches out of %zu for %zu patch", changes[i], patches[i]->count, i);
+			complete = false;
+		} else {
+			DBGLOG("patcher @ lookup patching found %zu patches for %zu patch", changes[i], i);
+		}
 	}
+	
+	// the patches are either applied completely or not at all
+	if (!complete) {
+		SYSLOG("patcher @ lookup patching left %s untouched by %zu patches", kext->id, num);
+		abortTransaction();
+		code = Error::NoPatternFound;
+	} else if (!commitTransaction()) {
+		SYSLOG("patcher @ lookup patching failed to write to kernel");
+		code = Error::MemoryProtection;
+	}
+	
+	Buffer::deleter(next);
+	Buffer::deleter(changes);
+}
+
+void KernelPatcher::beginTransaction() {
+	transactionDepth++;
+}
+
+bool KernelPatcher::commitTransaction() {
+	if (transactionDepth == 0) {
+		SYSLOG("patcher @ commit without an open transaction");
+		return false;
+	}
+	
+	// Nested transactions are written by the outermost one
+	if (--transactionDepth > 0)
+		return true;
+	
+	if (stageSize == 0)
+		return true;
+	
+	if (kinfos.size() == 0) {
+		SYSLOG("patcher @ no kernel info to commit %zu staged bytes", stageSize);
+		code = Error::MemoryProtection;
+		stageSize = 0;
+		return false;
+	}
+	
+	// Reserve the journal beforehand, nothing may be allocated inside the window
+	size_t journalNeed = journalSize;
+	for (size_t off = 0; off < stageSize; ) {
+		auto write = reinterpret_cast<StagedWrite *>(stageBuf + off);
+		size_t padded = (write->size + StageAlign - 1) & ~(StageAlign - 1);
+		if (write->journal)
+			journalNeed += padded + sizeof(JournalEntry);
+		off += sizeof(StagedWrite) + padded;
+	}
+	
+	if (journalNeed > journalCapacity) {
+		size_t capacity = journalCapacity > 0 ? journalCapacity : PAGE_SIZE;
+		while (capacity < journalNeed)
+			capacity *= 2;
+		if (!Buffer::resize(journalBuf, journalSize, capacity)) {
+			SYSLOG("patcher @ failed to grow the journal to %zu bytes", capacity);
+			code = Error::MemoryIssue;
+			stageSize = 0;
+			return false;
+		}
+		journalCapacity = capacity;
+	}
+	
+	// Routes may jump to trampolines as soon as they are written
+	if (!sealTrampolines()) {
+		SYSLOG("patcher @ failed to seal the trampolines to commit");
+		code = Error::MemoryProtection;
+		stageSize = 0;
+		return false;
+	}
+	
+	// Interrupts stay disabled from here till the window is closed
+	uint64_t start = mach_absolute_time();
+	if (kinfos[KernelID]->setKernelWriting(true) != KERN_SUCCESS) {
+		SYSLOG("patcher @ cannot change kernel memory protection to commit");
+		code = Error::MemoryProtection;
+		stageSize = 0;
+		return false;
+	}
+	
+	size_t writes {0};
+	for (size_t off = 0; off < stageSize; writes++) {
+		auto write = reinterpret_cast<StagedWrite *>(stageBuf + off);
+		size_t padded = (write->size + StageAlign - 1) & ~(StageAlign - 1);
+		if (write->journal) {
+			memcpy(journalBuf + journalSize, reinterpret_cast<void *>(write->address), write->size);
+			auto entry = reinterpret_cast<JournalEntry *>(journalBuf + journalSize + padded);
+			entry->address = write->address;
+			entry->size = write->size;
+			journalSize += padded + sizeof(JournalEntry);
+		}
+		memcpy(reinterpret_cast<void *>(write->address), write + 1, write->size);
+		off += sizeof(StagedWrite) + padded;
+	}
+	
+	bool success = kinfos[KernelID]->setKernelWriting(false) == KERN_SUCCESS;
+	uint64_t elapsed = mach_absolute_time() - start;
+	
+	uint64_t ns {0};
+	absolutetime_to_nanoseconds(elapsed, &ns);
+	writeWindows++;
+	writeWindowTime += ns;
+	DBGLOG("patcher @ committed %zu writes (%zu bytes) in %llu ns, %zu windows took %llu ns in total, journal is %zu bytes",
+		   writes, stageSize, ns, writeWindows, writeWindowTime, journalSize);
+	
+	stageSize = 0;
+	
+	if (!success) {
+		SYSLOG("patcher @ failed to restore kernel memory protection after commit");
+		code = Error::MemoryProtection;
+	}
+	
+	return success;
+}
+
+void KernelPatcher::abortTransaction() {
+	if (stageSize > 0)
+		DBGLOG("patcher @ dropping %zu staged bytes", stageSize);
+	transactionDepth = 0;
+	stageSize = 0;
+}
+
+bool KernelPatcher::stageWrite(mach_vm_address_t address, const void *data, size_t size, bool journal) {
+	if (transactionDepth == 0) {
+		beginTransaction();
+		if (!stageWrite(address, data, size, journal)) {
+			abortTransaction();
+			return false;
+		}
+		return commitTransaction();
+	}
+	
+	size_t need = stageSize + sizeof(StagedWrite) + ((size + StageAlign - 1) & ~(StageAlign - 1));
+	if (need > stageCapacity) {
+		size_t capacity = stageCapacity > 0 ? stageCapacity : PAGE_SIZE;
+		while (capacity < need)
+			capacity *= 2;
+		if (!Buffer::resize(stageBuf, stageSize, capacity)) {
+			SYSLOG("patcher @ failed to grow the stage buffer to %zu bytes", capacity);
+			code = Error::MemoryIssue;
+			return false;
+		}
+		stageCapacity = capacity;
+	}
+	
+	auto write = reinterpret_cast<StagedWrite *>(stageBuf + stageSize);
+	write->address = address;
+	write->size = size;
+	write->journal = journal;
+	memcpy(write + 1, data, size);
+	stageSize = need;
+	
+	return true;
+}
+
+bool KernelPatcher::revertJournal(size_t mark) {
+	if (journalSize <= mark)
+		return true;
+	
+	if (kinfos.size() == 0 || kinfos[KernelID]->setKernelWriting(true) != KERN_SUCCESS) {
+		SYSLOG("patcher @ cannot change kernel memory protection to revert the journal");
+		code = Error::MemoryProtection;
+		return false;
+	}
+	
+	size_t reverted {0};
+	while (journalSize > mark) {
+		auto entry = reinterpret_cast<JournalEntry *>(journalBuf + journalSize - sizeof(JournalEntry));
+		size_t padded = (entry->size + StageAlign - 1) & ~(StageAlign - 1);
+		journalSize -= sizeof(JournalEntry) + padded;
+		memcpy(reinterpret_cast<void *>(entry->address), journalBuf + journalSize, entry->size);
+		reverted++;
+	}
+	
+	DBGLOG("patcher @ reverted %zu journaled writes", reverted);
+	
+	return kinfos[KernelID]->setKernelWriting(false) == KERN_SUCCESS;
 }
 
 mach_vm_address_t KernelPatcher::routeFunction(mach_vm_address_t from, mach_vm_address_t to, bool buildWrapper, bool kernelRoute) {
@@ -228,8 +644,19 @@ mach_vm_address_t KernelPatcher::routeFunction(mach_vm_address_t from, mach_vm_a
 	bool absolute {false};
 	
 	if (diff != static_cast<mach_vm_address_t>(newArgument)) {
-		DBGLOG("patcher @ will use absolute jumping to %llX", to);
-		absolute = true;
+		// Put an absolute jump into an island reachable from the function and jump there instead
+		auto island = kernelRoute ? allocTrampoline(LongJump, from) : nullptr;
+		auto islandAddr = reinterpret_cast<mach_vm_address_t>(island);
+		if (island && canJumpShort(from, islandAddr)) {
+			routeFunction(islandAddr, to, false, false);
+			diff = islandAddr - (from + SmallJump);
+			newArgument = static_cast<int32_t>(diff);
+			islandRoutes++;
+			DBGLOG("patcher @ will jump to %llX through an island at %llX", to, islandAddr);
+		} else {
+			DBGLOG("patcher @ will use absolute jumping to %llX", to);
+			absolute = true;
+		}
 		//SYSLOG("patcher @ cannot route %llX is too far from %llX", to, from);
 		//code = Error::PointerRange;
 		//return EINVAL;
@@ -242,124 +669,230 @@ mach_vm_address_t KernelPatcher::routeFunction(mach_vm_address_t from, mach_vm_a
 		if (!trampoline) return EINVAL;
 	}
 	
-	Patch::All *opcode, *argument;
-	if (absolute) {
-		opcode = Patch::create<Patch::Variant::U64>(from, 0x0225FF);
-		argument = Patch::create<Patch::Variant::U64>(from+sizeof(uint64_t), to);
-	} else {
-		opcode = Patch::create<Patch::Variant::U8>(from, 0xE9);
-		argument = Patch::create<Patch::Variant::U32>(from+1, newArgument);
-	}
-	
-	if (!opcode || !argument) {
-		SYSLOG("patcher @ cannot create the necessary patches");
-		code = Error::MemoryIssue;
-		Patch::deleter(opcode); Patch::deleter(argument);
-		return EINVAL;
-	}
-	
-	if (kernelRoute && kinfos[KernelID]->setKernelWriting(true) != KERN_SUCCESS) {
-		SYSLOG("patcher @ cannot change kernel memory protection");
-		code = Error::MemoryProtection;
-		Patch::deleter(opcode); Patch::deleter(argument);
-		return EINVAL;
-	}
+	Patch::All routing[] {
+		absolute ? Patch::create<Patch::Variant::U64>(from, 0x0225FF) : Patch::create<Patch::Variant::U8>(from, 0xE9),
+		absolute ? Patch::create<Patch::Variant::U64>(from+sizeof(uint64_t), to) : Patch::create<Patch::Variant::U32>(from+1, newArgument)
+	};
 	
-	opcode->patch();
-	argument->patch();
-
 	if (kernelRoute) {
-		kinfos[KernelID]->setKernelWriting(false);
-
-		auto oidx = kpatches.push_back(opcode);
-		auto aidx = kpatches.push_back(argument);
-
-		if (!oidx || !aidx) {
-			SYSLOG("patcher @ failed to store patches for later removal, you are in trouble");
-			if (oidx) kpatches.erase(oidx);
-			if (aidx) kpatches.erase(aidx);
-			Patch::deleter(opcode); Patch::deleter(argument);
+		// Reserve the storage first, so that an applied patch could always be restored
+		if (!reservePatches(arrsize(routing))) {
+			SYSLOG("patcher @ failed to store patches for later removal");
+			code = Error::MemoryIssue;
+			return EINVAL;
 		}
+		
+		// Both halves of the jump go through the same write window
+		beginTransaction();
+		for (size_t i = 0; i < arrsize(routing); i++) {
+			if (!stageWrite(routing[i].u8.address, routing[i].replacement(), routing[i].size())) {
+				SYSLOG("patcher @ cannot stage the routing patches");
+				abortTransaction();
+				return EINVAL;
+			}
+		}
+		
+		if (!commitTransaction()) {
+			SYSLOG("patcher @ cannot change kernel memory protection");
+			code = Error::MemoryProtection;
+			return EINVAL;
+		}
+
+		memcpy(&kpatches[kpatchesNum], routing, sizeof(routing));
+		kpatchesNum += arrsize(routing);
+		
+		if (absolute)
+			longRoutes++;
+		else
+			shortRoutes++;
+		DBGLOG("patcher @ %zu short (%zu via islands) and %zu long routes", shortRoutes, islandRoutes, longRoutes);
 	} else {
-		Patch::deleter(opcode); Patch::deleter(argument);
+		for (size_t i = 0; i < arrsize(routing); i++)
+			routing[i].patch();
 	}
 
 	return trampoline;
 }
 
+bool KernelPatcher::reservePatches(size_t num) {
+	if (kpatchesNum + num <= kpatchesCapacity)
+		return true;
+	
+	size_t capacity = kpatchesCapacity > 0 ? kpatchesCapacity : PAGE_SIZE / sizeof(Patch::All);
+	while (capacity < kpatchesNum + num)
+		capacity *= 2;
+	
+	// Patch records are trivially copyable and may be moved to a new allocation
+	if (!Buffer::resize(kpatches, kpatchesNum, capacity))
+		return false;
+	
+	kpatchesCapacity = capacity;
+	kpatchesAllocs++;
+	DBGLOG("patcher @ patch arena grown to %zu records with %zu allocations", capacity, kpatchesAllocs);
+	return true;
+}
+
 mach_vm_address_t KernelPatcher::createTrampoline(mach_vm_address_t func, size_t min) {
-	if (!disasm.init()) {
-		SYSLOG("patcher @ failed to use disasm");
-		code = Error::DisasmFailure;
-		return 0;
+	// Relative destination offset, capstone is only needed for the rare instructions the length decoder skips
+	size_t off = Disassembler::quickInstructionSize(func, min);
+	if (!off) {
+		DBGLOG("patcher @ length decoder gave up at %llX, using capstone", func);
+		if (!disasm.init()) {
+			SYSLOG("patcher @ failed to use disasm");
+			code = Error::DisasmFailure;
+			return 0;
+		}
+		off = disasm.instructionSize(func, min);
 	}
 	
-	// Relative destination offset
-	size_t off = disasm.instructionSize(func, min);
-	
 	if (!off || off > PAGE_SIZE - LongJump) {
 		SYSLOG("patcher @ unsupported destination offset %zu", off);
 		code = Error::DisasmFailure;
 		return 0;
 	}
 	
-	auto p = Page::create();
-	if (!p) {
-		SYSLOG("patcher @ failed to generate a page object");
+	// A trampoline near the function jumps back with a relative jump
+	auto t = allocTrampoline(off + LongJump, func);
+	if (!t) {
+		SYSLOG("patcher @ failed to allocate a trampoline");
 		code = Error::MemoryIssue;
 		return 0;
 	}
 	
-	if (!p->alloc()) {
-		SYSLOG("patcher @ failed to allocate a new page");
-		code = Error::MemoryIssue;
-		Page::deleter(p);
-		return 0;
-	}
-	
 	// Copy the prologue, assuming it is PIC
-	memcpy(p->p, reinterpret_cast<void *>(func), off);
+	memcpy(t, reinterpret_cast<void *>(func), off);
 	
-	// Add a jump
-	routeFunction(reinterpret_cast<mach_vm_address_t>(p->p+off), func+off, false, false);
+	// Add a jump, the slab is made executable when the route is committed
+	routeFunction(reinterpret_cast<mach_vm_address_t>(t+off), func+off, false, false);
 	if (getError() != Error::NoError) {
 		SYSLOG("patcher @ failed to route an inner trempoline");
-	} else if (!p->protect(VM_PROT_READ|VM_PROT_EXECUTE)) {
+		return 0;
+	}
+	
+	return reinterpret_cast<mach_vm_address_t>(t);
+}
+
+void KernelPatcher::getRouteStatistics(size_t &shortJumps, size_t &longJumps, size_t &islands) {
+	shortJumps = shortRoutes;
+	longJumps = longRoutes;
+	islands = islandRoutes;
+}
+
+bool KernelPatcher::canJumpShort(mach_vm_address_t from, mach_vm_address_t to) {
+	mach_vm_address_t diff = to - (from + SmallJump);
+	return diff == static_cast<mach_vm_address_t>(static_cast<int32_t>(diff));
+}
+
+uint8_t *KernelPatcher::allocTrampoline(size_t size, mach_vm_address_t near) {
+	size = (size + TrampolineAlign - 1) & ~(TrampolineAlign - 1);
+	if (size > PAGE_SIZE)
+		return nullptr;
+	
+	bool reachable {true};
+	if (near && kpages.size() > 0) {
+		auto page = reinterpret_cast<mach_vm_address_t>(kpages[kpages.last()]->p);
+		reachable = canJumpShort(near, page) && canJumpShort(near, page + PAGE_SIZE);
+	}
+	
+	// Trampolines on a sealed page may be running already, and a page is never made writable and
+	// executable at once, so the free space left on it is given up
+	if (kpages.size() == 0 || slabSealed || slabUsed + size > PAGE_SIZE || !reachable) {
+		// The previous page is left as is, it is executable unless a commit is pending
+		if (!sealTrampolines())
+			return nullptr;
+		
+		auto p = Page::create();
+		if (!p) {
+			SYSLOG("patcher @ failed to generate a page object");
+			return nullptr;
+		}
+		
+		// Anywhere is still fine when no page is free nearby, the caller checks the distance
+		if ((!near || !p->allocNear(static_cast<vm_address_t>(near), IslandRange)) && !p->alloc()) {
+			SYSLOG("patcher @ failed to allocate a new page");
+			Page::deleter(p);
+			return nullptr;
+		}
+		
+		if (!kpages.push_back(p)) {
+			SYSLOG("patcher @ unable to store a page object");
+			Page::deleter(p);
+			return nullptr;
+		}
+		
+		slabUsed = 0;
+		slabSealed = false;
+	}
+	
+	auto t = kpages[kpages.last()]->p + slabUsed;
+	slabUsed += size;
+	slabTrampolines++;
+	
+	return t;
+}
+
+bool KernelPatcher::sealTrampolines() {
+	if (slabSealed || kpages.size() == 0)
+		return true;
+	
+	if (!kpages[kpages.last()]->protect(VM_PROT_READ|VM_PROT_EXECUTE)) {
 		SYSLOG("patcher @ failed to set executable permissions");
-		code = Error::MemoryProtection;
-	} else if (!kpages.push_back(p)) {
-		SYSLOG("patcher @ unable to store a page object");
-		code = Error::MemoryIssue;
-	} else {
-		return reinterpret_cast<mach_vm_address_t>(p->p);
+		return false;
 	}
 	
-	Page::deleter(p);
-	return 0;
+	slabSealed = true;
+	slabProtects++;
+	DBGLOG("patcher @ sealed trampoline slab, %zu trampolines in %zu pages with %zu protection changes",
+		   slabTrampolines, kpages.size(), slabProtects);
+	return true;
 }
 
 void KernelPatcher::onKextSummariesUpdated() {
 	DBGLOG("patcher @ invoked at kext loading/unloading");
 	
-	if (that && that->khandlers.size() > 0 && that->loadedKextSummaries) {
-		auto num = (*that->loadedKextSummaries)->numSummaries;
-		if (num > 0) {
-			OSKextLoadedKextSummary &last = (*that->loadedKextSummaries)->summaries[num-1];
-			DBGLOG("patcher @ last kext is %llX and its name is %.*s", last.address, KMOD_MAX_NAME, last.name);
-			// We may add khandlers items inside the handler
-			for (size_t i = 0; i < that->khandlers.size(); i++) {
-				if (!strncmp(that->khandlers[i]->id, last.name, KMOD_MAX_NAME)) {
-					DBGLOG("patcher @ caught the right kext at %llX, invoking handler", last.address);
-					that->khandlers[i]->address = last.address;
-					that->khandlers[i]->size = last.size;
-					that->khandlers[i]->handler(that->khandlers[i]);
-					// Remove the item
-					that->khandlers.erase(i);
-					return;
-				}
-			}
-		} else {
+	if (that && that->loadedKextSummaries && *that->loadedKextSummaries) {
+		auto header = *that->loadedKextSummaries;
+		auto num = header->numSummaries;
+		if (num == 0) {
 			SYSLOG("patcher @ no kext is currently loaded, this should not happen");
+			return;
+		}
+		
+		// Load tags only grow, so a kext is new if its tag is above any seen before,
+		// the number of summaries says nothing when a kext is unloaded and another one is loaded
+		uint32_t lastLoadTag = that->kextLastLoadTag;
+		size_t compared {0}, dispatched {0};
+		for (uint32_t i = 0; i < num; i++) {
+			OSKextLoadedKextSummary &curr = header->summaries[i];
+			if (curr.loadTag <= lastLoadTag)
+				continue;
+			if (curr.loadTag > that->kextLastLoadTag)
+				that->kextLastLoadTag = curr.loadTag;
+			dispatched++;
+			if (that->khandlersNum == 0)
+				continue;
+			DBGLOG("patcher @ new kext is %llX and its name is %.*s", curr.address, KMOD_MAX_NAME, curr.name);
+			
+			auto hash = hashKextId(curr.name);
+			for (auto slot = &that->khandlers[hash % HandlerBuckets]; *slot; slot = &(*slot)->next) {
+				auto handler = *slot;
+				compared++;
+				if (handler->hash != hash || strncmp(handler->id, curr.name, KMOD_MAX_NAME))
+					continue;
+				
+				DBGLOG("patcher @ caught the right kext at %llX, invoking handler", curr.address);
+				// Unlink first, we may add handlers inside the handler
+				*slot = handler->next;
+				that->khandlersNum--;
+				handler->address = curr.address;
+				handler->size = curr.size;
+				handler->handler(handler);
+				KextHandler::deleter(handler);
+				break;
+			}
 		}
+		
+		DBGLOG("patcher @ dispatched %zu summaries with %zu handler comparisons, %zu handlers left",
+			   dispatched, compared, that->khandlersNum);
 	}
 }
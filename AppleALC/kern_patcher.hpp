@@ -14,7 +14,7 @@
 #include "kern_mach.hpp"
 #include "kern_disasm.hpp"
 
-namespace Patch { union All; void deleter(All *); }
+namespace Patch { union All; }
 class OSKextLoadedKextSummaryHeader;
 
 class KernelPatcher {
@@ -33,7 +33,8 @@ public:
 		DisasmFailure,
 		MemoryIssue,
 		MemoryProtection,
-		PointerRange
+		PointerRange,
+		NoPatternFound
 	};
 	
 	/**
@@ -92,6 +93,21 @@ public:
 	 */
 	size_t loadKinfo(KextInfo *info);
 	
+	/**
+	 *  Release the memory of a loaded kinfo, its id is not reused
+	 *
+	 *  @param info kext to unload, marked as unloaded on success
+	 *
+	 *  @return released bytes
+	 */
+	size_t unloadKinfo(KextInfo *info);
+	
+	/**
+	 *  Release the prelinked image used for kext loading, should be called once all kexts are loaded
+	 *  A compressed image keeps its decoded data up to __PRELINK_INFO till then, a plain one only the kext list
+	 */
+	void freePrelinkedImage();
+	
 	/**
 	 *  Kernel kinfo id
 	 */
@@ -131,6 +147,18 @@ public:
 	 */
 	mach_vm_address_t solveSymbol(size_t id, const char *symbol);
 	
+	/**
+	 *  Solve multiple kinfo symbols at once
+	 *
+	 *  @param id        loaded kinfo id
+	 *  @param symbols   symbols to solve
+	 *  @param num       number of symbols passed
+	 *  @param addresses running symbol addresses or 0, must fit num entries
+	 *
+	 *  @return number of solved symbols
+	 */
+	size_t solveSymbols(size_t id, const char * const symbols[], size_t num, mach_vm_address_t addresses[]);
+	
 	/**
 	 *  Hook kext loading and unloading to access kexts at early stage
 	 */
@@ -157,17 +185,23 @@ public:
 		mach_vm_address_t address {0};
 		size_t size {0};
 		t_handler handler {nullptr};
+		
+		/**
+		 *  Registry bucket chaining, managed by KernelPatcher
+		 */
+		uint32_t hash {0};
+		KextHandler *next {nullptr};
 	};
 	
 	/**
-	 *  Enqueue handler processing at kext loading
+	 *  Enqueue handler processing at kext loading, the patcher takes the ownership
 	 *
 	 *  @param handler  handler to process
 	 */
 	void waitOnKext(KextHandler *handler);
 
 	/**
-	 *  Arbitrary kext find/replace patch
+	 *  Arbitrary kext find/replace patch, count is the exact number of occurrences to replace, 0 replaces all of them
 	 */
 	struct LookupPatch {
 		KextInfo *kext;
@@ -184,6 +218,51 @@ public:
 	 */
 	void applyLookupPatch(const LookupPatch *patch);
 	
+	/**
+	 *  Apply several find/replace patches to the same kext in a single pass
+	 *  Unlike applying the patches one by one, every pattern is matched against the original kext bytes:
+	 *  - a patch never matches the bytes replaced by another one, so patches cannot be chained
+	 *  - matches never overlap, the first listed patch wins at a position and its area is skipped
+	 *  - patches with equal patterns take the occurrences in their order, the same as sequentially
+	 *  - a patch with a non-zero count is applied exactly count times
+	 *  - a patch with a zero count replaces every remaining occurrence, finding none is not an error
+	 *  Nothing is written and NoPatternFound is set unless every counted patch is found,
+	 *  replaced bytes are journaled and reverted at deinit
+	 *
+	 *  @param patches patches to apply
+	 *  @param num     number of patches
+	 */
+	void applyLookupPatches(const LookupPatch * const patches[], size_t num);
+	
+	/**
+	 *  Start staging kernel memory writes, transactions may be nested
+	 */
+	void beginTransaction();
+	
+	/**
+	 *  Finish a transaction, the outermost one writes all the staged changes in a single write window
+	 *
+	 *  @return true on success
+	 */
+	bool commitTransaction();
+	
+	/**
+	 *  Drop all the staged changes and close all the transactions
+	 */
+	void abortTransaction();
+	
+	/**
+	 *  Stage a kernel memory write, written immediately outside of a transaction
+	 *
+	 *  @param address destination address
+	 *  @param data    bytes to write
+	 *  @param size    number of bytes
+	 *  @param journal save the original bytes at commit to revert them at deinit
+	 *
+	 *  @return true on success
+	 */
+	bool stageWrite(mach_vm_address_t address, const void *data, size_t size, bool journal=false);
+	
 	/**
 	 *  Route function to function
 	 *
@@ -195,11 +274,20 @@ public:
 	 *  @return wrapper pointer or 0 on success
 	 */
 	mach_vm_address_t routeFunction(mach_vm_address_t from, mach_vm_address_t to, bool buildWrapper=false, bool kernelRoute=true);
+	
+	/**
+	 *  Obtain kernel route statistics
+	 *
+	 *  @param shortJumps routes made with a relative jump
+	 *  @param longJumps  routes made with an absolute jump
+	 *  @param islands    short routes going through an island stub
+	 */
+	void getRouteStatistics(size_t &shortJumps, size_t &longJumps, size_t &islands);
 
 private:
 
 	/**
-	 *  Created routed trampoline page
+	 *  Created routed trampoline in the trampoline slab
 	 *
 	 *  @param func original area
 	 *  @param min  minimal amount of bytes that will be overwritten
@@ -208,6 +296,34 @@ private:
 	 */
 	mach_vm_address_t createTrampoline(mach_vm_address_t func, size_t min);
 	
+	/**
+	 *  Carve a writable trampoline out of the last slab page, a new page is allocated when it is full,
+	 *  already sealed or out of relative jump range of near
+	 *
+	 *  @param size trampoline size
+	 *  @param near address the trampoline is preferred to be reachable from, 0 if any
+	 *
+	 *  @return trampoline pointer or nullptr
+	 */
+	uint8_t *allocTrampoline(size_t size, mach_vm_address_t near=0);
+	
+	/**
+	 *  Check whether a relative jump at from can reach to
+	 *
+	 *  @param from jump address
+	 *  @param to   destination address
+	 *
+	 *  @return true if SmallJump is enough
+	 */
+	static bool canJumpShort(mach_vm_address_t from, mach_vm_address_t to);
+	
+	/**
+	 *  Make the last slab page executable, done before committing the routes that use it
+	 *
+	 *  @return true on success
+	 */
+	bool sealTrampolines();
+	
 	/**
 	 *  Called at kext loading and unloading if kext listening is enabled
 	 */
@@ -223,26 +339,161 @@ private:
 	 */
 	Disassembler disasm;
 
+	/**
+	 *  Loads kinfo information from the prelinked image if the kext is present there
+	 *
+	 *  @param id kext identifier
+	 *
+	 *  @return loaded kinfo id or INVALID
+	 */
+	size_t loadPrelinkedKinfo(const char *id);
+
 	/**
 	 *  Loaded kernel items
 	 */
 	evector<MachInfo *, MachInfo::deleter> kinfos;
 	
 	/**
-	 *  Applied patches
+	 *  Prelinked image kept during kext loading
 	 */
-	evector<Patch::All *, Patch::deleter> kpatches;
+	MachInfo *prelinkInfo {nullptr};
 	
 	/**
-	 *  Awaiting kext notificators
+	 *  Prelinked image loading was attempted
 	 */
-	evector<KextHandler *, KextHandler::deleter> khandlers;
+	bool prelinkTried {false};
 	
 	/**
-	 *  Allocated pages
+	 *  Applied patches stored inline in a single growable arena
+	 */
+	Patch::All *kpatches {nullptr};
+	size_t kpatchesNum {0};
+	size_t kpatchesCapacity {0};
+	
+	/**
+	 *  Number of arena allocations made for the applied patches
+	 */
+	size_t kpatchesAllocs {0};
+	
+	/**
+	 *  Ensure the arena fits more patches
+	 *
+	 *  @param num number of patches to add
+	 *
+	 *  @return true on success
+	 */
+	bool reservePatches(size_t num);
+	
+	/**
+	 *  Lookup patches applied together are searched one by one with findPattern up to this number,
+	 *  more of them are matched by a single byte walk over the kext
+	 */
+	static constexpr size_t LookupCursorPatches {16};
+	
+	/**
+	 *  Awaiting kext notificators hashed by their identifiers, chains keep the registration order
+	 */
+	static constexpr size_t HandlerBuckets {32};
+	KextHandler *khandlers[HandlerBuckets] {};
+	size_t khandlersNum {0};
+	
+	/**
+	 *  Highest load tag of the dispatched kext summaries
+	 */
+	uint32_t kextLastLoadTag {0};
+	
+	/**
+	 *  Hash a kext identifier for the handler registry
+	 *
+	 *  @param id kext identifier, at most KMOD_MAX_NAME bytes are used
+	 *
+	 *  @return identifier hash
+	 */
+	static uint32_t hashKextId(const char *id);
+	
+	/**
+	 *  Allocated trampoline slab pages, only the last one may have free space
 	 */
 	evector<Page *, Page::deleter> kpages;
 	
+	/**
+	 *  Trampoline alignment within a slab page
+	 */
+	static constexpr size_t TrampolineAlign {16};
+	
+	/**
+	 *  Used bytes of the last slab page and its protection state
+	 */
+	size_t slabUsed {0};
+	bool slabSealed {true};
+	
+	/**
+	 *  Slab statistics
+	 */
+	size_t slabTrampolines {0};
+	size_t slabProtects {0};
+	
+	/**
+	 *  Island pages are searched within this distance of the routed function
+	 */
+	static constexpr vm_size_t IslandRange {0x7FF00000};
+	
+	/**
+	 *  Kernel route statistics
+	 */
+	size_t shortRoutes {0};
+	size_t longRoutes {0};
+	size_t islandRoutes {0};
+	
+	/**
+	 *  Staged kernel memory write header, size bytes of data padded to StageAlign follow it
+	 */
+	struct StagedWrite {
+		mach_vm_address_t address;
+		size_t size;
+		bool journal;
+	};
+	static constexpr size_t StageAlign {sizeof(uint64_t)};
+	
+	/**
+	 *  Journal entry trailing size bytes of original data padded to StageAlign,
+	 *  so that the journal could be walked backwards
+	 */
+	struct JournalEntry {
+		mach_vm_address_t address;
+		size_t size;
+	};
+	
+	/**
+	 *  Staged writes of the current transaction
+	 */
+	uint8_t *stageBuf {nullptr};
+	size_t stageSize {0};
+	size_t stageCapacity {0};
+	size_t transactionDepth {0};
+	
+	/**
+	 *  Original bytes of the committed journaled writes
+	 */
+	uint8_t *journalBuf {nullptr};
+	size_t journalSize {0};
+	size_t journalCapacity {0};
+	
+	/**
+	 *  Restore journaled writes made after the mark in the reverse order
+	 *
+	 *  @param mark journal size to return to
+	 *
+	 *  @return true on success
+	 */
+	bool revertJournal(size_t mark);
+	
+	/**
+	 *  Write window statistics
+	 */
+	size_t writeWindows {0};
+	uint64_t writeWindowTime {0};
+	
 	/**
 	 *  Current error code
 	 */
@@ -268,6 +519,28 @@ private:
 		"/System/Library/PrelinkedKernels/prelinkedkernel" //compressed one
 		
 	};
+	
+	/**
+	 *  Symbol cache path format, filled with the kinfo identifier
+	 */
+	static constexpr size_t symbolCachePathSize {128};
+	const char *symbolCacheFormat {"/Library/Caches/AppleALC/%s.symcache"};
+	
+	/**
+	 *  Symbol cache directory, probed once so that no cache is looked up per kinfo without it
+	 */
+	const char *symbolCacheDir {"/Library/Caches/AppleALC"};
+	bool symbolCacheTried {false};
+	bool symbolCacheFound {false};
+	
+	/**
+	 *  Possible prelinked image paths
+	 */
+	static constexpr size_t prelinkedPathsNum {2};
+	const char *prelinkedPaths[prelinkedPathsNum] {
+		"/System/Library/PrelinkedKernels/prelinkedkernel",
+		"/System/Library/Caches/com.apple.kext.caches/Startup/kernelcache"
+	};
 };
 
 #endif /* kern_patcher_hpp */
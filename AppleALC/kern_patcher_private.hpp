@@ -60,6 +60,12 @@ namespace Patch {
 		void restore() {
 			writeType(address, original);
 		}
+		size_t size() const {
+			return sizeof(VV<T>);
+		}
+		const void *replacement() const {
+			return &replaced;
+		}
 	};
 
 	union All {
@@ -96,20 +102,38 @@ namespace Patch {
 				default: SYSLOG("patcher @ unsupported patch type %d, cannot restore", static_cast<int>(u8.type));
 			}
 		}
+		
+		size_t size() const {
+			switch (u8.type) {
+				case Variant::U8: return u8.size();
+				case Variant::U16: return u16.size();
+				case Variant::U32: return u32.size();
+				case Variant::U64: return u64.size();
+				case Variant::U128: return u128.size();
+				default: return 0;
+			}
+		}
+		
+		const void *replacement() const {
+			switch (u8.type) {
+				case Variant::U8: return u8.replacement();
+				case Variant::U16: return u16.replacement();
+				case Variant::U32: return u32.replacement();
+				case Variant::U64: return u64.replacement();
+				case Variant::U128: return u128.replacement();
+				default: return nullptr;
+			}
+		}
 	};
 	
 	template <Variant T>
-	static All *create(mach_vm_address_t addr, VV<T> rep) {
-		return new All(P<T>(addr, rep));
+	static All create(mach_vm_address_t addr, VV<T> rep) {
+		return All(P<T>(addr, rep));
 	}
 	
 	template <Variant T>
-	static All *create(mach_vm_address_t addr, VV<T> org, VV<T> rep) {
-		return new All(P<T>(addr, org, rep));
-	}
-	
-	static void deleter(All *i) {
-		delete i;
+	static All create(mach_vm_address_t addr, VV<T> org, VV<T> rep) {
+		return All(P<T>(addr, org, rep));
 	}
 }
 
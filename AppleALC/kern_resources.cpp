@@ -2190,7 +2190,7 @@ static const KextPatch patches4[] {
 	{ { &kextList[2], patchBuf74, patchBuf75, 4, 2 }, 13, KernelPatcher::KernelAny },
 	{ { &kextList[2], patchBuf76, patchBuf77, 4, 2 }, 15, KernelPatcher::KernelAny },
 };
-static const uint32_t revisions1[] { 0x100004, 0x100202, 0x100100, };
+static const uint32_t revisions1[] { 0x100004, 0x100100, 0x100202, };
 static const uint8_t file15[] {
 	0x78, 0x9C, 0xED, 0x5D, 0x5B, 0x73, 0xE2, 0x4A, 0x0E, 0x7E, 0x9E, 0xFD, 0x15, 0xB3, 0xF3, 0x9A, 0x3A, 0x07, 0xDF, 0x6D, 0xB6, 0x66, 0x67, 0x8B, 
 	0x34, 0x09, 0xF8, 0x42, 0x60, 0x26, 0x10, 0x18, 0xDE, 0x8C, 0x31, 0x60, 0xF0, 0xFD, 0x42, 0x07, 0x7E, 0xFD, 0x3A, 0x27, 0x63, 0x73, 0x89, 0x4D, 
@@ -18578,6 +18578,77 @@ VendorModInfo vendorMod[] {
 
 const size_t vendorModSize {7};
 
+// Codec index section
+
+const CodecModIndex codecModIndex[] {
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0899, &vendorMod[2], &codecModRealtek[19] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0235, &vendorMod[2], &codecModRealtek[2] },
+	{ 0x10EC0662, &vendorMod[2], &codecModRealtek[9] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x11060441, &vendorMod[3], &codecModVIA[1] },
+	{ 0x11D4198B, &vendorMod[5], &codecModAnalogDevices[0] },
+	{ 0x10EC0663, &vendorMod[2], &codecModRealtek[10] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x11D4989B, &vendorMod[5], &codecModAnalogDevices[1] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0882, &vendorMod[2], &codecModRealtek[12] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x11068446, &vendorMod[3], &codecModVIA[0] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0883, &vendorMod[2], &codecModRealtek[13] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0270, &vendorMod[2], &codecModRealtek[6] },
+	{ 0x10EC0255, &vendorMod[2], &codecModRealtek[3] },
+	{ 0x14F1506E, &vendorMod[6], &codecModConexant[0] },
+	{ 0x10EC0892, &vendorMod[2], &codecModRealtek[18] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0885, &vendorMod[2], &codecModRealtek[14] },
+	{ 0x10EC0668, &vendorMod[2], &codecModRealtek[11] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0272, &vendorMod[2], &codecModRealtek[7] },
+	{ 0x10EC0900, &vendorMod[2], &codecModRealtek[0] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0887, &vendorMod[2], &codecModRealtek[15] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0888, &vendorMod[2], &codecModRealtek[16] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0282, &vendorMod[2], &codecModRealtek[8] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0889, &vendorMod[2], &codecModRealtek[17] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0268, &vendorMod[2], &codecModRealtek[4] },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0xFFFFFFFF, nullptr, nullptr },
+	{ 0x10EC0269, &vendorMod[2], &codecModRealtek[5] },
+	{ 0x10EC0233, &vendorMod[2], &codecModRealtek[1] },
+};
+const uint32_t codecModIndexSeed {0x12EBAA83};
+const uint32_t codecModIndexBits {6};
+
 // ControllerMod section
 
 static const uint8_t patchBuf274[] { 0x20, 0x8C, };
@@ -18650,3 +18721,20 @@ ControllerModInfo controllerMod[] {
 };
 
 const size_t controllerModSize {8};
+
+// Controller index section
+
+static const size_t controllerCandidates0[] { 0x4, 0x5, 0x6, 0x7, };
+static const size_t controllerCandidates1[] { 0x3, };
+static const size_t controllerCandidates2[] { 0x1, };
+static const size_t controllerCandidates3[] { 0x0, };
+static const size_t controllerCandidates4[] { 0x2, };
+const ControllerModIndex controllerModIndex[] {
+	{ 0x80860166, controllerCandidates0, 4 },
+	{ 0x80860412, controllerCandidates1, 1 },
+	{ 0x80860C0C, controllerCandidates2, 1 },
+	{ 0x80868CA0, controllerCandidates3, 1 },
+	{ 0x80868D20, controllerCandidates4, 1 },
+};
+
+const size_t controllerModIndexSize {5};
@@ -48,8 +48,19 @@ struct ControllerModInfo {
 	size_t patchNum;
 };
 
+/**
+ *  Controller candidates for a vendor << 16 | device key, the index is sorted by key
+ *  Candidates are controllerMod indices with platform-specific entries going first
+ */
+struct ControllerModIndex {
+	uint32_t key;
+	const size_t *mods;
+	size_t modNum;
+};
+
 /**
  *  Corresponds to Info.plist resource file of each codec
+ *  Revisions are sorted in ascending order
  */
 struct CodecModInfo {
 	struct File {
@@ -84,6 +95,18 @@ struct VendorModInfo {
 	const size_t codecsNum;
 };
 
+/**
+ *  Perfect hash index of all the codecs keyed by vendor << 16 | codec
+ *  A key may only be found at (key * codecModIndexSeed) >> (32 - codecModIndexBits) slot
+ *  Empty slots have an Empty key and no codec
+ */
+struct CodecModIndex {
+	static constexpr uint32_t Empty {0xFFFFFFFF};
+	uint32_t key;
+	const VendorModInfo *vendor;
+	const CodecModInfo *codec;
+};
+
 /**
  *  Generated resource data
  */
@@ -96,8 +119,29 @@ extern const size_t kextListSize;
 extern ControllerModInfo controllerMod[];
 extern const size_t controllerModSize;
 
+extern const ControllerModIndex controllerModIndex[];
+extern const size_t controllerModIndexSize;
+
 extern VendorModInfo vendorMod[];
 extern const size_t vendorModSize;
 
+extern const CodecModIndex codecModIndex[];
+extern const uint32_t codecModIndexSeed;
+extern const uint32_t codecModIndexBits;
+
+/**
+ *  Find a codec with a single codecModIndex probe
+ *
+ *  @param vendor codec vendor
+ *  @param codec  codec device
+ *
+ *  @return index entry or nullptr
+ */
+inline const CodecModIndex *findCodecMod(uint16_t vendor, uint16_t codec) {
+	uint32_t key = static_cast<uint32_t>(vendor) << 16 | codec;
+	auto &entry = codecModIndex[static_cast<uint32_t>(key * codecModIndexSeed) >> (32 - codecModIndexBits)];
+	return entry.codec && entry.key == key ? &entry : nullptr;
+}
+
 
 #endif /* kern_resource_hpp */
@@ -0,0 +1,33 @@
+//
+//  kern_symcache.hpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef kern_symcache_hpp
+#define kern_symcache_hpp
+
+#include <stdint.h>
+
+/**
+ *  On-disk symbol cache shared by MachInfo and SymbolCacheGenerator
+ *
+ *  The file consists of this header, count nlist_64 entries with n_strx
+ *  relative to the string pool, and stringsSize bytes of the pool itself.
+ *  n_value fields are unslid, exactly as in the binary the cache was made of,
+ *  whose __TEXT address is recorded to reject a cache of a relocated image.
+ */
+struct SymbolCacheHeader {
+	static constexpr uint32_t Magic {0x43595341}; // 'ASYC'
+	static constexpr uint32_t Version {2};
+	static constexpr uint32_t MaxSize {0x10000};
+	uint32_t magic;
+	uint32_t version;
+	uint8_t uuid[16];   // LC_UUID of the binary the cache was made of
+	uint32_t count;     // number of symbol entries
+	uint32_t stringsSize;
+	uint64_t textAddr;  // __TEXT vm address of the binary the cache was made of
+};
+
+#endif /* kern_symcache_hpp */
@@ -32,6 +32,43 @@ const char *strstr(const char *stack, const char *needle, size_t len) {
 	return nullptr;
 }
 
+const uint8_t *findPattern(const uint8_t *data, size_t size, const uint8_t *pattern, size_t len) {
+	if (len == 0 || size < len)
+		return nullptr;
+	
+	// the last position the pattern may start at
+	const uint8_t *end = data + size - len;
+	const uint8_t *curr = data;
+	
+	// Kernel code may not use vector registers, so the candidates are found in general purpose ones.
+	// A zero byte of v marks a position with matching first and last bytes, higher marks may be false.
+	static constexpr uint64_t ones {0x0101010101010101ULL};
+	static constexpr uint64_t highs {0x8080808080808080ULL};
+	const uint64_t first = ones * pattern[0];
+	const uint64_t last = ones * pattern[len-1];
+	
+	while (end - curr >= 7) {
+		uint64_t head, tail;
+		memcpy(&head, curr, sizeof(head));
+		memcpy(&tail, curr + len - 1, sizeof(tail));
+		uint64_t v = (head ^ first) | (tail ^ last);
+		for (uint64_t mask = (v - ones) & ~v & highs; mask; mask &= mask - 1) {
+			auto candidate = curr + (__builtin_ctzll(mask) >> 3);
+			if (memcmp(candidate, pattern, len) == 0)
+				return candidate;
+		}
+		curr += sizeof(uint64_t);
+	}
+	
+	// scalar tail
+	for (; curr <= end; curr++) {
+		if (*curr == pattern[0] && memcmp(curr, pattern, len) == 0)
+			return curr;
+	}
+	
+	return nullptr;
+}
+
 extern "C" void *kern_os_calloc(size_t num, size_t size) {
 	return kern_os_malloc(num * size); // malloc bzeroes the buffer
 }
@@ -43,6 +80,26 @@ bool Page::alloc() {
 	return vm_allocate(kernel_map, reinterpret_cast<vm_address_t *>(&p), PAGE_SIZE, VM_FLAGS_ANYWHERE) == KERN_SUCCESS;
 }
 
+bool Page::allocNear(vm_address_t hint, vm_size_t range) {
+	if (p && vm_deallocate(kernel_map, reinterpret_cast<vm_address_t>(p), PAGE_SIZE) != KERN_SUCCESS)
+		return false;
+	p = nullptr;
+	
+	hint &= ~static_cast<vm_address_t>(PAGE_MASK);
+	for (size_t i = 1; i <= NearAttempts && i * NearStep < range; i++) {
+		// try above and below the hint alternately
+		vm_address_t candidates[] {hint + i * NearStep, hint - i * NearStep};
+		for (auto addr : candidates) {
+			if (vm_allocate(kernel_map, &addr, PAGE_SIZE, VM_FLAGS_FIXED) == KERN_SUCCESS) {
+				p = reinterpret_cast<uint8_t *>(addr);
+				return true;
+			}
+		}
+	}
+	
+	return false;
+}
+
 bool Page::protect(vm_prot_t prot) {
 	if (!p) return false;
 	
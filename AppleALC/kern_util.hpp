@@ -10,6 +10,7 @@
 
 #include <libkern/libkern.h>
 #include <mach/vm_prot.h>
+#include <mach/vm_types.h>
 
 extern bool debugEnabled;
 extern bool lowMemory;
@@ -39,6 +40,30 @@ extern bool lowMemory;
  */
 const char *strstr(const char *stack, const char *needle, size_t len);
 
+/**
+ *  @brief  Binary pattern search filtering 8 positions at a time by the first and last pattern bytes
+ *
+ *  @param data     Data to search in
+ *  @param size     Data size
+ *  @param pattern  Pattern to search for
+ *  @param len      Pattern length
+ *
+ *  @return first pattern address if there or nullptr
+ */
+const uint8_t *findPattern(const uint8_t *data, size_t size, const uint8_t *pattern, size_t len);
+
+/**
+ *  Static array element count
+ *
+ *  @param array static array
+ *
+ *  @return number of elements
+ */
+template <typename T, size_t N>
+constexpr size_t arrsize(const T (&array)[N]) {
+	return N;
+}
+
 /**
  *  @brief  C-style memory management from libkern, missing from headers
  */
@@ -50,17 +75,44 @@ extern "C" {
 }
 
 /**
- *  Typed buffer allocator
+ *  Typed buffer allocator for plain data types
  */
 namespace Buffer {
 	template <typename T>
 	T *create(size_t size) {
-		return new T[size];
+		// the byte size must not wrap around
+		if (size > static_cast<size_t>(-1) / sizeof(T))
+			return nullptr;
+		return static_cast<T *>(kern_os_malloc(sizeof(T) * size));
+	}
+	
+	/**
+	 *  Move a buffer allocated by create to a new allocation of another size
+	 *  kern_os_realloc is not used, it copies even when shrinking and frees the buffer when it fails,
+	 *  both allocations exist while the elements are copied
+	 *
+	 *  @param buf  buffer to resize, stays valid on failure
+	 *  @param used number of elements to keep
+	 *  @param size new element count
+	 *
+	 *  @return true on success
+	 */
+	template <typename T>
+	bool resize(T *&buf, size_t used, size_t size) {
+		auto nbuf = create<T>(size);
+		if (!nbuf)
+			return false;
+		if (buf) {
+			memcpy(nbuf, buf, sizeof(T) * (used < size ? used : size));
+			kern_os_free(buf);
+		}
+		buf = nbuf;
+		return true;
 	}
 	
 	template <typename T>
 	void deleter(T *buf) {
-		delete[] buf;
+		kern_os_free(buf);
 	}
 }
 
@@ -75,6 +127,22 @@ struct Page {
 	 */
 	bool alloc();
 	
+	/**
+	 *  Allocates a page at a fixed address as close to the hint as possible
+	 *
+	 *  @param hint  desired address
+	 *  @param range maximum distance from the hint
+	 *
+	 *  @return true on success
+	 */
+	bool allocNear(vm_address_t hint, vm_size_t range);
+	
+	/**
+	 *  Search step and attempt count for allocNear
+	 */
+	static constexpr vm_size_t NearStep {0x100000};
+	static constexpr size_t NearAttempts {64};
+	
 	/**
 	 *  Sets page protection
 	 *
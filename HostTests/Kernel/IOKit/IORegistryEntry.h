@@ -0,0 +1,23 @@
+//
+//  IORegistryEntry.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_IORegistryEntry_h
+#define host_IORegistryEntry_h
+
+#include <libkern/c++/OSObject.h>
+
+// Declarations for the helpers compiled along with the resources, the registry itself is never used
+
+class IORegistryPlane;
+
+class IORegistryEntry : public OSObject {
+public:
+	OSObject *getProperty(const char *aKey) const;
+	const char *getName(const IORegistryPlane *plane = nullptr) const;
+};
+
+#endif /* host_IORegistryEntry_h */
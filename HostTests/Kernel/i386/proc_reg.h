@@ -0,0 +1,22 @@
+//
+//  proc_reg.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_proc_reg_h
+#define host_proc_reg_h
+
+#include <stdint.h>
+
+// CR0 is emulated with a variable, so that write protection toggling could be verified
+
+#define CR0_WP 0x00010000
+
+extern "C" {
+	uintptr_t get_cr0(void);
+	void set_cr0(uintptr_t value);
+}
+
+#endif /* host_proc_reg_h */
@@ -0,0 +1,18 @@
+//
+//  clock.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_clock_h
+#define host_clock_h
+
+#include <stdint.h>
+
+extern "C" {
+	uint64_t mach_absolute_time(void);
+	void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+}
+
+#endif /* host_clock_h */
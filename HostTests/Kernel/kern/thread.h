@@ -0,0 +1,15 @@
+//
+//  thread.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_thread_h
+#define host_thread_h
+
+// thread_t is a port name in userspace, so an opaque pointer is returned instead
+
+extern "C" void *current_thread(void);
+
+#endif /* host_thread_h */
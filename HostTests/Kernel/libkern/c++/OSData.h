@@ -0,0 +1,8 @@
+//
+//  OSData.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include <libkern/c++/OSObject.h>
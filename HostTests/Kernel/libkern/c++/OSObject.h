@@ -0,0 +1,127 @@
+//
+//  OSObject.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_OSObject_h
+#define host_OSObject_h
+
+#include <stdint.h>
+#include <string.h>
+
+// Userspace replacement of the libkern containers for the host test targets.
+// Containers own their members, so only the outermost object is ever released.
+
+#define OSDynamicCast(type, inst) dynamic_cast<type *>(inst)
+
+class OSSerialize;
+
+class OSObject {
+public:
+	virtual ~OSObject() {}
+	void release() const { delete this; }
+};
+
+class OSString : public OSObject {
+	char *string;
+public:
+	explicit OSString(const char *str, size_t len) : string(new char[len + 1]) {
+		memcpy(string, str, len);
+		string[len] = '\0';
+	}
+	~OSString() { delete[] string; }
+	
+	static OSString *withCString(const char *str) { return new OSString(str, strlen(str)); }
+	const char *getCStringNoCopy() const { return string; }
+	unsigned int getLength() const { return static_cast<unsigned int>(strlen(string)); }
+	bool isEqualTo(const char *str) const { return strcmp(string, str) == 0; }
+};
+
+class OSNumber : public OSObject {
+	uint64_t value;
+public:
+	explicit OSNumber(uint64_t v) : value(v) {}
+	
+	static OSNumber *withNumber(uint64_t v, unsigned int) { return new OSNumber(v); }
+	uint32_t unsigned32BitValue() const { return static_cast<uint32_t>(value); }
+	uint64_t unsigned64BitValue() const { return value; }
+};
+
+class OSBoolean : public OSObject {
+	bool value;
+public:
+	explicit OSBoolean(bool v) : value(v) {}
+	
+	bool isTrue() const { return value; }
+};
+
+class OSData : public OSObject {
+	uint8_t *bytes;
+	unsigned int length;
+public:
+	OSData(const void *data, unsigned int len) : bytes(new uint8_t[len ? len : 1]), length(len) {
+		memcpy(bytes, data, len);
+	}
+	~OSData() { delete[] bytes; }
+	
+	static OSData *withBytes(const void *data, unsigned int len) { return new OSData(data, len); }
+	const void *getBytesNoCopy() const { return bytes; }
+	unsigned int getLength() const { return length; }
+};
+
+class OSArray : public OSObject {
+	OSObject **objects {nullptr};
+	unsigned int count {0};
+public:
+	~OSArray() {
+		for (unsigned int i = 0; i < count; i++)
+			objects[i]->release();
+		delete[] objects;
+	}
+	
+	static OSArray *withCapacity(unsigned int) { return new OSArray; }
+	unsigned int getCount() const { return count; }
+	OSObject *getObject(unsigned int index) const { return index < count ? objects[index] : nullptr; }
+	bool setObject(OSObject *object) {
+		auto grown = new OSObject *[count + 1];
+		if (count) memcpy(grown, objects, count * sizeof(OSObject *));
+		delete[] objects;
+		objects = grown;
+		objects[count++] = object;
+		return true;
+	}
+};
+
+class OSDictionary : public OSObject {
+	OSArray values;
+	OSArray keys;
+public:
+	static OSDictionary *withCapacity(unsigned int) { return new OSDictionary; }
+	unsigned int getCount() const { return keys.getCount(); }
+	OSObject *getObject(const char *key) const {
+		for (unsigned int i = 0; i < keys.getCount(); i++) {
+			if (static_cast<OSString *>(keys.getObject(i))->isEqualTo(key))
+				return values.getObject(i);
+		}
+		return nullptr;
+	}
+	bool setObject(const char *key, OSObject *object) {
+		keys.setObject(OSString::withCString(key));
+		return values.setObject(object);
+	}
+};
+
+/**
+ *  Parse the plist subset used by __PRELINK_INFO: dict, array, key, string, integer, true, false
+ *  and data, whose contents are dropped, with ID and IDREF attributes of strings and integers
+ *
+ *  @param buffer      null-terminated xml
+ *  @param errorString ignored
+ *
+ *  @return parsed object or nullptr
+ */
+OSObject *OSUnserializeXML(const char *buffer, OSString **errorString = nullptr);
+
+#endif /* host_OSObject_h */
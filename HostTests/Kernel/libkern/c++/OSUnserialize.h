@@ -0,0 +1,8 @@
+//
+//  OSUnserialize.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include <libkern/c++/OSObject.h>
@@ -0,0 +1,22 @@
+//
+//  libkern.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_libkern_h
+#define host_libkern_h
+
+// Userspace replacement of the kernel header for the host test targets
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <libkern/OSByteOrder.h>
+#include <mach/vm_param.h>
+
+#endif /* host_libkern_h */
@@ -0,0 +1,21 @@
+//
+//  vm_map.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_vm_map_h
+#define host_vm_map_h
+
+#include <mach/mach_types.h>
+
+// Kernel map interface emulated with mmap and mprotect by kern_host.cpp
+
+extern "C" {
+	kern_return_t vm_allocate(vm_map_t target_task, vm_address_t *address, vm_size_t size, int flags);
+	kern_return_t vm_deallocate(vm_map_t target_task, vm_address_t address, vm_size_t size);
+	kern_return_t vm_protect(vm_map_t target_task, vm_address_t address, vm_size_t size, boolean_t set_maximum, vm_prot_t new_protection);
+}
+
+#endif /* host_vm_map_h */
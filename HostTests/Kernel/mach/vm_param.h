@@ -0,0 +1,23 @@
+//
+//  vm_param.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_vm_param_h
+#define host_vm_param_h
+
+#include_next <mach/vm_param.h>
+
+// 64-bit page constants are only exported to the kernel
+
+#ifndef PAGE_SIZE_64
+#define PAGE_SIZE_64 (unsigned long long)PAGE_SIZE
+#endif
+
+#ifndef PAGE_MASK_64
+#define PAGE_MASK_64 (unsigned long long)PAGE_MASK
+#endif
+
+#endif /* host_vm_param_h */
@@ -0,0 +1,13 @@
+//
+//  malloc.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_malloc_h
+#define host_malloc_h
+
+// Nothing is used from the kernel header
+
+#endif /* host_malloc_h */
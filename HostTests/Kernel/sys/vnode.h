@@ -0,0 +1,57 @@
+//
+//  vnode.h
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef host_vnode_h
+#define host_vnode_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <errno.h>
+
+// Vnode KPI subset used by MachInfo, backed by stdio files in kern_host.cpp
+
+typedef int errno_t;
+typedef struct vnode *vnode_t;
+typedef struct vfs_context *vfs_context_t;
+typedef struct uio *uio_t;
+typedef struct proc *proc_t;
+typedef struct ucred *kauth_cred_t;
+
+#define NULLVP ((vnode_t)0)
+#define CAST_USER_ADDR_T(a) ((uint64_t)(uintptr_t)(a))
+
+enum host_uio_seg {
+	UIO_SYSSPACE = 2
+};
+
+enum host_uio_rw {
+	UIO_READ = 0
+};
+
+struct vnode_attr {
+	uint64_t va_active;
+	uint64_t va_data_size;
+};
+
+#define VATTR_INIT(v) ((v)->va_active = 0)
+#define VATTR_WANTED(v, a) ((v)->va_active |= 1)
+
+extern "C" {
+	vfs_context_t vfs_context_create(vfs_context_t ctx);
+	vfs_context_t vfs_context_current(void);
+	kauth_cred_t vfs_context_ucred(vfs_context_t ctx);
+	int vfs_context_rele(vfs_context_t ctx);
+	errno_t vnode_lookup(const char *path, int flags, vnode_t *vpp, vfs_context_t ctx);
+	int vnode_put(vnode_t vp);
+	int vnode_getattr(vnode_t vp, struct vnode_attr *vap, vfs_context_t ctx);
+	uio_t uio_create(int a_iovcount, off_t a_offset, int a_spacetype, int a_iodirection);
+	int uio_addiov(uio_t a_uio, uint64_t a_baseaddr, uint64_t a_length);
+	int64_t uio_resid(uio_t a_uio);
+	int VNOP_READ(vnode_t vp, uio_t uio, int ioflag, vfs_context_t ctx);
+}
+
+#endif /* host_vnode_h */
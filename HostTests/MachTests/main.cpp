@@ -0,0 +1,387 @@
+//
+//  main.cpp
+//  MachTests
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include "../kern_host.hpp"
+#include "../kern_machimage.hpp"
+#include "../../AppleALC/kern_mach.hpp"
+#include "../../AppleALC/kern_compression.hpp"
+#include "../../AppleALC/kern_symcache.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ *  Load a binary written to a temporary file and place it at a running copy
+ *
+ *  @param name    temporary file name
+ *  @param image   binary image
+ *  @param running running copy of the image, its address is the load slide
+ *  @param file    file contents if they differ from the image
+ *
+ *  @return initialised MachInfo or nullptr
+ */
+static MachInfo *loadBinary(const char *name, const std::vector<uint8_t> &image, std::vector<uint8_t> &running,
+							const std::vector<uint8_t> *file=nullptr) {
+	if (!file)
+		file = &image;
+	auto path = Host::writeFile(name, file->data(), file->size());
+	auto info = MachInfo::create();
+	running = image;
+	MachImage::place(running, reinterpret_cast<mach_vm_address_t>(running.data()));
+	if (!path || info->init(&path, 1) != KERN_SUCCESS ||
+		info->getRunningAddresses(reinterpret_cast<mach_vm_address_t>(running.data()), running.size()) != KERN_SUCCESS) {
+		info->deinit();
+		MachInfo::deleter(info);
+		return nullptr;
+	}
+	return info;
+}
+
+static void testSymbolLookup() {
+	printf("symbol lookup:\n");
+
+	MachImage::Binary binary;
+	binary.codeSize = 0x80000;
+	for (size_t i = 0; i < 20000; i++)
+		binary.symbols.push_back(MachImage::symbolName(i));
+	auto image = MachImage::build(binary);
+
+	// a typical solveSymbols request, the names are spread over the table
+	static constexpr size_t Requested {8};
+	const char *symbols[Requested + 1];
+	for (size_t i = 0; i < Requested; i++)
+		symbols[i] = binary.symbols[i * 2497].c_str();
+	symbols[Requested] = "_missingSymbol";
+
+	static constexpr size_t Rounds {200};
+	uint64_t elapsed[2] {};
+	mach_vm_address_t addresses[2][Requested + 1] {};
+
+	for (size_t indexed = 0; indexed < 2; indexed++) {
+		// the index is not built in low memory mode
+		lowMemory = indexed == 0;
+		std::vector<uint8_t> running;
+		auto info = loadBinary("lookup", image, running);
+		CHECK(info);
+		if (!info)
+			continue;
+
+		uint64_t start = Host::now();
+		for (size_t r = 0; r < Rounds; r++)
+			CHECK(info->solveSymbols(symbols, Requested + 1, addresses[indexed]) == Requested);
+		elapsed[indexed] = Host::now() - start;
+
+		for (size_t i = 0; i < Requested; i++)
+			CHECK(addresses[indexed][i] == reinterpret_cast<mach_vm_address_t>(running.data()) + MachImage::symbolValue(binary, i * 2497));
+		CHECK(addresses[indexed][Requested] == 0);
+
+		// a repeated name is solved at every position
+		const char *repeated[] {symbols[1], symbols[0], symbols[1], symbols[1]};
+		mach_vm_address_t repeatedAddresses[arrsize(repeated)] {};
+		CHECK(info->solveSymbols(repeated, arrsize(repeated), repeatedAddresses) == arrsize(repeated));
+		CHECK(repeatedAddresses[0] == addresses[indexed][1] && repeatedAddresses[2] == addresses[indexed][1] &&
+			  repeatedAddresses[3] == addresses[indexed][1] && repeatedAddresses[1] == addresses[indexed][0]);
+
+		info->deinit();
+		MachInfo::deleter(info);
+	}
+	lowMemory = false;
+
+	RESULT("%zu symbols, %zu names per request", binary.symbols.size(), Requested + 1);
+	RESULT("linear scan %llu ns per request", elapsed[0] / Rounds);
+	RESULT("indexed %llu ns per request (%.1fx)", elapsed[1] / Rounds, elapsed[1] ? static_cast<double>(elapsed[0]) / elapsed[1] : 0.0);
+}
+
+static void testUnterminatedStrings() {
+	printf("unterminated string table:\n");
+
+	// the last name runs to the very end of the string table, which ends the linkedit buffer
+	MachImage::Binary binary;
+	binary.symbols = {"_first", "_second", "_last"};
+	binary.terminatedStrings = false;
+	auto image = MachImage::build(binary);
+
+	for (size_t indexed = 0; indexed < 2; indexed++) {
+		lowMemory = indexed == 0;
+		std::vector<uint8_t> running;
+		auto info = loadBinary("unterminated", image, running);
+		CHECK(info);
+		if (!info)
+			continue;
+
+		auto base = reinterpret_cast<mach_vm_address_t>(running.data());
+		CHECK(info->solveSymbol("_first") == base + MachImage::symbolValue(binary, 0));
+		CHECK(info->solveSymbol("_second") == base + MachImage::symbolValue(binary, 1));
+		CHECK(info->solveSymbol("_last") == 0);
+		CHECK(info->solveSymbol("_las") == 0);
+
+		info->deinit();
+		MachInfo::deleter(info);
+	}
+	lowMemory = false;
+
+	RESULT("unterminated name is never matched with and without the index");
+}
+
+static void testPartialDecode() {
+	printf("partial decode:\n");
+
+	MachImage::Binary binary;
+	binary.filetype = 0x2; // MH_EXECUTE
+	binary.codeSize = 0x800000;
+	for (size_t i = 0; i < 2000; i++)
+		binary.symbols.push_back(MachImage::symbolName(i));
+	auto image = MachImage::build(binary);
+	auto container = MachImage::compress(image);
+	auto src = container.data() + sizeof(CompressedHeader);
+	auto srclen = static_cast<uint32_t>(container.size() - sizeof(CompressedHeader));
+	auto full = static_cast<uint32_t>(image.size());
+
+	// decoding stops at the requested size and produces the same prefix
+	static constexpr size_t Rounds {10};
+	std::vector<uint8_t> decoded(full);
+	uint64_t elapsed[2] {};
+	uint32_t sizes[2] {static_cast<uint32_t>(MachInfo::HeaderSize), full};
+	for (size_t i = 0; i < 2; i++) {
+		memset(decoded.data(), 0, decoded.size());
+		uint64_t start = Host::now();
+		for (size_t r = 0; r < Rounds; r++)
+			CHECK(decompressData(CompressionLZSS, sizes[i], src, srclen, decoded.data()) == decoded.data());
+		elapsed[i] = (Host::now() - start) / Rounds;
+		CHECK(memcmp(decoded.data(), image.data(), sizes[i]) == 0);
+		CHECK(sizes[i] == full || decoded[sizes[i]] == 0);
+	}
+
+	RESULT("%u bytes compressed into %u", full, srclen);
+	RESULT("header decode %llu ns, full decode %llu ns (%.1fx)", elapsed[0], elapsed[1],
+		   elapsed[0] ? static_cast<double>(elapsed[1]) / elapsed[0] : 0.0);
+
+	// symbols of a compressed binary are served from the data decoded up to the tables
+	Host::resetAllocations();
+	Host::fileBytesRead = 0;
+	std::vector<uint8_t> running;
+	auto info = loadBinary("compressed", image, running, &container);
+	CHECK(info);
+	if (info) {
+		RESULT("init read %zu file bytes, peak memory %zu bytes (full decode keeps %u)", Host::fileBytesRead, Host::bytesPeak, srclen + full);
+
+		for (size_t i = 0; i < binary.symbols.size(); i += 199)
+			CHECK(info->solveSymbol(binary.symbols[i].c_str()) == reinterpret_cast<mach_vm_address_t>(running.data()) + MachImage::symbolValue(binary, i));
+		info->deinit();
+		MachInfo::deleter(info);
+	}
+}
+
+static void testPrelinked() {
+	printf("prelinked image:\n");
+
+	MachImage::Prelinked prelinked;
+	prelinked.ids = {"com.apple.iokit.IOHDAFamily", "com.apple.driver.AppleHDA"};
+	prelinked.kexts.resize(2);
+	for (size_t k = 0; k < prelinked.kexts.size(); k++) {
+		prelinked.kexts[k].codeSize = 0x20000 * (k + 1);
+		prelinked.kexts[k].uuid[0] = static_cast<uint8_t>(k + 1);
+		for (size_t i = 0; i < 500; i++)
+			prelinked.kexts[k].symbols.push_back(MachImage::symbolName(i + k * 500));
+	}
+	auto image = MachImage::buildPrelinked(prelinked);
+
+	// the x86_64 slice is cut before __PRELINK_INFO, yet the file goes on with the i386 slice
+	std::vector<uint8_t> cut(image.begin(), image.end() - prelinked.linkeditSize - PAGE_SIZE);
+
+	struct {
+		const char *name;
+		std::vector<uint8_t> file;
+		bool valid;
+		bool compressed;
+	} variants[] {
+		{"plain", image, true, false},
+		{"compressed", MachImage::compress(image), true, true},
+		{"fat", MachImage::fat(image, PAGE_SIZE), true, false},
+		{"truncated fat slice", MachImage::fat(cut, image.size()), false, false}
+	};
+
+	for (auto &variant : variants) {
+		Host::resetAllocations();
+		Host::fileBytesRead = 0;
+		auto prelink = MachInfo::create();
+		auto path = Host::writeFile("prelinked", variant.file.data(), variant.file.size());
+		bool loaded = prelink->init(&path, 1, true) == KERN_SUCCESS;
+		CHECK(loaded == variant.valid);
+		size_t peak = Host::bytesPeak;
+		size_t bytesRead = Host::fileBytesRead;
+		size_t resident = Host::bytesUsed;
+		// __LINKEDIT is neither read nor decoded, plain images keep nothing but the parsed kext list
+		CHECK(!loaded || peak < (variant.compressed ? variant.file.size() : 0) + image.size() - prelinked.linkeditSize + 2 * MachInfo::HeaderSize);
+		CHECK(!loaded || resident < (variant.compressed ? image.size() - prelinked.linkeditSize : 0) + PAGE_SIZE);
+
+		for (size_t k = 0; loaded && k < prelinked.kexts.size(); k++) {
+			auto &kext = prelinked.kexts[k];
+			auto info = MachInfo::create();
+			CHECK(info->initFromPrelinked(prelink, prelinked.ids[k].c_str()) == KERN_SUCCESS);
+
+			// prelinked symbol values are absolute, the running kext is elsewhere
+			auto running = MachImage::build(kext);
+			auto base = reinterpret_cast<mach_vm_address_t>(running.data());
+			MachImage::place(running, base - kext.textAddr);
+			CHECK(info->getRunningAddresses(base, running.size()) == KERN_SUCCESS);
+			for (size_t i = 0; i < kext.symbols.size(); i += 37)
+				CHECK(info->solveSymbol(kext.symbols[i].c_str()) == base + (MachImage::symbolValue(kext, i) - kext.textAddr));
+			CHECK(info->solveSymbol(prelinked.kexts[1 - k].symbols[0].c_str()) == 0);
+
+			info->deinit();
+			MachInfo::deleter(info);
+		}
+
+		// plain images are read per kext, only the headers and the tables
+		size_t kextBytesRead = Host::fileBytesRead - bytesRead;
+		CHECK(!loaded || (variant.compressed ? kextBytesRead == 0 : kextBytesRead < prelinked.kexts[0].codeSize));
+
+		prelink->deinit();
+		MachInfo::deleter(prelink);
+
+		if (loaded)
+			RESULT("%s: read %zu of %zu file bytes and %zu for the kexts, peak memory %zu bytes, %zu bytes resident", variant.name,
+				   bytesRead, variant.file.size(), kextBytesRead, peak, resident);
+		else
+			RESULT("%s: rejected", variant.name);
+	}
+}
+
+static void testSymbolCache() {
+	printf("symbol cache:\n");
+
+	MachImage::Binary binary;
+	binary.codeSize = 0x40000;
+	binary.uuid[0] = 0x5C;
+	for (size_t i = 0; i < 5000; i++)
+		binary.symbols.push_back(MachImage::symbolName(i));
+	auto image = MachImage::build(binary);
+	size_t tables = binary.symbols.size() * sizeof(nlist_64);
+
+	std::vector<size_t> cached {10, 1000, 4000};
+	auto valid = MachImage::symbolCache(binary, cached);
+	auto relocated = valid;
+	reinterpret_cast<SymbolCacheHeader *>(relocated.data())->textAddr += 0x200000;
+	auto outside = valid;
+	reinterpret_cast<nlist_64 *>(outside.data() + sizeof(SymbolCacheHeader))[1].n_value += binary.codeSize;
+
+	// symbols refer to sections by ordinals, which also count the sections the index leaves out
+	auto unlisted = binary;
+	unlisted.unlistedSections = 2;
+	auto unlistedImage = MachImage::build(unlisted);
+	auto unlistedCache = MachImage::symbolCache(unlisted, cached);
+
+	struct {
+		const char *name;
+		std::vector<uint8_t> &image;
+		std::vector<uint8_t> cache;
+		bool used;
+		bool compressed;
+	} variants[] {
+		{"valid", image, valid, true, false},
+		{"valid with compressed binary", image, valid, true, true},
+		{"valid after unlisted sections", unlistedImage, unlistedCache, true, false},
+		{"other image base", image, relocated, false, false},
+		{"entry out of its section", image, outside, false, false}
+	};
+
+	auto container = MachImage::compress(image);
+	for (auto &variant : variants) {
+		auto cachePath = Host::writeFile("symcache", variant.cache.data(), variant.cache.size());
+		auto path = Host::writeFile("cached", variant.compressed ? container.data() : variant.image.data(),
+									variant.compressed ? container.size() : variant.image.size());
+		std::vector<uint8_t> running = variant.image;
+		auto base = reinterpret_cast<mach_vm_address_t>(running.data());
+		MachImage::place(running, base);
+
+		Host::fileBytesRead = 0;
+		auto info = MachInfo::create();
+		CHECK(info->init(&path, 1, false, cachePath) == KERN_SUCCESS);
+		CHECK(info->getRunningAddresses(base, running.size()) == KERN_SUCCESS);
+		// the symbol table is not read when the cache is used
+		size_t initRead = Host::fileBytesRead;
+		CHECK(variant.compressed || (initRead < tables) == variant.used);
+
+		for (auto i : cached)
+			CHECK(info->solveSymbol(binary.symbols[i].c_str()) == base + MachImage::symbolValue(binary, i));
+		size_t cachedRead = Host::fileBytesRead;
+		CHECK(cachedRead == initRead);
+
+		// symbols missing from a used cache are not solved, the symbol table is only read at init
+		const char *symbols[] {binary.symbols[7].c_str(), binary.symbols[1000].c_str(), "_missingSymbol"};
+		mach_vm_address_t addresses[3];
+		size_t solved = info->solveSymbols(symbols, 3, addresses);
+		CHECK(solved == (variant.used ? 1 : 2));
+		CHECK(addresses[0] == (variant.used ? 0 : base + MachImage::symbolValue(binary, 7)));
+		CHECK(addresses[1] == base + MachImage::symbolValue(binary, 1000));
+		CHECK(addresses[2] == 0);
+		CHECK(info->solveSymbol(binary.symbols[4999].c_str()) == (variant.used ? 0 : base + MachImage::symbolValue(binary, 4999)));
+		CHECK(Host::fileBytesRead == cachedRead);
+
+		info->deinit();
+		MachInfo::deleter(info);
+
+		RESULT("%s: init read %zu bytes, %zu of 2 uncached symbols solved", variant.name, initRead, solved - 1);
+	}
+}
+
+static void testBaseLookup() {
+	printf("kernel base lookup:\n");
+
+	// kernel text with its header at a page boundary and magic decoys in the code
+	static constexpr size_t KernelSize {0x800000};
+	std::vector<uint8_t> memory(KernelSize + PAGE_SIZE);
+	auto base = (reinterpret_cast<mach_vm_address_t>(memory.data()) + PAGE_MASK) & ~static_cast<mach_vm_address_t>(PAGE_MASK);
+	MachImage::Binary binary;
+	auto header = MachImage::build(binary);
+	memcpy(reinterpret_cast<void *>(base), header.data(), PAGE_SIZE);
+	for (size_t off = PAGE_SIZE; off + sizeof(mach_header_64) + sizeof(segment_command_64) < KernelSize; off += 0x10000 + 0x123) {
+		auto magic = reinterpret_cast<uint32_t *>(base + off);
+		*magic = MH_MAGIC_64;
+		// the aligned decoys are not followed by __TEXT
+		*reinterpret_cast<uint32_t *>(base + (off & ~static_cast<size_t>(PAGE_MASK))) = MH_MAGIC_64;
+	}
+
+	struct {
+		const char *name;
+		mach_vm_address_t start;
+		size_t window;
+		mach_vm_address_t result;
+	} cases[] {
+		{"start near the header", base + 0x2345, 0, base},
+		{"start far from the header", base + KernelSize - 0x1001, 0, base},
+		{"window shorter than the distance", base + KernelSize - 0x1001, 0x100000, 0},
+		{"window reaching the header", base + 0x100000, 0x100000, base}
+	};
+
+	for (auto &test : cases) {
+		MachInfo::t_baseLookup lookups[] {MachInfo::lookupBaseBytewise, MachInfo::lookupBasePagewise};
+		size_t probes[2] {};
+		uint64_t elapsed[2] {};
+		for (size_t i = 0; i < 2; i++) {
+			uint64_t start = Host::now();
+			CHECK(lookups[i](test.start, test.window, probes[i]) == test.result);
+			elapsed[i] = Host::now() - start;
+		}
+		CHECK(probes[1] <= (test.start - base) / PAGE_SIZE + 1);
+
+		RESULT("%s: bytewise %zu probes %llu ns, pagewise %zu probes %llu ns", test.name,
+			   probes[0], elapsed[0], probes[1], elapsed[1]);
+	}
+}
+
+int main() {
+	testSymbolLookup();
+	testUnterminatedStrings();
+	testPartialDecode();
+	testPrelinked();
+	testSymbolCache();
+	testBaseLookup();
+
+	return Host::report("MachTests");
+}
@@ -0,0 +1,128 @@
+//
+//  kern_machmock.cpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include "kern_machmock.hpp"
+#include "../../AppleALC/kern_mach.hpp"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <map>
+#include <string>
+
+namespace MachMock {
+	size_t writeWindows {0};
+	bool writing {false};
+
+	struct Image {
+		uint8_t *start;
+		size_t size;
+	};
+
+	static std::map<std::string, Image> images;
+	static std::map<std::string, mach_vm_address_t> symbols;
+
+	/**
+	 *  Items are executable outside of the write windows, so that routed functions could be called
+	 */
+	static constexpr int ReadOnly {PROT_READ|PROT_EXEC};
+
+	static void protect(int prot) {
+		for (auto &image : images)
+			mprotect(image.second.start, image.second.size, prot);
+	}
+}
+
+uint8_t *MachMock::addImage(const char *path, size_t size) {
+	size = (size + PAGE_MASK) & ~static_cast<size_t>(PAGE_MASK);
+	auto p = mmap(nullptr, size, ReadOnly, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	auto start = static_cast<uint8_t *>(p);
+	images[path] = Image {start, size};
+	return start;
+}
+
+void MachMock::addSymbol(const char *symbol, mach_vm_address_t address) {
+	symbols[symbol] = address;
+}
+
+void MachMock::fill(void *dst, const void *src, size_t size) {
+	protect(PROT_READ|PROT_WRITE);
+	memcpy(dst, src, size);
+	protect(writing ? PROT_READ|PROT_WRITE : ReadOnly);
+}
+
+void MachMock::reset() {
+	for (auto &image : images)
+		munmap(image.second.start, image.second.size);
+	images.clear();
+	symbols.clear();
+	writeWindows = 0;
+	writing = false;
+}
+
+kern_return_t MachInfo::init(const char * const paths[], size_t num, bool prelinked, const char *cache) {
+	// there is no prelinked image, kexts are found by their paths
+	for (size_t i = 0; !prelinked && i < num; i++) {
+		auto image = MachMock::images.find(paths[i]);
+		if (image != MachMock::images.end()) {
+			running_mh = reinterpret_cast<mach_header_64 *>(image->second.start);
+			memory_size = image->second.size;
+			// resembles the symbol tables a kinfo keeps
+			accountMemory(MachMock::SymbolTableSize);
+			return KERN_SUCCESS;
+		}
+	}
+	return KERN_FAILURE;
+}
+
+kern_return_t MachInfo::initFromPrelinked(MachInfo *prelink, const char *id) {
+	return KERN_FAILURE;
+}
+
+void MachInfo::deinit() {
+	running_mh = nullptr;
+	memory_size = HeaderSize;
+	accountMemory(0, memory_used);
+}
+
+kern_return_t MachInfo::getRunningAddresses(mach_vm_address_t slide, size_t size) {
+	return running_mh ? KERN_SUCCESS : KERN_FAILURE;
+}
+
+void MachInfo::getRunningPosition(uint8_t * &header, size_t &size) {
+	header = reinterpret_cast<uint8_t *>(running_mh);
+	size = memory_size;
+}
+
+mach_vm_address_t MachInfo::solveSymbol(const char *symbol) {
+	mach_vm_address_t address {0};
+	solveSymbols(&symbol, 1, &address);
+	return address;
+}
+
+size_t MachInfo::solveSymbols(const char * const symbols[], size_t num, mach_vm_address_t addresses[]) {
+	size_t found {0};
+	for (size_t i = 0; i < num; i++) {
+		auto symbol = MachMock::symbols.find(symbols[i]);
+		addresses[i] = symbol != MachMock::symbols.end() ? symbol->second : 0;
+		if (addresses[i])
+			found++;
+	}
+	return found;
+}
+
+kern_return_t MachInfo::setKernelWriting(bool enable) {
+	// nested windows would mean interrupts are enabled too early
+	if (enable == MachMock::writing)
+		return KERN_FAILURE;
+	MachMock::writing = enable;
+	if (enable)
+		MachMock::writeWindows++;
+	MachMock::protect(enable ? PROT_READ|PROT_WRITE : MachMock::ReadOnly);
+	return KERN_SUCCESS;
+}
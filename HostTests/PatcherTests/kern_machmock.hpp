@@ -0,0 +1,68 @@
+//
+//  kern_machmock.hpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef kern_machmock_hpp
+#define kern_machmock_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <mach/mach_types.h>
+
+/**
+ *  MachInfo replacement for the patcher tests
+ *
+ *  Kernel items are plain memory regions registered by their paths instead of mach-o files,
+ *  they stay read only and executable outside of the setKernelWriting windows, so that any
+ *  write made without a window faults.
+ */
+namespace MachMock {
+	/**
+	 *  Register a kernel item found by MachInfo::init at the path
+	 *
+	 *  @param path filesystem path, must stay valid till reset
+	 *  @param size item size, rounded up to pages
+	 *
+	 *  @return zero filled item memory or nullptr
+	 */
+	uint8_t *addImage(const char *path, size_t size);
+
+	/**
+	 *  Make an item symbol solvable by any MachInfo
+	 *
+	 *  @param symbol  symbol name, must stay valid till reset
+	 *  @param address running symbol address
+	 */
+	void addSymbol(const char *symbol, mach_vm_address_t address);
+
+	/**
+	 *  Fill item memory bypassing the protection
+	 *
+	 *  @param dst  destination within an item
+	 *  @param src  source bytes
+	 *  @param size number of bytes
+	 */
+	void fill(void *dst, const void *src, size_t size);
+
+	/**
+	 *  Release all the registered items and symbols and reset the statistics
+	 */
+	void reset();
+
+	/**
+	 *  Resident size of every initialised MachInfo
+	 */
+	static constexpr size_t SymbolTableSize {0x10000};
+
+	/**
+	 *  Number of opened write windows and whether one is open now
+	 */
+	extern size_t writeWindows;
+	extern bool writing;
+}
+
+#endif /* kern_machmock_hpp */
@@ -0,0 +1,973 @@
+//
+//  main.cpp
+//  PatcherTests
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include "../kern_host.hpp"
+#include "kern_machmock.hpp"
+#include "../../AppleALC/kern_patcher_private.hpp"
+#include "../../AppleALC/kern_patcher.hpp"
+#include "../../AppleALC/kern_disasm.hpp"
+#include "../../AppleALC/kern_resources.hpp"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ *  Registered kernel and a single test kext with a patcher loaded on top of them
+ */
+struct Fixture {
+	static constexpr size_t KernelSize {0x10000};
+
+	const char *kextPaths[1] {"/System/Library/Extensions/Test.kext/Contents/MacOS/Test"};
+	KernelPatcher::KextInfo kext {"com.apple.driver.Test", kextPaths, 1, false, KernelPatcher::KextInfo::Unloaded};
+	KernelPatcher patcher;
+	uint8_t *kernel {nullptr};
+	uint8_t *kextStart {nullptr};
+	size_t kextSize {0};
+
+	/**
+	 *  Register the items and load them
+	 *
+	 *  @param contents kext bytes
+	 */
+	explicit Fixture(const std::vector<uint8_t> &contents) {
+		kernel = MachMock::addImage("/mach_kernel", KernelSize);
+		kextStart = MachMock::addImage(kextPaths[0], contents.size());
+		kextSize = contents.size();
+		if (kextStart)
+			MachMock::fill(kextStart, contents.data(), contents.size());
+		patcher.init();
+		patcher.loadKinfo(&kext);
+	}
+
+	~Fixture() {
+		patcher.deinit();
+		MachMock::reset();
+	}
+
+	/**
+	 *  Check kext bytes
+	 *
+	 *  @param off  kext offset
+	 *  @param data expected bytes
+	 *
+	 *  @return true if matching
+	 */
+	bool has(size_t off, const std::vector<uint8_t> &data) {
+		return off + data.size() <= kextSize && !memcmp(kextStart + off, data.data(), data.size());
+	}
+};
+
+/**
+ *  Fill a kext with bytes, which are not used by the tested patterns, and put the patterns at the offsets
+ *
+ *  @param size  kext size
+ *  @param parts offsets and pattern bytes
+ *
+ *  @return kext bytes
+ */
+static std::vector<uint8_t> makeKext(size_t size, const std::vector<std::pair<size_t, std::vector<uint8_t>>> &parts) {
+	std::vector<uint8_t> kext(size, 0x90);
+	for (auto &part : parts)
+		memcpy(kext.data() + part.first, part.second.data(), part.second.size());
+	return kext;
+}
+
+/**
+ *  Reference pattern lookup, the one lookup patching used before findPattern
+ */
+static const uint8_t *naivePattern(const uint8_t *data, size_t size, const uint8_t *pattern, size_t len) {
+	for (size_t i = 0; len > 0 && i + len <= size; i++) {
+		if (!memcmp(data + i, pattern, len))
+			return data + i;
+	}
+	return nullptr;
+}
+
+static void testFindPattern() {
+	printf("pattern lookup:\n");
+
+	// every length and position near the buffer ends, where the scalar tail takes over
+	std::vector<uint8_t> small(64);
+	for (size_t i = 0; i < small.size(); i++)
+		small[i] = static_cast<uint8_t>(i * 7);
+	for (size_t len = 1; len <= 16; len++) {
+		for (size_t size = len; size <= small.size(); size++) {
+			for (size_t pos = 0; pos + len <= size; pos++) {
+				auto expected = naivePattern(small.data(), size, small.data() + pos, len);
+				CHECK(findPattern(small.data(), size, small.data() + pos, len) == expected);
+			}
+		}
+	}
+	CHECK(findPattern(small.data(), 4, small.data(), 5) == nullptr);
+	CHECK(findPattern(small.data(), small.size(), small.data(), 0) == nullptr);
+
+	// kext sized buffers, the first one resembles code, the second one has every third position matching
+	// the first and the last pattern bytes, so that each of them goes to memcmp
+	static constexpr size_t Size {16 * 1024 * 1024};
+	static constexpr size_t Rounds {8};
+	std::vector<uint8_t> code(Size);
+	uint32_t seed {0x12345678};
+	for (auto &b : code) {
+		seed = seed * 1103515245 + 12345;
+		b = static_cast<uint8_t>(seed >> 16);
+	}
+	std::vector<uint8_t> repetitive(Size);
+	for (size_t i = 0; i < Size; i++)
+		repetitive[i] = (i % 3) ? 0x00 : 0x0C;
+
+	struct {
+		const char *name;
+		std::vector<uint8_t> &data;
+		std::vector<uint8_t> pattern;
+	} cases[] {
+		{"code", code, {0x0C, 0x0A, 0x00, 0x00, 0x3D, 0x0C}},
+		{"repetitive", repetitive, {0x0C, 0x00, 0x00, 0x0C, 0x00, 0x01, 0x0C}}
+	};
+
+	for (auto &test : cases) {
+		// the pattern is placed at the end only, so that the whole buffer is scanned
+		auto pattern = test.pattern.data();
+		auto len = test.pattern.size();
+		memcpy(test.data.data() + Size - len, pattern, len);
+		auto expected = test.data.data() + Size - len;
+		CHECK(naivePattern(test.data.data(), Size, pattern, len) == expected);
+
+		uint64_t elapsed[2] {};
+		for (size_t i = 0; i < 2; i++) {
+			uint64_t start = Host::now();
+			for (size_t r = 0; r < Rounds; r++) {
+				auto found = i == 0 ? naivePattern(test.data.data(), Size, pattern, len) :
+					findPattern(test.data.data(), Size, pattern, len);
+				CHECK(found == expected);
+			}
+			elapsed[i] = Host::now() - start;
+		}
+
+		RESULT("%s: naive %.2f GB/s, findPattern %.2f GB/s", test.name,
+			   static_cast<double>(Size) * Rounds / elapsed[0], static_cast<double>(Size) * Rounds / elapsed[1]);
+	}
+}
+
+static void testLookupRules() {
+	printf("lookup patch rules:\n");
+
+	const uint8_t findA[] {0x01, 0x02, 0x03, 0x04}, replaceA[] {0x05, 0x06, 0x07, 0x08};
+	const uint8_t findB[] {0x05, 0x06, 0x07, 0x08}, replaceB[] {0x0A, 0x0B, 0x0C, 0x0D};
+	const uint8_t findC[] {0x02, 0x03, 0x04, 0x0E}, replaceC[] {0x0F, 0x0F, 0x0F, 0x0F};
+	const std::vector<uint8_t> a {0x01, 0x02, 0x03, 0x04}, b {0x05, 0x06, 0x07, 0x08}, c {0x0A, 0x0B, 0x0C, 0x0D};
+
+	// the rules do not depend on whether the patches are searched one by one or matched by a byte walk,
+	// the latter is taken for many patches, so the lists are padded with never matching ones of a zero count
+	const uint8_t findPad[] {0xFF, 0xFE, 0xFD, 0xFC};
+	for (size_t padding : {0, 32}) {
+		auto apply = [&](Fixture &fixture, const KernelPatcher::LookupPatch * const list[], size_t num) {
+			std::vector<KernelPatcher::LookupPatch> pad(padding, {&fixture.kext, findPad, findPad, sizeof(findPad), 0});
+			std::vector<const KernelPatcher::LookupPatch *> padded(list, list + num);
+			for (auto &patch : pad)
+				padded.push_back(&patch);
+			fixture.patcher.applyLookupPatches(padded.data(), padded.size());
+		};
+
+		{
+			// a patch does not match the replacement of a previous one
+			Fixture fixture(makeKext(0x3000, {{0x100, a}, {0x2000, b}}));
+			KernelPatcher::LookupPatch patches[] {
+				{&fixture.kext, findA, replaceA, sizeof(findA), 1},
+				{&fixture.kext, findB, replaceB, sizeof(findB), 1}
+			};
+			const KernelPatcher::LookupPatch *list[] {&patches[0], &patches[1]};
+			apply(fixture, list, arrsize(list));
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			CHECK(fixture.has(0x100, b));
+			CHECK(fixture.has(0x2000, c));
+			RESULT("chained pattern with %zu padding: %s", padding, fixture.has(0x100, b) ? "left alone" : "replaced");
+		}
+
+		{
+			// overlapping matches, the earlier position wins and the later match is lost
+			Fixture fixture(makeKext(0x3000, {{0x100, {0x01, 0x02, 0x03, 0x04, 0x0E}}}));
+			KernelPatcher::LookupPatch patches[] {
+				{&fixture.kext, findC, replaceC, sizeof(findC), 1},
+				{&fixture.kext, findA, replaceA, sizeof(findA), 1}
+			};
+			const KernelPatcher::LookupPatch *list[] {&patches[0], &patches[1]};
+			apply(fixture, list, arrsize(list));
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoPatternFound);
+			CHECK(fixture.has(0x100, {0x01, 0x02, 0x03, 0x04, 0x0E}));
+		}
+
+		{
+			// equal patterns take the occurrences in their order
+			Fixture fixture(makeKext(0x3000, {{0x100, a}, {0x200, a}, {0x300, a}}));
+			KernelPatcher::LookupPatch patches[] {
+				{&fixture.kext, findA, replaceA, sizeof(findA), 2},
+				{&fixture.kext, findA, replaceB, sizeof(findA), 1}
+			};
+			const KernelPatcher::LookupPatch *list[] {&patches[0], &patches[1]};
+			apply(fixture, list, arrsize(list));
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			CHECK(fixture.has(0x100, b) && fixture.has(0x200, b) && fixture.has(0x300, c));
+		}
+
+		{
+			// count 0 replaces every occurrence, also the ones past the counted patches
+			Fixture fixture(makeKext(0x3000, {{0x100, a}, {0x200, b}, {0x300, a}, {0x2F00, a}}));
+			KernelPatcher::LookupPatch patches[] {
+				{&fixture.kext, findA, replaceB, sizeof(findA), 0},
+				{&fixture.kext, findB, replaceB, sizeof(findB), 1}
+			};
+			const KernelPatcher::LookupPatch *list[] {&patches[0], &patches[1]};
+			apply(fixture, list, arrsize(list));
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			CHECK(fixture.has(0x100, c) && fixture.has(0x200, c) && fixture.has(0x300, c) && fixture.has(0x2F00, c));
+			CHECK(MachMock::writeWindows == 1);
+
+			// finding no occurrence is not an error
+			KernelPatcher::LookupPatch missing {&fixture.kext, findC, replaceC, sizeof(findC), 0};
+			fixture.patcher.applyLookupPatch(&missing);
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			CHECK(MachMock::writeWindows == 1);
+		}
+
+		{
+			// a missing occurrence leaves the whole group untouched, while the groups applied
+			// before and after it stay, and all of them are reverted at deinit
+			Fixture fixture(makeKext(0x3000, {{0x100, a}, {0x200, b}, {0x300, {0x02, 0x03, 0x04, 0x0E}}}));
+			KernelPatcher::LookupPatch patches[] {
+				{&fixture.kext, findC, replaceC, sizeof(findC), 1},
+				{&fixture.kext, findA, replaceA, sizeof(findA), 2},
+				{&fixture.kext, findB, replaceB, sizeof(findB), 1}
+			};
+			fixture.patcher.applyLookupPatch(&patches[0]);
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+
+			const KernelPatcher::LookupPatch *list[] {&patches[1], &patches[2]};
+			apply(fixture, list, arrsize(list));
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoPatternFound);
+			CHECK(fixture.has(0x100, a) && fixture.has(0x200, b));
+			CHECK(fixture.has(0x300, {0x0F, 0x0F, 0x0F, 0x0F}));
+
+			fixture.patcher.clearError();
+			fixture.patcher.applyLookupPatch(&patches[2]);
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			CHECK(fixture.has(0x200, c));
+			fixture.patcher.deinit();
+			CHECK(fixture.has(0x200, b) && fixture.has(0x300, {0x02, 0x03, 0x04, 0x0E}));
+		}
+	}
+}
+
+/**
+ *  Check whether a pattern occurs in the bytes
+ */
+static bool contains(const uint8_t *data, size_t size, const uint8_t *pattern, size_t len) {
+	return naivePattern(data, size, pattern, len) != nullptr;
+}
+
+/**
+ *  Apply lookup patches to random kext bytes with their occurrences spread over them in a random order
+ *  one by one and in a single pass, which must give the same bytes
+ *
+ *  @param name    printed name
+ *  @param patches patches without a kext, their finds must not occur in the finds or replacements of the others
+ */
+static void benchLookupPass(const char *name, std::vector<KernelPatcher::LookupPatch> patches) {
+	static constexpr size_t Size {8 * 1024 * 1024};
+	static constexpr size_t Rounds {4};
+
+	size_t occurrences {0}, longest {0};
+	for (auto &patch : patches) {
+		occurrences += patch.count;
+		if (patch.size > longest)
+			longest = patch.size;
+	}
+
+	std::vector<uint8_t> kext(Size);
+	uint32_t seed {0x5EED};
+	for (auto &b : kext) {
+		seed = seed * 1103515245 + 12345;
+		b = static_cast<uint8_t>(seed >> 16);
+	}
+	std::vector<size_t> order;
+	for (size_t i = 0; i < patches.size(); i++)
+		order.insert(order.end(), patches[i].count, i);
+	for (size_t i = order.size(); i > 1; i--) {
+		seed = seed * 1103515245 + 12345;
+		std::swap(order[i-1], order[(seed >> 8) % i]);
+	}
+	size_t slot = Size / occurrences;
+	CHECK(slot > longest);
+	for (size_t i = 0; i < order.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		memcpy(kext.data() + i * slot + (seed >> 8) % (slot - longest), patches[order[i]].find, patches[order[i]].size);
+	}
+
+	uint64_t elapsed[2] {};
+	std::vector<uint8_t> result[2];
+	for (size_t i = 0; i < 2; i++) {
+		for (size_t r = 0; r < Rounds; r++) {
+			Fixture fixture(kext);
+			std::vector<const KernelPatcher::LookupPatch *> list;
+			for (auto &patch : patches) {
+				patch.kext = &fixture.kext;
+				list.push_back(&patch);
+			}
+
+			uint64_t start = Host::now();
+			if (i == 0) {
+				for (auto patch : list)
+					fixture.patcher.applyLookupPatch(patch);
+			} else {
+				fixture.patcher.applyLookupPatches(list.data(), list.size());
+			}
+			elapsed[i] += Host::now() - start;
+
+			CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+			result[i].assign(fixture.kextStart, fixture.kextStart + fixture.kextSize);
+		}
+	}
+	CHECK(result[0] == result[1]);
+	CHECK(result[1] != kext);
+
+	RESULT("%s: %zu patches, %zu replacements in %zu MB, one by one %.2f ms, single pass %.2f ms",
+		   name, patches.size(), occurrences, Size / (1024 * 1024),
+		   elapsed[0] / 1000000.0 / Rounds, elapsed[1] / 1000000.0 / Rounds);
+}
+
+static void testLookupPass() {
+	printf("lookup patch pass:\n");
+
+	// the real patches of the kext most patches target, only the ones whose finds do not occur in
+	// the finds or replacements of the others are taken, so that both ways give the same result
+	std::vector<const KextPatch *> all;
+	for (size_t i = 0; i < controllerModSize; i++) {
+		for (size_t j = 0; j < controllerMod[i].patchNum; j++)
+			all.push_back(&controllerMod[i].patches[j]);
+	}
+	for (size_t i = 0; i < vendorModSize; i++) {
+		for (size_t j = 0; j < vendorMod[i].codecsNum; j++) {
+			for (size_t k = 0; k < vendorMod[i].codecs[j].patchNum; k++)
+				all.push_back(&vendorMod[i].codecs[j].patches[k]);
+		}
+	}
+
+	KernelPatcher::KextInfo *target {nullptr};
+	size_t targetNum {0};
+	for (size_t i = 0; i < kextListSize; i++) {
+		size_t num {0};
+		for (auto patch : all)
+			num += patch->patch.kext == &kextList[i];
+		if (num > targetNum) {
+			target = &kextList[i];
+			targetNum = num;
+		}
+	}
+	CHECK(target != nullptr);
+	if (!target)
+		return;
+
+	auto independent = [](const KernelPatcher::LookupPatch &a, const KernelPatcher::LookupPatch &b) {
+		return !contains(b.find, b.size, a.find, a.size) && !contains(b.replace, b.size, a.find, a.size) &&
+			!contains(a.find, a.size, b.find, b.size) && !contains(a.replace, a.size, b.find, b.size);
+	};
+
+	std::vector<KernelPatcher::LookupPatch> patches;
+	for (auto patch : all) {
+		auto &candidate = patch->patch;
+		if (candidate.kext != target || candidate.size == 0 || candidate.count == 0)
+			continue;
+		bool taken {true};
+		for (auto &other : patches)
+			taken &= independent(candidate, other);
+		if (taken)
+			patches.push_back(candidate);
+	}
+	CHECK(patches.size() > 1);
+	benchLookupPass(target->id, patches);
+
+	// every patch of the set applied at once, generated patterns, so that they are independent
+	static constexpr size_t Generated {64}, PatternSize {8};
+	std::vector<uint8_t> bytes(Generated * PatternSize * 2);
+	uint32_t seed {0xB17E};
+	for (auto &b : bytes) {
+		seed = seed * 1103515245 + 12345;
+		b = static_cast<uint8_t>(seed >> 16);
+	}
+	patches.clear();
+	for (size_t i = 0; i < Generated; i++)
+		patches.push_back({nullptr, &bytes[i * PatternSize * 2], &bytes[i * PatternSize * 2 + PatternSize], PatternSize, 1 + i % 4});
+	benchLookupPass("generated", patches);
+}
+
+static void testWriteWindows() {
+	printf("write windows:\n");
+
+	const uint8_t find[] {0x01, 0x02, 0x03, 0x04}, replace[] {0x05, 0x06, 0x07, 0x08};
+	const std::vector<uint8_t> a {0x01, 0x02, 0x03, 0x04}, b {0x05, 0x06, 0x07, 0x08};
+
+	{
+		// all the occurrences of all the patches are written at once
+		static constexpr size_t Patches {8}, Occurrences {16};
+		std::vector<std::pair<size_t, std::vector<uint8_t>>> parts;
+		for (size_t p = 0; p < Patches; p++) {
+			for (size_t i = 0; i < Occurrences; i++)
+				parts.push_back({0x1000 + (p * Occurrences + i) * 0x10, {static_cast<uint8_t>(0x10 + p), 0x02, 0x03, 0x04}});
+		}
+		Fixture fixture(makeKext(0x3000, parts));
+
+		std::vector<uint8_t> finds(Patches * sizeof(find));
+		std::vector<KernelPatcher::LookupPatch> patches;
+		std::vector<const KernelPatcher::LookupPatch *> list;
+		for (size_t p = 0; p < Patches; p++) {
+			memcpy(&finds[p * sizeof(find)], find, sizeof(find));
+			finds[p * sizeof(find)] = static_cast<uint8_t>(0x10 + p);
+			patches.push_back({&fixture.kext, &finds[p * sizeof(find)], replace, sizeof(find), Occurrences});
+		}
+		for (auto &patch : patches)
+			list.push_back(&patch);
+
+		fixture.patcher.applyLookupPatches(list.data(), list.size());
+		CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+		CHECK(MachMock::writeWindows == 1);
+		bool written {true};
+		for (auto &part : parts)
+			written &= fixture.has(part.first, b);
+		CHECK(written);
+		RESULT("%zu replacements: %zu windows", Patches * Occurrences, MachMock::writeWindows);
+
+		// reverting the journal takes one more window
+		fixture.patcher.deinit();
+		CHECK(MachMock::writeWindows == 2);
+		CHECK(fixture.has(0x1000, {0x10, 0x02, 0x03, 0x04}));
+	}
+
+	{
+		// nested transactions are written by the outermost one, aborted ones are never written
+		Fixture fixture(makeKext(0x3000, {}));
+		auto address = reinterpret_cast<mach_vm_address_t>(fixture.kextStart);
+		fixture.patcher.beginTransaction();
+		fixture.patcher.beginTransaction();
+		CHECK(fixture.patcher.stageWrite(address, a.data(), a.size()));
+		CHECK(fixture.patcher.commitTransaction());
+		CHECK(MachMock::writeWindows == 0);
+		CHECK(fixture.patcher.stageWrite(address + 0x100, a.data(), a.size()));
+		CHECK(fixture.patcher.commitTransaction());
+		CHECK(MachMock::writeWindows == 1);
+		CHECK(fixture.has(0, a) && fixture.has(0x100, a));
+
+		fixture.patcher.beginTransaction();
+		CHECK(fixture.patcher.stageWrite(address + 0x200, a.data(), a.size()));
+		fixture.patcher.abortTransaction();
+		CHECK(!fixture.patcher.commitTransaction());
+		CHECK(MachMock::writeWindows == 1);
+		CHECK(!fixture.has(0x200, a));
+
+		// a write outside of a transaction takes its own window
+		CHECK(fixture.patcher.stageWrite(address + 0x300, a.data(), a.size()));
+		CHECK(MachMock::writeWindows == 2);
+		CHECK(fixture.has(0x300, a));
+	}
+}
+
+static void testPatchArena() {
+	printf("patch arena:\n");
+
+	Fixture fixture(makeKext(0x1000, {}));
+	std::vector<uint8_t> original(Fixture::KernelSize, 0xCC);
+	MachMock::fill(fixture.kernel, original.data(), original.size());
+
+	// every route stores two patch records to be restored at deinit
+	static constexpr size_t Routes {1000};
+	auto target = reinterpret_cast<mach_vm_address_t>(fixture.kernel) + Fixture::KernelSize - 0x10;
+	Host::resetAllocations();
+	for (size_t i = 0; i < Routes; i++)
+		fixture.patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(fixture.kernel) + i * 0x10, target);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+
+	// the arena grows geometrically and the stage buffer is allocated once
+	size_t allocations = Host::allocations + Host::reallocations;
+	CHECK(allocations <= 8);
+	CHECK(fixture.kernel[0] == 0xE9 && fixture.kernel[(Routes - 1) * 0x10] == 0xE9);
+	RESULT("%zu routes: %zu allocations, %zu reallocations, peak %zu bytes", Routes, Host::allocations, Host::reallocations, Host::bytesPeak);
+
+	fixture.patcher.deinit();
+	CHECK(!memcmp(fixture.kernel, original.data(), original.size()));
+
+	// a failed resize keeps the buffer, a successful one moves the used elements
+	auto buf = Buffer::create<uint32_t>(4);
+	CHECK(buf);
+	for (uint32_t i = 0; buf && i < 4; i++)
+		buf[i] = i;
+	Host::failingAllocations = 1;
+	CHECK(!Buffer::resize(buf, 4, 8));
+	CHECK(buf && buf[3] == 3);
+	CHECK(Buffer::resize(buf, 4, 2));
+	CHECK(buf && buf[0] == 0 && buf[1] == 1);
+	Buffer::deleter(buf);
+	CHECK(!Buffer::create<uint64_t>(static_cast<size_t>(-1) / 4));
+
+	// the arena stays usable when it fails to grow
+	Fixture failing(makeKext(0x1000, {}));
+	MachMock::fill(failing.kernel, original.data(), original.size());
+	failing.patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(failing.kernel), target);
+	size_t routed {1};
+	Host::failingAllocations = 1;
+	while (routed < Routes && failing.patcher.getError() == KernelPatcher::Error::NoError)
+		failing.patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(failing.kernel) + routed++ * 0x10, target);
+	CHECK(failing.patcher.getError() == KernelPatcher::Error::MemoryIssue && Host::failingAllocations == 0);
+	failing.patcher.clearError();
+	Host::failingAllocations = 0;
+	failing.patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(failing.kernel) + routed * 0x10, target);
+	CHECK(failing.patcher.getError() == KernelPatcher::Error::NoError);
+	CHECK(failing.kernel[0] == 0xE9 && failing.kernel[routed * 0x10] == 0xE9);
+	RESULT("arena growth failed after %zu routes and recovered", routed - 1);
+
+	failing.patcher.deinit();
+	CHECK(!memcmp(failing.kernel, original.data(), original.size()));
+}
+
+static void testTrampolineSlab() {
+	printf("trampoline slab:\n");
+
+	// push rbp; mov rbp, rsp; push rbx; followed by nops at every function
+	static constexpr size_t Functions {8}, FunctionSize {0x40};
+	const std::vector<uint8_t> prologue {0x55, 0x48, 0x89, 0xE5, 0x53};
+	Fixture fixture(makeKext(0x1000, {}));
+	std::vector<uint8_t> kernel(Fixture::KernelSize, 0x90);
+	for (size_t i = 0; i < Functions; i++)
+		memcpy(&kernel[i * FunctionSize], prologue.data(), prologue.size());
+	MachMock::fill(fixture.kernel, kernel.data(), kernel.size());
+
+	auto base = reinterpret_cast<mach_vm_address_t>(fixture.kernel);
+	auto target = base + Fixture::KernelSize - 0x10;
+	size_t pages = Host::pageCount();
+	Host::writableExecutable = 0;
+
+	// the routes of a transaction share a page
+	std::vector<mach_vm_address_t> wrappers;
+	fixture.patcher.beginTransaction();
+	for (size_t i = 0; i < Functions / 2; i++)
+		wrappers.push_back(fixture.patcher.routeFunction(base + i * FunctionSize, target, true));
+	CHECK(fixture.patcher.commitTransaction());
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	CHECK(Host::pageCount() == pages + 1);
+
+	bool aligned {true}, copied {true}, shared {true};
+	for (auto wrapper : wrappers) {
+		aligned &= wrapper % 16 == 0;
+		copied &= !memcmp(reinterpret_cast<void *>(wrapper), prologue.data(), prologue.size());
+		shared &= (wrapper & ~static_cast<mach_vm_address_t>(PAGE_MASK)) == (wrappers[0] & ~static_cast<mach_vm_address_t>(PAGE_MASK));
+	}
+	CHECK(aligned && copied && shared);
+	CHECK(Host::pageProtection(wrappers[0]) == (VM_PROT_READ|VM_PROT_EXECUTE));
+
+	// a sealed page is never reopened, the next transaction starts a new one
+	auto first = wrappers.size();
+	fixture.patcher.beginTransaction();
+	for (size_t i = Functions / 2; i < Functions; i++)
+		wrappers.push_back(fixture.patcher.routeFunction(base + i * FunctionSize, target, true));
+	CHECK(fixture.patcher.commitTransaction());
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	CHECK(Host::pageCount() == pages + 2);
+	CHECK((wrappers[first] & ~static_cast<mach_vm_address_t>(PAGE_MASK)) != (wrappers[0] & ~static_cast<mach_vm_address_t>(PAGE_MASK)));
+	CHECK(Host::pageProtection(wrappers[0]) == (VM_PROT_READ|VM_PROT_EXECUTE));
+	CHECK(Host::pageProtection(wrappers[first]) == (VM_PROT_READ|VM_PROT_EXECUTE));
+	CHECK(Host::writableExecutable == 0);
+
+	RESULT("%zu wrapped routes: %zu pages, %zu bytes apart, %zu writable executable requests", Functions,
+		   Host::pageCount() - pages, static_cast<size_t>(wrappers[1] - wrappers[0]), Host::writableExecutable);
+
+	fixture.patcher.deinit();
+	CHECK(Host::pageCount() == pages);
+	CHECK(!memcmp(fixture.kernel, kernel.data(), kernel.size()));
+}
+
+static void testKinfoUnload() {
+	printf("kinfo unload:\n");
+
+	Fixture fixture(makeKext(0x1000, {}));
+	auto index = fixture.kext.loadIndex;
+	CHECK(index != KernelPatcher::KextInfo::Unloaded);
+	auto base = reinterpret_cast<mach_vm_address_t>(fixture.kextStart);
+	fixture.patcher.updateRunningInfo(index, base, fixture.kextSize);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+
+	// the released kinfo can no longer be used, the others keep their ids
+	CHECK(fixture.patcher.unloadKinfo(&fixture.kext) == MachMock::SymbolTableSize);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	CHECK(fixture.kext.loadIndex == KernelPatcher::KextInfo::Unloaded);
+	fixture.patcher.updateRunningInfo(index, base, fixture.kextSize);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::KernRunningInitFailure);
+	fixture.patcher.clearError();
+	fixture.patcher.updateRunningInfo(KernelPatcher::KernelID);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+
+	// neither an unloaded kext nor the kernel may be released
+	CHECK(fixture.patcher.unloadKinfo(&fixture.kext) == 0);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoKinfoFound);
+	fixture.patcher.clearError();
+
+	// a reloaded kinfo takes a new id
+	auto reloaded = fixture.patcher.loadKinfo(&fixture.kext);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	CHECK(reloaded == fixture.kext.loadIndex && reloaded > index);
+	fixture.patcher.updateRunningInfo(reloaded, base, fixture.kextSize);
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+
+	RESULT("kinfo %zu released, reloaded at %zu", index, reloaded);
+}
+
+/**
+ *  Codec lookup over the vendor and codec lists the index replaces
+ *
+ *  @param vendor codec vendor
+ *  @param codec  codec device
+ *
+ *  @return codec info or nullptr
+ */
+static const CodecModInfo *scanCodecMod(uint16_t vendor, uint16_t codec) {
+	for (size_t i = 0; i < vendorModSize; i++) {
+		if (vendorMod[i].vendor != vendor)
+			continue;
+		for (size_t j = 0; j < vendorMod[i].codecsNum; j++) {
+			if (vendorMod[i].codecs[j].codec == codec)
+				return &vendorMod[i].codecs[j];
+		}
+	}
+	return nullptr;
+}
+
+static void testCodecIndex() {
+	printf("codec index:\n");
+
+	// every known codec is found with its vendor
+	std::vector<std::pair<uint16_t, uint16_t>> keys;
+	bool found {true};
+	for (size_t i = 0; i < vendorModSize; i++) {
+		for (size_t j = 0; j < vendorMod[i].codecsNum; j++) {
+			auto entry = findCodecMod(vendorMod[i].vendor, vendorMod[i].codecs[j].codec);
+			found &= entry && entry->vendor == &vendorMod[i] && entry->codec == &vendorMod[i].codecs[j];
+			keys.emplace_back(vendorMod[i].vendor, vendorMod[i].codecs[j].codec);
+		}
+	}
+	CHECK(found && !keys.empty());
+
+	// empty slots are not matched by any key, including the ones of absent codecs
+	CHECK(findCodecMod(0x0000, 0x0000) == nullptr);
+	CHECK(findCodecMod(0xFFFF, 0xFFFF) == nullptr);
+	bool agree {true};
+	uint32_t seed {0x12345678};
+	for (size_t i = 0; i < 0x100000; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint16_t vendor = i & 1 ? keys[seed % keys.size()].first : static_cast<uint16_t>(seed >> 16);
+		uint16_t codec = static_cast<uint16_t>(seed);
+		auto entry = findCodecMod(vendor, codec);
+		agree &= (entry ? entry->codec : nullptr) == scanCodecMod(vendor, codec);
+	}
+	CHECK(agree);
+
+	// known codecs are mixed with unknown ones sharing a known vendor
+	static constexpr size_t Lookups {0x100000};
+	std::vector<std::pair<uint16_t, uint16_t>> queries;
+	for (size_t i = 0; i < Lookups; i++) {
+		auto key = keys[i % keys.size()];
+		if (i & 1)
+			key.second ^= 0x5A5A;
+		queries.push_back(key);
+	}
+
+	uint64_t elapsed[2] {};
+	size_t hits[2] {};
+	for (size_t i = 0; i < 2; i++) {
+		uint64_t start = Host::now();
+		for (auto &query : queries) {
+			if (i == 0 ? scanCodecMod(query.first, query.second) != nullptr : findCodecMod(query.first, query.second) != nullptr)
+				hits[i]++;
+		}
+		elapsed[i] = Host::now() - start;
+	}
+	CHECK(hits[0] == hits[1]);
+
+	RESULT("%zu codecs: scan %.1f ns, index %.1f ns per lookup", keys.size(),
+		   static_cast<double>(elapsed[0]) / Lookups, static_cast<double>(elapsed[1]) / Lookups);
+}
+
+/**
+ *  Loaded kext list the dispatcher reads through _gLoadedKextSummaries
+ */
+static OSKextLoadedKextSummaryHeader *loadedSummaries {nullptr};
+static std::vector<uint8_t> loadedSummariesBuf;
+
+/**
+ *  Kexts the handlers were invoked for
+ */
+static std::vector<std::pair<std::string, mach_vm_address_t>> dispatchedKexts;
+
+/**
+ *  Replace the loaded kext list
+ *
+ *  @param kexts names and load tags in the loading order, the addresses are made of the tags
+ */
+static void setLoadedKexts(const std::vector<std::pair<const char *, uint32_t>> &kexts) {
+	loadedSummariesBuf.assign(sizeof(OSKextLoadedKextSummaryHeader) + kexts.size() * sizeof(OSKextLoadedKextSummary), 0);
+	loadedSummaries = reinterpret_cast<OSKextLoadedKextSummaryHeader *>(loadedSummariesBuf.data());
+	loadedSummaries->entry_size = sizeof(OSKextLoadedKextSummary);
+	loadedSummaries->numSummaries = static_cast<uint32_t>(kexts.size());
+	for (size_t i = 0; i < kexts.size(); i++) {
+		auto &summary = loadedSummaries->summaries[i];
+		strncpy(summary.name, kexts[i].first, KMOD_MAX_NAME - 1);
+		summary.loadTag = kexts[i].second;
+		summary.address = 0x1000000ULL * kexts[i].second;
+		summary.size = PAGE_SIZE;
+	}
+}
+
+static void testKextDispatcher() {
+	printf("kext dispatcher:\n");
+
+	// ret followed by nops, the debugger hook does nothing by itself
+	Fixture fixture(makeKext(0x1000, {}));
+	std::vector<uint8_t> kernel(Fixture::KernelSize, 0x90);
+	kernel[0] = 0xC3;
+	MachMock::fill(fixture.kernel, kernel.data(), kernel.size());
+	auto updated = reinterpret_cast<void (*)()>(fixture.kernel);
+	MachMock::addSymbol("_OSKextLoadedKextSummariesUpdated", reinterpret_cast<mach_vm_address_t>(fixture.kernel));
+	MachMock::addSymbol("_gLoadedKextSummaries", reinterpret_cast<mach_vm_address_t>(&loadedSummaries));
+
+	// the kexts loaded before listening are never dispatched
+	setLoadedKexts({{"com.test.A", 10}, {"com.test.B", 11}, {"com.test.C", 12}});
+	fixture.patcher.setupKextListening();
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	for (auto id : {"com.test.A", "com.test.D", "com.test.E", "com.test.F"}) {
+		fixture.patcher.waitOnKext(KernelPatcher::KextHandler::create(id, 0, [](KernelPatcher::KextHandler *handler) {
+			dispatchedKexts.emplace_back(handler->id, handler->address);
+		}));
+	}
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	dispatchedKexts.clear();
+
+	size_t updates {0};
+	auto update = [&](const std::vector<std::pair<const char *, uint32_t>> &kexts) {
+		setLoadedKexts(kexts);
+		updated();
+		updates++;
+	};
+
+	// a plain load
+	update({{"com.test.A", 10}, {"com.test.B", 11}, {"com.test.C", 12}, {"com.test.D", 13}});
+	CHECK(dispatchedKexts.size() == 1 && dispatchedKexts[0].first == "com.test.D" && dispatchedKexts[0].second == 0x1000000ULL * 13);
+
+	// an unload followed by a load keeps the number of summaries
+	update({{"com.test.A", 10}, {"com.test.C", 12}, {"com.test.D", 13}, {"com.test.E", 14}});
+	CHECK(dispatchedKexts.size() == 2 && dispatchedKexts[1].first == "com.test.E");
+
+	// an unload or a repeated notification brings nothing new
+	update({{"com.test.A", 10}, {"com.test.D", 13}, {"com.test.E", 14}});
+	update({{"com.test.A", 10}, {"com.test.D", 13}, {"com.test.E", 14}});
+	CHECK(dispatchedKexts.size() == 2);
+
+	// several unloads followed by a load shrink the list
+	update({{"com.test.A", 10}, {"com.test.F", 15}});
+	CHECK(dispatchedKexts.size() == 3 && dispatchedKexts[2].first == "com.test.F");
+
+	RESULT("%zu updates, %zu handlers invoked", updates, dispatchedKexts.size());
+
+	// the hook is restored and the dispatcher is no longer reachable
+	fixture.patcher.deinit();
+	CHECK(!memcmp(fixture.kernel, kernel.data(), kernel.size()));
+	update({{"com.test.A", 10}, {"com.test.F", 15}, {"com.test.G", 16}});
+	CHECK(dispatchedKexts.size() == 3);
+}
+
+/**
+ *  Longest x86 instruction
+ */
+static constexpr size_t MaxInstruction {15};
+
+/**
+ *  Build a code stream of typical kernel function instructions
+ *
+ *  @param size   minimal stream size
+ *  @param starts instruction offsets
+ *
+ *  @return code bytes padded with MaxInstruction int3 bytes
+ */
+static std::vector<uint8_t> makeCode(size_t size, std::vector<size_t> &starts) {
+	const std::vector<uint8_t> instructions[] {
+		{0x55},                                           // push rbp
+		{0x48, 0x89, 0xE5},                               // mov rbp, rsp
+		{0x41, 0x57},                                     // push r15
+		{0x53},                                           // push rbx
+		{0x48, 0x83, 0xEC, 0x28},                         // sub rsp, 0x28
+		{0x48, 0x8B, 0x05, 0x10, 0x20, 0x30, 0x00},       // mov rax, [rip + 0x302010]
+		{0x89, 0x7D, 0xFC},                               // mov [rbp - 4], edi
+		{0xE8, 0x00, 0x10, 0x00, 0x00},                   // call rel32
+		{0x0F, 0x84, 0x40, 0x00, 0x00, 0x00},             // je rel32
+		{0x48, 0x8D, 0x3D, 0x00, 0x01, 0x00, 0x00},       // lea rdi, [rip + 0x100]
+		{0xC7, 0x45, 0xF8, 0x01, 0x00, 0x00, 0x00},       // mov dword [rbp - 8], 1
+		{0x4C, 0x8B, 0x74, 0x24, 0x08},                   // mov r14, [rsp + 8]
+		{0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},             // nop word [rax + rax]
+		{0x48, 0xB8, 1, 2, 3, 4, 5, 6, 7, 8},             // mov rax, imm64
+		{0x80, 0x3D, 0x00, 0x10, 0x00, 0x00, 0x00},       // cmp byte [rip + 0x1000], 0
+		{0x31, 0xC0},                                     // xor eax, eax
+		{0x5D},                                           // pop rbp
+		{0xC3}                                            // ret
+	};
+
+	std::vector<uint8_t> code;
+	uint32_t seed {0x9E3779B9};
+	while (code.size() < size) {
+		seed = seed * 1103515245 + 12345;
+		auto &instruction = instructions[(seed >> 16) % arrsize(instructions)];
+		starts.push_back(code.size());
+		code.insert(code.end(), instruction.begin(), instruction.end());
+	}
+	code.insert(code.end(), MaxInstruction, 0xCC);
+	return code;
+}
+
+static void testLengthDecoder() {
+	printf("length decoder:\n");
+
+	// capstone memory management is set up by Disassembler
+	Disassembler disasm;
+	CHECK(disasm.init());
+	csh handle;
+	CHECK(cs_open(CS_ARCH_X86, CS_MODE_64, &handle) == CS_ERR_OK);
+	auto insn = cs_malloc(handle);
+	CHECK(insn != nullptr);
+	if (!insn) {
+		disasm.deinit();
+		return;
+	}
+
+	// invalid instructions may be decoded, they are never met at function starts
+	size_t agree {0}, fallback {0}, invalid {0}, mismatch {0};
+	auto compare = [&](const uint8_t *ptr) {
+		const uint8_t *code = ptr;
+		size_t size = MaxInstruction;
+		uint64_t address = reinterpret_cast<uint64_t>(ptr);
+		bool valid = cs_disasm_iter(handle, &code, &size, &address, insn);
+		size_t quick = Disassembler::quickInstructionSize(reinterpret_cast<mach_vm_address_t>(ptr), 1);
+		if (quick == 0)
+			fallback++;
+		else if (!valid)
+			invalid++;
+		else if (quick == insn->size)
+			agree++;
+		else
+			mismatch++;
+	};
+
+	// the decoder may give up, but it must never disagree with capstone, which is built with
+	// the full x86 tables here, as the reduced ones decode 0F 8x jumps with 16-bit displacements
+	std::vector<size_t> starts;
+	auto code = makeCode(0x40000, starts);
+	for (auto start : starts)
+		compare(&code[start]);
+	CHECK(mismatch == 0 && fallback == 0 && invalid == 0);
+	RESULT("%zu typical instructions: %zu agree, %zu fallback, %zu mismatch", starts.size(), agree, fallback, mismatch);
+
+	agree = fallback = invalid = mismatch = 0;
+	static constexpr size_t Samples {1000000};
+	uint8_t bytes[32];
+	uint32_t seed {1};
+	for (size_t n = 0; n < Samples; n++) {
+		for (auto &b : bytes) {
+			seed = seed * 1103515245 + 12345;
+			b = static_cast<uint8_t>(seed >> 16);
+		}
+		// prefixes and escapes are less frequent in random bytes than in code
+		if (n % 3 == 0)
+			bytes[0] = 0x0F;
+		else if (n % 7 == 0)
+			bytes[0] = 0x48 | (bytes[1] & 7);
+		compare(bytes);
+	}
+	CHECK(mismatch == 0);
+	RESULT("%zu random instructions: %zu agree, %zu fallback, %zu invalid, %zu mismatch", Samples, agree, fallback, invalid, mismatch);
+
+	// trampolines need SmallJump or LongJump bytes of whole instructions
+	static constexpr size_t Rounds {200000};
+	for (size_t min : {5, 16}) {
+		uint64_t elapsed[2] {};
+		size_t sums[2] {};
+		for (size_t i = 0; i < 2; i++) {
+			uint64_t start = Host::now();
+			for (size_t r = 0; r < Rounds; r++) {
+				auto ptr = reinterpret_cast<mach_vm_address_t>(&code[starts[(r * 13) % (starts.size() - 16)]]);
+				sums[i] += i == 0 ? Disassembler::quickInstructionSize(ptr, min) : disasm.instructionSize(ptr, min);
+			}
+			elapsed[i] = Host::now() - start;
+		}
+		CHECK(sums[0] == sums[1]);
+		RESULT("%zu bytes: table decoder %.1f ns, capstone %.1f ns", min,
+			   static_cast<double>(elapsed[0]) / Rounds, static_cast<double>(elapsed[1]) / Rounds);
+	}
+
+	cs_free(insn, 1);
+	cs_close(&handle);
+	disasm.deinit();
+
+	// wrapped routes within a transaction, each of them builds a trampoline
+	Fixture fixture(makeKext(0x1000, {}));
+	static constexpr size_t FunctionSize {0x40};
+	std::vector<uint8_t> kernel(Fixture::KernelSize, 0xCC);
+	for (size_t off = 0; off + FunctionSize <= kernel.size(); off += FunctionSize)
+		memcpy(&kernel[off], &code[starts[off / FunctionSize]], FunctionSize - MaxInstruction);
+	MachMock::fill(fixture.kernel, kernel.data(), kernel.size());
+
+	auto base = reinterpret_cast<mach_vm_address_t>(fixture.kernel);
+	size_t routes = Fixture::KernelSize / FunctionSize - 1;
+	fixture.patcher.beginTransaction();
+	uint64_t start = Host::now();
+	for (size_t i = 0; i < routes; i++)
+		fixture.patcher.routeFunction(base + i * FunctionSize, base + Fixture::KernelSize - FunctionSize, true);
+	uint64_t elapsed = Host::now() - start;
+	CHECK(fixture.patcher.commitTransaction());
+	CHECK(fixture.patcher.getError() == KernelPatcher::Error::NoError);
+	RESULT("%zu wrapped routes: %.1f ns per route", routes, static_cast<double>(elapsed) / routes);
+}
+
+static void testDisassemblerInit() {
+	printf("disassembler init:\n");
+
+	// jmp rel32; push rbp; mov rbp, rsp
+	const uint8_t code[32] {0xE9, 0x00, 0x01, 0x00, 0x00, 0x55, 0x48, 0x89, 0xE5};
+	auto address = reinterpret_cast<mach_vm_address_t>(code);
+	size_t used = Host::bytesUsed;
+
+	// detailed decoding needs the instruction buffer allocated after the detail option
+	for (bool detailed : {true, false, true}) {
+		Disassembler disasm;
+		CHECK(disasm.init(detailed));
+		CHECK(disasm.init(detailed));
+		CHECK(disasm.instructionSize(address, 5) == 5);
+		CHECK(disasm.instructionSize(address, 6) == 6);
+		disasm.deinit();
+		disasm.deinit();
+		CHECK(Host::bytesUsed == used);
+	}
+	RESULT("%zu bytes left after deinit", Host::bytesUsed - used);
+}
+
+int main() {
+	testFindPattern();
+	testLookupRules();
+	testLookupPass();
+	testWriteWindows();
+	testPatchArena();
+	testTrampolineSlab();
+	testKextDispatcher();
+	testKinfoUnload();
+	testCodecIndex();
+	testLengthDecoder();
+	testDisassemblerInit();
+
+	return Host::report("PatcherTests");
+}
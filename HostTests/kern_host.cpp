@@ -0,0 +1,480 @@
+//
+//  kern_host.cpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include "kern_host.hpp"
+
+#include <libkern/libkern.h>
+#include <libkern/c++/OSObject.h>
+#include <mach/vm_map.h>
+#include <sys/vnode.h>
+#include <i386/proc_reg.h>
+#include <kern/clock.h>
+#include <kern/thread.h>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <chrono>
+#include <map>
+#include <string>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+namespace Host {
+	size_t allocations {0};
+	size_t reallocations {0};
+	size_t bytesUsed {0};
+	size_t bytesPeak {0};
+	size_t failingAllocations {0};
+	size_t protections {0};
+	size_t writableExecutable {0};
+	size_t fileBytesRead {0};
+	uintptr_t cr0 {CR0_WP};
+	size_t failures {0};
+
+	static std::map<vm_address_t, vm_prot_t> pages;
+	static std::map<std::string, std::string> files;
+}
+
+void Host::resetAllocations() {
+	allocations = reallocations = 0;
+	bytesPeak = bytesUsed;
+}
+
+vm_prot_t Host::pageProtection(vm_address_t addr) {
+	auto page = pages.find(addr & ~static_cast<vm_address_t>(PAGE_MASK));
+	return page != pages.end() ? page->second : VM_PROT_NONE;
+}
+
+size_t Host::pageCount() {
+	return pages.size();
+}
+
+uint64_t Host::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char *Host::writeFile(const char *name, const void *data, size_t size) {
+	auto dir = getenv("TMPDIR");
+	auto &path = files[name];
+	path = std::string(dir ? dir : "/tmp") + "/AppleALC-" + std::to_string(getpid()) + "-" + name;
+
+	auto file = fopen(path.c_str(), "wb");
+	if (!file)
+		return nullptr;
+	bool written = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && written ? path.c_str() : nullptr;
+}
+
+void Host::removeFiles() {
+	for (auto &file : files)
+		unlink(file.second.c_str());
+	files.clear();
+}
+
+int Host::report(const char *name) {
+	removeFiles();
+	if (failures > 0) {
+		printf("%s: %zu checks failed\n", name, failures);
+		return 1;
+	}
+	printf("%s: all checks passed\n", name);
+	return 0;
+}
+
+/**
+ *  Memory management, allocations are prefixed with their size and zero filled like in libkern
+ */
+static constexpr size_t AllocHeader {16};
+
+extern "C" void *kern_os_malloc(size_t size) {
+	if (Host::failingAllocations > 0) {
+		Host::failingAllocations--;
+		return nullptr;
+	}
+	auto p = static_cast<uint8_t *>(calloc(1, size + AllocHeader));
+	if (!p)
+		return nullptr;
+	*reinterpret_cast<size_t *>(p) = size;
+	Host::allocations++;
+	Host::bytesUsed += size;
+	if (Host::bytesUsed > Host::bytesPeak)
+		Host::bytesPeak = Host::bytesUsed;
+	return p + AllocHeader;
+}
+
+extern "C" void kern_os_free(void *addr) {
+	if (!addr)
+		return;
+	auto p = static_cast<uint8_t *>(addr) - AllocHeader;
+	Host::bytesUsed -= *reinterpret_cast<size_t *>(p);
+	free(p);
+}
+
+extern "C" void *kern_os_realloc(void *addr, size_t nsize) {
+	// like libkern, always a new block, and the old one is freed even when the allocation fails
+	auto np = kern_os_malloc(nsize);
+	if (addr) {
+		size_t size = *reinterpret_cast<size_t *>(static_cast<uint8_t *>(addr) - AllocHeader);
+		if (np)
+			memcpy(np, addr, size < nsize ? size : nsize);
+		kern_os_free(addr);
+	}
+	if (np)
+		Host::reallocations++;
+	return np;
+}
+
+/**
+ *  Kernel map, pages are real so that protection violations fault
+ */
+vm_map_t kernel_map {0};
+
+static int hostProtection(vm_prot_t prot) {
+	return ((prot & VM_PROT_READ) ? PROT_READ : 0) |
+		   ((prot & VM_PROT_WRITE) ? PROT_WRITE : 0) |
+		   ((prot & VM_PROT_EXECUTE) ? PROT_EXEC : 0);
+}
+
+extern "C" kern_return_t vm_allocate(vm_map_t target_task, vm_address_t *address, vm_size_t size, int flags) {
+	size = (size + PAGE_MASK) & ~static_cast<vm_size_t>(PAGE_MASK);
+	bool fixed = !(flags & VM_FLAGS_ANYWHERE);
+
+	// a fixed address is only passed as a hint, so that existing mappings are never replaced
+	auto p = mmap(fixed ? reinterpret_cast<void *>(*address) : nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		return KERN_NO_SPACE;
+
+	auto addr = reinterpret_cast<vm_address_t>(p);
+	if (fixed && addr != *address) {
+		munmap(p, size);
+		return KERN_NO_SPACE;
+	}
+
+	for (vm_size_t off = 0; off < size; off += PAGE_SIZE)
+		Host::pages[addr + off] = VM_PROT_READ|VM_PROT_WRITE;
+	*address = addr;
+	return KERN_SUCCESS;
+}
+
+extern "C" kern_return_t vm_deallocate(vm_map_t target_task, vm_address_t address, vm_size_t size) {
+	size = (size + PAGE_MASK) & ~static_cast<vm_size_t>(PAGE_MASK);
+	for (vm_size_t off = 0; off < size; off += PAGE_SIZE) {
+		if (!Host::pages.erase(address + off))
+			return KERN_INVALID_ADDRESS;
+	}
+	return munmap(reinterpret_cast<void *>(address), size) == 0 ? KERN_SUCCESS : KERN_INVALID_ADDRESS;
+}
+
+extern "C" kern_return_t vm_protect(vm_map_t target_task, vm_address_t address, vm_size_t size, boolean_t set_maximum, vm_prot_t new_protection) {
+	Host::protections++;
+
+	// the patcher must never leave a page both writable and executable
+	if ((new_protection & VM_PROT_WRITE) && (new_protection & VM_PROT_EXECUTE)) {
+		Host::writableExecutable++;
+		return KERN_PROTECTION_FAILURE;
+	}
+
+	size = (size + PAGE_MASK) & ~static_cast<vm_size_t>(PAGE_MASK);
+	for (vm_size_t off = 0; off < size; off += PAGE_SIZE) {
+		if (Host::pages.find(address + off) == Host::pages.end())
+			return KERN_INVALID_ADDRESS;
+	}
+
+	if (mprotect(reinterpret_cast<void *>(address), size, hostProtection(new_protection)) != 0)
+		return KERN_PROTECTION_FAILURE;
+
+	for (vm_size_t off = 0; off < size; off += PAGE_SIZE)
+		Host::pages[address + off] = new_protection;
+	return KERN_SUCCESS;
+}
+
+/**
+ *  Kernel version, 10.11
+ */
+extern const uint32_t version_major {15};
+
+/**
+ *  Processor state and time
+ */
+extern "C" uintptr_t get_cr0(void) {
+	return Host::cr0;
+}
+
+extern "C" void set_cr0(uintptr_t value) {
+	Host::cr0 = value;
+}
+
+#ifdef __APPLE__
+extern "C" void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result) {
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	*result = abstime * timebase.numer / timebase.denom;
+}
+#else
+extern "C" uint64_t mach_absolute_time(void) {
+	return Host::now();
+}
+
+extern "C" void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result) {
+	*result = abstime;
+}
+#endif
+
+static int hostThread;
+extern "C" void *current_thread(void) {
+	return &hostThread;
+}
+
+/**
+ *  Filesystem, vnodes are stdio files and a single uio is reused as the sources never free them
+ */
+struct vnode {
+	FILE *file;
+};
+
+struct vfs_context {
+	int unused;
+};
+
+struct uio {
+	off_t offset;
+	uint64_t base;
+	uint64_t length;
+	int64_t resid;
+};
+
+static int hostProc;
+proc_t kernproc {reinterpret_cast<proc_t>(&hostProc)};
+static vfs_context hostContext;
+static uio hostUio;
+
+extern "C" vfs_context_t vfs_context_create(vfs_context_t ctx) {
+	return &hostContext;
+}
+
+extern "C" vfs_context_t vfs_context_current(void) {
+	return &hostContext;
+}
+
+extern "C" kauth_cred_t vfs_context_ucred(vfs_context_t ctx) {
+	return reinterpret_cast<kauth_cred_t>(&hostContext);
+}
+
+extern "C" int vfs_context_rele(vfs_context_t ctx) {
+	return 0;
+}
+
+extern "C" errno_t vnode_lookup(const char *path, int flags, vnode_t *vpp, vfs_context_t ctx) {
+	auto file = fopen(path, "rb");
+	if (!file)
+		return ENOENT;
+	*vpp = new vnode {file};
+	return 0;
+}
+
+extern "C" int vnode_put(vnode_t vp) {
+	if (vp) {
+		fclose(vp->file);
+		delete vp;
+	}
+	return 0;
+}
+
+extern "C" int vnode_getattr(vnode_t vp, struct vnode_attr *vap, vfs_context_t ctx) {
+	if (fseeko(vp->file, 0, SEEK_END) != 0)
+		return EIO;
+	vap->va_data_size = ftello(vp->file);
+	return 0;
+}
+
+extern "C" uio_t uio_create(int a_iovcount, off_t a_offset, int a_spacetype, int a_iodirection) {
+	hostUio = uio {a_offset, 0, 0, 0};
+	return &hostUio;
+}
+
+extern "C" int uio_addiov(uio_t a_uio, uint64_t a_baseaddr, uint64_t a_length) {
+	a_uio->base = a_baseaddr;
+	a_uio->length = a_uio->resid = a_length;
+	return 0;
+}
+
+extern "C" int64_t uio_resid(uio_t a_uio) {
+	return a_uio->resid;
+}
+
+extern "C" int VNOP_READ(vnode_t vp, uio_t uio, int ioflag, vfs_context_t ctx) {
+	if (fseeko(vp->file, uio->offset, SEEK_SET) != 0)
+		return EIO;
+	size_t read = fread(reinterpret_cast<void *>(uio->base), 1, uio->length, vp->file);
+	Host::fileBytesRead += read;
+	uio->resid = uio->length - read;
+	return ferror(vp->file) ? EIO : 0;
+}
+
+/**
+ *  Plist parsing
+ */
+class XMLParser {
+	const char *pos;
+	std::map<std::string, std::string> refs;
+
+	void skipSpace() {
+		while (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n')
+			pos++;
+	}
+
+	// skips declarations and comments, stops at the next element tag
+	bool nextTag(std::string &name, std::string &attrs, bool &empty, bool &closing) {
+		for (;;) {
+			skipSpace();
+			if (*pos != '<')
+				return false;
+			if (!strncmp(pos, "<?", 2) || !strncmp(pos, "<!", 2)) {
+				auto end = strchr(pos, '>');
+				if (!end)
+					return false;
+				pos = end + 1;
+				continue;
+			}
+
+			auto end = strchr(pos, '>');
+			if (!end)
+				return false;
+			closing = pos[1] == '/';
+			empty = end[-1] == '/';
+			std::string tag(pos + (closing ? 2 : 1), end - (empty ? 1 : 0));
+			auto space = tag.find(' ');
+			name = tag.substr(0, space);
+			attrs = space != std::string::npos ? tag.substr(space) : "";
+			pos = end + 1;
+			return true;
+		}
+	}
+
+	static std::string attribute(const std::string &attrs, const char *name) {
+		auto key = std::string(" ") + name + "=\"";
+		auto start = attrs.find(key);
+		if (start == std::string::npos)
+			return "";
+		start += key.size();
+		return attrs.substr(start, attrs.find('"', start) - start);
+	}
+
+	bool text(const char *name, std::string &value) {
+		auto end = strstr(pos, (std::string("</") + name + ">").c_str());
+		if (!end)
+			return false;
+		value.clear();
+		for (auto p = pos; p < end; p++) {
+			const char *entities[][2] {{"&lt;", "<"}, {"&gt;", ">"}, {"&amp;", "&"}, {"&quot;", "\""}, {"&apos;", "'"}};
+			bool replaced = false;
+			for (auto &entity : entities) {
+				if (!strncmp(p, entity[0], strlen(entity[0]))) {
+					value += entity[1];
+					p += strlen(entity[0]) - 1;
+					replaced = true;
+					break;
+				}
+			}
+			if (!replaced)
+				value += *p;
+		}
+		pos = end + strlen(name) + 3;
+		return true;
+	}
+
+	OSObject *leaf(const std::string &name, const std::string &value) {
+		if (name == "string")
+			return OSString::withCString(value.c_str());
+		if (name == "integer")
+			return OSNumber::withNumber(strtoull(value.c_str(), nullptr, 0), 64);
+		return nullptr;
+	}
+
+public:
+	explicit XMLParser(const char *buffer) : pos(buffer) {}
+
+	OSObject *parse() {
+		std::string name, attrs;
+		bool empty, closing;
+		if (!nextTag(name, attrs, empty, closing) || closing)
+			return nullptr;
+
+		if (name == "plist")
+			return parse();
+
+		if (name == "true" || name == "false")
+			return empty ? new OSBoolean(name == "true") : nullptr;
+
+		if (name == "string" || name == "integer") {
+			std::string value;
+			auto ref = attribute(attrs, "IDREF");
+			if (!ref.empty()) {
+				auto found = refs.find(name + ref);
+				return empty && found != refs.end() ? leaf(name, found->second) : nullptr;
+			}
+			if (!empty && !text(name.c_str(), value))
+				return nullptr;
+			auto id = attribute(attrs, "ID");
+			if (!id.empty())
+				refs[name + id] = value;
+			return leaf(name, value);
+		}
+
+		if (name == "data") {
+			std::string value;
+			if (!empty && !text("data", value))
+				return nullptr;
+			return OSData::withBytes(value.data(), 0);
+		}
+
+		if (name == "array" || name == "dict") {
+			bool dict = name == "dict";
+			OSObject *container = dict ? static_cast<OSObject *>(OSDictionary::withCapacity(0)) : OSArray::withCapacity(0);
+			while (!empty) {
+				auto save = pos;
+				std::string key;
+				if (!nextTag(name, attrs, empty, closing)) {
+					container->release();
+					return nullptr;
+				}
+				if (closing)
+					break;
+				if (dict) {
+					if (name != "key" || empty || !text("key", key)) {
+						container->release();
+						return nullptr;
+					}
+				} else {
+					pos = save;
+				}
+
+				auto object = parse();
+				if (!object) {
+					container->release();
+					return nullptr;
+				}
+				if (dict)
+					static_cast<OSDictionary *>(container)->setObject(key.c_str(), object);
+				else
+					static_cast<OSArray *>(container)->setObject(object);
+				empty = false;
+			}
+			return container;
+		}
+
+		return nullptr;
+	}
+};
+
+OSObject *OSUnserializeXML(const char *buffer, OSString **errorString) {
+	return XMLParser(buffer).parse();
+}
@@ -0,0 +1,127 @@
+//
+//  kern_host.hpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef kern_host_hpp
+#define kern_host_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <mach/mach_types.h>
+
+/**
+ *  Kernel environment emulation for the host test targets
+ *
+ *  The kext sources are compiled as is against the headers in HostTests/Kernel,
+ *  kern_host.cpp implements the used kernel interfaces on top of libc and keeps
+ *  statistics, which the tests check instead of the private patcher state.
+ */
+namespace Host {
+	/**
+	 *  kern_os_malloc statistics, reset by resetAllocations
+	 */
+	extern size_t allocations;
+	extern size_t reallocations;
+	extern size_t bytesUsed;
+	extern size_t bytesPeak;
+
+	/**
+	 *  Number of the next kern_os_malloc calls to fail
+	 */
+	extern size_t failingAllocations;
+
+	/**
+	 *  Reset allocation counters, the peak starts from the bytes currently used
+	 */
+	void resetAllocations();
+
+	/**
+	 *  Page protection changes made through vm_protect and the attempts to make a page writable and executable
+	 */
+	extern size_t protections;
+	extern size_t writableExecutable;
+
+	/**
+	 *  Get the protection of a page allocated with vm_allocate
+	 *
+	 *  @param addr any address within the page
+	 *
+	 *  @return page protection or VM_PROT_NONE if the page is unknown
+	 */
+	vm_prot_t pageProtection(vm_address_t addr);
+
+	/**
+	 *  Number of allocated pages
+	 */
+	size_t pageCount();
+
+	/**
+	 *  Bytes read through VNOP_READ
+	 */
+	extern size_t fileBytesRead;
+
+	/**
+	 *  Emulated CR0 register
+	 */
+	extern uintptr_t cr0;
+
+	/**
+	 *  Monotonic time for benchmarks
+	 *
+	 *  @return nanoseconds
+	 */
+	uint64_t now();
+
+	/**
+	 *  Write a temporary file for vnode_lookup
+	 *
+	 *  @param name file name
+	 *  @param data file contents
+	 *  @param size file size
+	 *
+	 *  @return file path valid till the next call with the same name or nullptr
+	 */
+	const char *writeFile(const char *name, const void *data, size_t size);
+
+	/**
+	 *  Remove temporary files written by writeFile
+	 */
+	void removeFiles();
+
+	/**
+	 *  Failed checks
+	 */
+	extern size_t failures;
+
+	/**
+	 *  Print the test summary
+	 *
+	 *  @param name test target name
+	 *
+	 *  @return process exit code
+	 */
+	int report(const char *name);
+}
+
+/**
+ *  Report a failed check and continue
+ */
+#define CHECK(expr)                                                                 \
+	do {                                                                            \
+		if (!(expr)) {                                                              \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);         \
+			Host::failures++;                                                       \
+		}                                                                           \
+	} while (0)
+
+/**
+ *  Print a named test or benchmark result
+ */
+#define RESULT(str, ...) printf("    " str "\n", ## __VA_ARGS__)
+
+#endif /* kern_host_hpp */
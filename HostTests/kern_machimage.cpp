@@ -0,0 +1,337 @@
+//
+//  kern_machimage.cpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include "kern_machimage.hpp"
+
+#include <string.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <mach-o/fat.h>
+#include <mach/mach_types.h>
+#include <mach/vm_param.h>
+#include <libkern/OSByteOrder.h>
+
+#include "../AppleALC/kern_compression.hpp"
+#include "../AppleALC/kern_symcache.hpp"
+
+namespace {
+	template <typename T>
+	T *append(std::vector<uint8_t> &image) {
+		image.resize(image.size() + sizeof(T));
+		return reinterpret_cast<T *>(image.data() + image.size() - sizeof(T));
+	}
+
+	template <typename T>
+	T *at(std::vector<uint8_t> &image, size_t off) {
+		return reinterpret_cast<T *>(image.data() + off);
+	}
+
+	void segment(std::vector<uint8_t> &image, const char *name, uint64_t vmaddr, uint64_t size, uint64_t fileoff, uint32_t nsects) {
+		auto seg = append<segment_command_64>(image);
+		seg->cmd = LC_SEGMENT_64;
+		seg->cmdsize = sizeof(segment_command_64) + nsects * sizeof(section_64);
+		strncpy(seg->segname, name, sizeof(seg->segname));
+		seg->vmaddr = vmaddr;
+		seg->vmsize = seg->filesize = size;
+		seg->fileoff = fileoff;
+		seg->maxprot = seg->initprot = VM_PROT_READ|VM_PROT_EXECUTE;
+		seg->nsects = nsects;
+	}
+
+	void section(std::vector<uint8_t> &image, const char *seg, const char *name, uint64_t addr, uint64_t size, uint32_t offset) {
+		auto sect = append<section_64>(image);
+		strncpy(sect->segname, seg, sizeof(sect->segname));
+		strncpy(sect->sectname, name, sizeof(sect->sectname));
+		sect->addr = addr;
+		sect->size = size;
+		sect->offset = offset;
+	}
+
+	size_t roundPage(size_t size) {
+		return (size + PAGE_MASK) & ~static_cast<size_t>(PAGE_MASK);
+	}
+
+	// code-like filler, repeated instruction sequences make it compressible like real binaries
+	void fillCode(uint8_t *code, size_t size, uint32_t seed) {
+		static const uint8_t words[][8] {
+			{0x55, 0x48, 0x89, 0xE5, 0x41, 0x57, 0x41, 0x56},
+			{0x48, 0x8B, 0x47, 0x08, 0x48, 0x85, 0xC0, 0x74},
+			{0xE8, 0x00, 0x00, 0x00, 0x00, 0x89, 0xC3, 0x90},
+			{0x5D, 0xC3, 0x0F, 0x1F, 0x44, 0x00, 0x00, 0xCC},
+		};
+		for (size_t i = 0; i < size; i++) {
+			if (i % 8 == 0)
+				seed = seed * 1103515245 + 12345;
+			code[i] = (seed >> 24) < 0x20 ? static_cast<uint8_t>(seed >> (i % 8)) : words[(seed >> 16) % 4][i % 8];
+		}
+	}
+}
+
+std::vector<uint8_t> MachImage::buildPrelinked(Prelinked &prelinked) {
+	std::vector<uint8_t> image;
+	size_t text = PAGE_SIZE + roundPage(prelinked.kernelSize);
+
+	// kexts follow the kernel both in the file and in memory
+	std::vector<std::vector<uint8_t>> kexts;
+	size_t prelinkText = 0;
+	for (auto &kext : prelinked.kexts) {
+		kext.textAddr = prelinked.kernelAddr + text + prelinkText;
+		kexts.push_back(build(kext));
+		prelinkText += roundPage(kexts.back().size());
+	}
+
+	std::string plist = "<dict><key>_PrelinkInfoDictionary</key><array>";
+	for (size_t i = 0; i < kexts.size(); i++) {
+		char addr[64], size[64];
+		snprintf(addr, sizeof(addr), "0x%llx", static_cast<unsigned long long>(prelinked.kexts[i].textAddr));
+		snprintf(size, sizeof(size), "0x%zx", kexts[i].size());
+		plist += "<dict><key>CFBundleIdentifier</key><string>" + prelinked.ids[i] + "</string>"
+			"<key>_PrelinkExecutableSourceAddr</key><integer size=\"64\">" + addr + "</integer>"
+			"<key>_PrelinkExecutableSize</key><integer size=\"64\">" + size + "</integer></dict>";
+	}
+	plist += "</array></dict>";
+	size_t prelinkInfo = roundPage(plist.size() + 1);
+
+	uint64_t infoOff = text + prelinkText;
+	uint64_t linkeditOff = infoOff + prelinkInfo;
+
+	auto header = append<mach_header_64>(image);
+	header->magic = MH_MAGIC_64;
+	header->cputype = CPU_TYPE_X86_64;
+	header->cpusubtype = 3;
+	header->filetype = MH_EXECUTE;
+	size_t commands = image.size();
+
+	segment(image, "__TEXT", prelinked.kernelAddr, text, 0, 0);
+	segment(image, "__PRELINK_TEXT", prelinked.kernelAddr + text, prelinkText, text, 0);
+	segment(image, "__PRELINK_INFO", prelinked.kernelAddr + infoOff, prelinkInfo, infoOff, 1);
+	section(image, "__PRELINK_INFO", "__info", prelinked.kernelAddr + infoOff, plist.size() + 1, static_cast<uint32_t>(infoOff));
+	segment(image, "__LINKEDIT", prelinked.kernelAddr + linkeditOff, prelinked.linkeditSize, linkeditOff, 0);
+
+	auto uuid = append<uuid_command>(image);
+	uuid->cmd = LC_UUID;
+	uuid->cmdsize = sizeof(uuid_command);
+
+	header = at<mach_header_64>(image, 0);
+	header->ncmds = 5;
+	header->sizeofcmds = static_cast<uint32_t>(image.size() - commands);
+
+	image.resize(text);
+	fillCode(image.data() + PAGE_SIZE, prelinked.kernelSize, 0);
+	for (auto &kext : kexts) {
+		image.insert(image.end(), kext.begin(), kext.end());
+		image.resize(roundPage(image.size()));
+	}
+	image.insert(image.end(), plist.begin(), plist.end());
+	image.resize(linkeditOff + prelinked.linkeditSize);
+	fillCode(image.data() + linkeditOff, prelinked.linkeditSize, 1);
+
+	return image;
+}
+
+std::vector<uint8_t> MachImage::symbolCache(const Binary &binary, const std::vector<size_t> &indices) {
+	std::vector<uint8_t> data(sizeof(SymbolCacheHeader));
+	std::vector<char> pool {'\0'};
+	for (auto i : indices) {
+		auto sym = append<nlist_64>(data);
+		sym->n_un.n_strx = static_cast<uint32_t>(pool.size());
+		sym->n_type = N_SECT|N_EXT;
+		sym->n_sect = 1 + binary.unlistedSections;
+		sym->n_value = symbolValue(binary, i);
+		pool.insert(pool.end(), binary.symbols[i].begin(), binary.symbols[i].end());
+		pool.push_back('\0');
+	}
+	data.insert(data.end(), pool.begin(), pool.end());
+
+	auto header = at<SymbolCacheHeader>(data, 0);
+	header->magic = SymbolCacheHeader::Magic;
+	header->version = SymbolCacheHeader::Version;
+	memcpy(header->uuid, binary.uuid, sizeof(header->uuid));
+	header->count = static_cast<uint32_t>(indices.size());
+	header->stringsSize = static_cast<uint32_t>(pool.size());
+	header->textAddr = binary.textAddr;
+	return data;
+}
+
+std::vector<uint8_t> MachImage::fat(const std::vector<uint8_t> &image, size_t trailing) {
+	std::vector<uint8_t> data(PAGE_SIZE);
+	auto header = reinterpret_cast<fat_header *>(data.data());
+	header->magic = OSSwapHostToBigInt32(FAT_MAGIC);
+	header->nfat_arch = OSSwapHostToBigInt32(2);
+
+	auto arch = reinterpret_cast<fat_arch *>(header + 1);
+	arch[0].cputype = OSSwapHostToBigInt32(CPU_TYPE_X86_64);
+	arch[0].offset = OSSwapHostToBigInt32(PAGE_SIZE);
+	arch[0].size = OSSwapHostToBigInt32(static_cast<uint32_t>(image.size()));
+	arch[0].align = OSSwapHostToBigInt32(12);
+	arch[1].cputype = OSSwapHostToBigInt32(CPU_TYPE_I386);
+	arch[1].offset = OSSwapHostToBigInt32(static_cast<uint32_t>(PAGE_SIZE + roundPage(image.size())));
+	arch[1].size = OSSwapHostToBigInt32(static_cast<uint32_t>(trailing));
+	arch[1].align = OSSwapHostToBigInt32(12);
+
+	data.insert(data.end(), image.begin(), image.end());
+	data.resize(PAGE_SIZE + roundPage(image.size()));
+	data.resize(data.size() + trailing, 0xCC);
+	return data;
+}
+
+std::vector<uint8_t> MachImage::compress(const std::vector<uint8_t> &image) {
+	// greedy LZSS matching the kext_tools decoder: 4096 byte ring starting at N - F, 3 to 18 byte matches
+	static constexpr size_t N {4096}, F {18}, Threshold {2}, Chain {16};
+	std::vector<uint8_t> data(sizeof(CompressedHeader));
+	std::vector<int64_t> head(1 << 16, -1), prev(image.size(), -1);
+	auto hash = [&image](size_t p) { return ((image[p] << 8) ^ (image[p+1] << 4) ^ image[p+2]) & 0xFFFF; };
+	size_t flags = 0;
+	uint32_t items = 8;
+
+	for (size_t p = 0; p < image.size(); ) {
+		if (items == 8) {
+			flags = data.size();
+			data.push_back(0);
+			items = 0;
+		}
+
+		size_t bestLen = 0, bestPos = 0;
+		if (p + Threshold < image.size()) {
+			int64_t q = head[hash(p)];
+			for (size_t c = 0; c < Chain && q >= 0 && p - q < N - F; c++, q = prev[q]) {
+				size_t len = 0;
+				while (len < F && p + len < image.size() && image[q + len] == image[p + len])
+					len++;
+				if (len > bestLen) {
+					bestLen = len;
+					bestPos = q;
+				}
+			}
+		}
+
+		size_t step = 1;
+		if (bestLen > Threshold) {
+			size_t ring = (N - F + bestPos) & (N - 1);
+			data.push_back(ring & 0xFF);
+			data.push_back(((ring >> 4) & 0xF0) | (bestLen - Threshold - 1));
+			step = bestLen;
+		} else {
+			data[flags] |= 1 << items;
+			data.push_back(image[p]);
+		}
+		items++;
+
+		for (size_t i = 0; i < step; i++, p++) {
+			if (p + Threshold < image.size()) {
+				auto h = hash(p);
+				prev[p] = head[h];
+				head[h] = p;
+			}
+		}
+	}
+
+	auto header = reinterpret_cast<CompressedHeader *>(data.data());
+	header->magic = CompressedMagic;
+	header->compression = CompressionLZSS;
+	header->decompressed = OSSwapHostToBigInt32(static_cast<uint32_t>(image.size()));
+	header->compressed = OSSwapHostToBigInt32(static_cast<uint32_t>(data.size() - sizeof(CompressedHeader)));
+	header->version = OSSwapHostToBigInt32(1);
+	return data;
+}
+
+void MachImage::place(std::vector<uint8_t> &image, uint64_t address) {
+	auto header = at<mach_header_64>(image, 0);
+	size_t off = sizeof(mach_header_64);
+	for (uint32_t i = 0; i < header->ncmds; i++) {
+		auto cmd = at<load_command>(image, off);
+		if (cmd->cmd == LC_SEGMENT_64)
+			at<segment_command_64>(image, off)->vmaddr += address;
+		off += cmd->cmdsize;
+	}
+}
+
+size_t MachImage::textSize(const Binary &binary) {
+	return PAGE_SIZE + roundPage(binary.codeSize);
+}
+
+uint64_t MachImage::symbolValue(const Binary &binary, size_t index) {
+	return binary.textAddr + PAGE_SIZE + (index * 16) % binary.codeSize;
+}
+
+std::string MachImage::symbolName(size_t index) {
+	static const char *classes[] {"IOHDACodecDevice", "AppleHDAController", "AppleHDAFunctionGroup", "AppleHDAWidget"};
+	static const char *methods[] {"initWithProvider", "handleInterrupt", "setPowerState", "getProperty", "configure"};
+	return "__ZN" + std::to_string(strlen(classes[index % 4])) + classes[index % 4] +
+		std::to_string(strlen(methods[index / 4 % 5]) + std::to_string(index).size()) + methods[index / 4 % 5] +
+		std::to_string(index) + "EP9IOService";
+}
+
+std::vector<uint8_t> MachImage::build(const Binary &binary) {
+	std::vector<uint8_t> image;
+	size_t text = textSize(binary);
+	uint32_t nsyms = static_cast<uint32_t>(binary.symbols.size());
+
+	// string table starts with an empty name like the linker does
+	std::vector<char> strings {'\0'};
+	std::vector<uint32_t> strx;
+	for (auto &name : binary.symbols) {
+		strx.push_back(static_cast<uint32_t>(strings.size()));
+		strings.insert(strings.end(), name.begin(), name.end());
+		strings.push_back('\0');
+	}
+	if (!binary.terminatedStrings)
+		strings.pop_back();
+
+	uint64_t symoff = text;
+	uint64_t stroff = symoff + nsyms * sizeof(nlist_64);
+	uint64_t linkedit = stroff + strings.size() - text;
+
+	auto header = append<mach_header_64>(image);
+	header->magic = MH_MAGIC_64;
+	header->cputype = CPU_TYPE_X86_64;
+	header->cpusubtype = 3;
+	header->filetype = binary.filetype;
+	size_t commands = image.size();
+	uint32_t ncmds = 4;
+
+	if (binary.unlistedSections > 0) {
+		segment(image, "__UNLISTED", binary.textAddr, 0, 0, 0);
+		at<segment_command_64>(image, image.size() - sizeof(segment_command_64))->nsects = binary.unlistedSections;
+		ncmds++;
+	}
+
+	segment(image, "__TEXT", binary.textAddr, text, 0, 1);
+	section(image, "__TEXT", "__text", binary.textAddr + PAGE_SIZE, binary.codeSize, PAGE_SIZE);
+	segment(image, "__LINKEDIT", binary.textAddr + text, linkedit, text, 0);
+
+	auto symtab = append<symtab_command>(image);
+	symtab->cmd = LC_SYMTAB;
+	symtab->cmdsize = sizeof(symtab_command);
+	symtab->symoff = static_cast<uint32_t>(symoff);
+	symtab->nsyms = nsyms;
+	symtab->stroff = static_cast<uint32_t>(stroff);
+	symtab->strsize = static_cast<uint32_t>(strings.size());
+
+	auto uuid = append<uuid_command>(image);
+	uuid->cmd = LC_UUID;
+	uuid->cmdsize = sizeof(uuid_command);
+	memcpy(uuid->uuid, binary.uuid, sizeof(uuid->uuid));
+
+	header = at<mach_header_64>(image, 0);
+	header->ncmds = ncmds;
+	header->sizeofcmds = static_cast<uint32_t>(image.size() - commands);
+
+	image.resize(text);
+	fillCode(image.data() + PAGE_SIZE, binary.codeSize, nsyms);
+
+	for (uint32_t i = 0; i < nsyms; i++) {
+		auto sym = append<nlist_64>(image);
+		sym->n_un.n_strx = strx[i];
+		sym->n_type = N_SECT|N_EXT;
+		sym->n_sect = 1 + binary.unlistedSections;
+		sym->n_value = symbolValue(binary, i);
+	}
+	image.insert(image.end(), strings.begin(), strings.end());
+
+	return image;
+}
@@ -0,0 +1,130 @@
+//
+//  kern_machimage.hpp
+//  AppleALC
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#ifndef kern_machimage_hpp
+#define kern_machimage_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ *  Synthetic mach-o images for the host tests
+ */
+namespace MachImage {
+	/**
+	 *  x86_64 binary with __TEXT,__text, __LINKEDIT symbol and string tables and LC_UUID
+	 *  __TEXT starts with a header page followed by the code, __LINKEDIT follows __TEXT both in the file and in memory
+	 */
+	struct Binary {
+		uint32_t filetype {0xB}; // MH_KEXT_BUNDLE
+		uint64_t textAddr {0};
+		size_t codeSize {0x1000};
+		std::vector<std::string> symbols;
+		uint8_t uuid[16] {};
+		bool terminatedStrings {true};
+		uint32_t unlistedSections {0}; // declared by a leading empty segment without their headers, __text follows them
+	};
+
+	/**
+	 *  x86_64 prelinked kernel with __TEXT, __PRELINK_TEXT holding kext executables at their vm addresses,
+	 *  __PRELINK_INFO,__info with the kext plist and a trailing __LINKEDIT, file offsets follow vm offsets
+	 */
+	struct Prelinked {
+		uint64_t kernelAddr {0xFFFFFF8000200000};
+		size_t kernelSize {0x100000};
+		size_t linkeditSize {0x400000};
+		std::vector<std::string> ids;
+		std::vector<Binary> kexts; // textAddr is assigned when building
+	};
+
+	/**
+	 *  Build a binary image
+	 *
+	 *  @param binary binary description
+	 *
+	 *  @return image bytes
+	 */
+	std::vector<uint8_t> build(const Binary &binary);
+
+	/**
+	 *  Build a prelinked kernel image
+	 *
+	 *  @param prelinked prelinked kernel description, kext addresses are updated
+	 *
+	 *  @return image bytes
+	 */
+	std::vector<uint8_t> buildPrelinked(Prelinked &prelinked);
+
+	/**
+	 *  Build a symbol cache like SymbolCacheGenerator does
+	 *
+	 *  @param binary  binary description
+	 *  @param indices cached symbol indices
+	 *
+	 *  @return cache file bytes
+	 */
+	std::vector<uint8_t> symbolCache(const Binary &binary, const std::vector<size_t> &indices);
+
+	/**
+	 *  Wrap an image into a fat binary as its x86_64 slice followed by an i386 slice
+	 *
+	 *  @param image    image bytes
+	 *  @param trailing i386 slice size
+	 *
+	 *  @return fat binary bytes
+	 */
+	std::vector<uint8_t> fat(const std::vector<uint8_t> &image, size_t trailing);
+
+	/**
+	 *  Wrap an image into a compressed kernelcache container with LZSS compression
+	 *
+	 *  @param image image bytes
+	 *
+	 *  @return container bytes
+	 */
+	std::vector<uint8_t> compress(const std::vector<uint8_t> &image);
+
+	/**
+	 *  Move segment addresses of a loaded copy like the kext loader does
+	 *
+	 *  @param image   loaded image bytes
+	 *  @param address load address
+	 */
+	void place(std::vector<uint8_t> &image, uint64_t address);
+
+	/**
+	 *  Unslid value of a symbol, symbols are placed 16 bytes apart in __text wrapping at its end
+	 *
+	 *  @param binary binary description
+	 *  @param index  symbol index
+	 *
+	 *  @return symbol address
+	 */
+	uint64_t symbolValue(const Binary &binary, size_t index);
+
+	/**
+	 *  Size of __TEXT segment
+	 *
+	 *  @param binary binary description
+	 *
+	 *  @return size in bytes
+	 */
+	size_t textSize(const Binary &binary);
+
+	/**
+	 *  Generate a mangled C++ symbol name resembling kernel ones
+	 *
+	 *  @param index unique name index
+	 *
+	 *  @return symbol name
+	 */
+	std::string symbolName(size_t index);
+}
+
+#endif /* kern_machimage_hpp */
@@ -11,6 +11,9 @@
 #import <Foundation/Foundation.h>
 #import <Cocoa/Cocoa.h>
 #include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
 
 #define SYSLOG(str, ...) printf("ResourceConverter: " str "\n", ## __VA_ARGS__)
 #define ERROR(str, ...) do { SYSLOG(str, ## __VA_ARGS__); exit(1); } while(0)
@@ -27,6 +30,15 @@ NSString *ResourceHeader {@"\
 #include \"kern_resources.hpp\"                      \n\n"
 };
 
+struct CodecIndexEntry {
+	uint32_t key;
+	size_t vendor;
+	std::string vendorName;
+	size_t codec;
+};
+
+static std::vector<CodecIndexEntry> codecIndex;
+
 static void appendFile(NSString *file, NSString *data) {
 	NSFileHandle *handle = [NSFileHandle fileHandleForUpdatingAtPath:file];
 	[handle seekToEndOfFile];
@@ -122,7 +134,8 @@ static NSString *generateFile(NSString *file, NSString *path, NSString *inFile)
 static NSString *generateRevisions(NSString *file, NSDictionary *codecDict) {
 	static size_t revisionIndex {0};
 	
-	NSArray *revs = [codecDict objectForKey:@"Revisions"];
+	// Sorted for binary search
+	NSArray *revs = [[codecDict objectForKey:@"Revisions"] sortedArrayUsingSelector:@selector(compare:)];
 	
 	if (revs) {
 		appendFile(file, makeStringList(@"revisions", revisionIndex, revs, @"uint32_t"));
@@ -183,6 +196,12 @@ static NSString *generateLayouts(NSString *file, NSDictionary *codecDict, NSStri
 	return @"nullptr, 0";
 }
 
+static bool kernelsOverlap(NSDictionary *a, NSDictionary *b) {
+	auto min = [](NSDictionary *p) { return [p objectForKey:@"MinKernel"] ? [[p objectForKey:@"MinKernel"] intValue] : 0; };
+	auto max = [](NSDictionary *p) { return [p objectForKey:@"MaxKernel"] ? [[p objectForKey:@"MaxKernel"] intValue] : INT_MAX; };
+	return min(a) <= max(b) && min(b) <= max(a);
+}
+
 static NSString *generatePatches(NSString *file, NSDictionary *codecDict, NSDictionary *kextIndexes) {
 	static size_t patchIndex {0};
 	static size_t patchBufIndex {0};
@@ -192,7 +211,8 @@ static NSString *generatePatches(NSString *file, NSDictionary *codecDict, NSDict
 	if (patches) {
 		auto pStr = [[NSMutableString alloc] initWithFormat:@"static const KextPatch patches%zu[] {\n", patchIndex];
 		auto pbStr = [[NSMutableString alloc] init];
-		for (NSDictionary *p in patches) {
+		for (NSUInteger i = 0; i < [patches count]; i++) {
+			NSDictionary *p = patches[i];
             NSData *f[] = {[p objectForKey:@"Find"], [p objectForKey:@"Replace"]};
 			
 			if ([f[0] length] != [f[1] length]) {
@@ -200,6 +220,21 @@ static NSString *generatePatches(NSString *file, NSDictionary *codecDict, NSDict
 				continue;
 			}
 			
+			// The patches of a kext are applied in a single pass over its original bytes, see applyLookupPatches
+			if (![p objectForKey:@"Count"])
+				ERROR("%s patch %lu must have a Count, 0 replaces every occurrence", [[p objectForKey:@"Name"] UTF8String], i);
+			
+			for (NSUInteger j = 0; j < i; j++) {
+				NSDictionary *prev = patches[j];
+				if (![[prev objectForKey:@"Name"] isEqualToString:[p objectForKey:@"Name"]] || !kernelsOverlap(prev, p))
+					continue;
+				if ([[prev objectForKey:@"Find"] isEqualToData:f[0]])
+					ERROR("%s patch %lu duplicates the Find of patch %lu", [[p objectForKey:@"Name"] UTF8String], i, j);
+				NSData *prevReplace = [prev objectForKey:@"Replace"];
+				if ([f[0] length] > 0 && [prevReplace rangeOfData:f[0] options:0 range:NSMakeRange(0, [prevReplace length])].location != NSNotFound)
+					ERROR("%s patch %lu finds the Replace of patch %lu, chained patches are not supported", [[p objectForKey:@"Name"] UTF8String], i, j);
+			}
+			
 			for (auto d : f) {
 				[pbStr appendString:[[NSString alloc] initWithFormat:@"static const uint8_t patchBuf%zu[] { ", patchBufIndex]];
 				
@@ -217,7 +252,7 @@ static NSString *generatePatches(NSString *file, NSDictionary *codecDict, NSDict
 			 patchBufIndex-2,
 			 patchBufIndex-1,
 			 [f[0] length],
-			 [p objectForKey:@"Count"] ?: @"0",
+			 [p objectForKey:@"Count"],
 			 [p objectForKey:@"MinKernel"] ?: @"KernelPatcher::KernelAny",
 			 [p objectForKey:@"MaxKernel"] ?: @"KernelPatcher::KernelAny"
 			];
@@ -233,7 +268,7 @@ static NSString *generatePatches(NSString *file, NSDictionary *codecDict, NSDict
 	return @"nullptr, 0";
 }
 
-static size_t generateCodecs(NSString *file, NSString *vendor, NSString *path, NSDictionary *kextIndexes) {
+static size_t generateCodecs(NSString *file, NSString *vendor, uint16_t vendorID, size_t vendorIndex, NSString *path, NSDictionary *kextIndexes) {
 	appendFile(file, [[NSString alloc] initWithFormat:@"\n// %@ CodecMod section\n\n", vendor]);
 
 	auto codecModSection = [[NSMutableString alloc] initWithFormat:@"CodecModInfo codecMod%@[] {\n", vendor];
@@ -260,6 +295,10 @@ static size_t generateCodecs(NSString *file, NSString *vendor, NSString *path, N
 				 [[codecDict objectForKey:@"CodecID"] unsignedShortValue],
 				 revs, platforms, layouts, patches
 				];
+				codecIndex.push_back({
+					static_cast<uint32_t>(vendorID) << 16 | [[codecDict objectForKey:@"CodecID"] unsignedShortValue],
+					vendorIndex, [vendor UTF8String], codecs
+				});
 				codecs++;
 			}
 		}
@@ -301,6 +340,36 @@ static void generateControllers(NSString *file, NSArray *ctrls, NSDictionary *ve
 	[ctrlModSection appendString:@"};\n"];
 	[ctrlModSection appendFormat:@"\nconst size_t controllerModSize {%lu};\n", [ctrls count]];
 	appendFile(file, ctrlModSection);
+	
+	// Index the controllers by vendor and device, platform-specific entries go first
+	std::map<uint32_t, NSMutableArray *> index;
+	for (int pass = 0; pass < 2; pass++) {
+		size_t ctrlIndex {0};
+		for (NSDictionary *entry in ctrls) {
+			bool anyPlatform = [entry objectForKey:@"Platform"] == nil;
+			if (anyPlatform == (pass == 1)) {
+				uint32_t key = static_cast<uint32_t>([[vendors objectForKey:[entry objectForKey:@"Vendor"]] unsignedShortValue]) << 16 |
+					[[entry objectForKey:@"Device"] unsignedShortValue];
+				if (!index[key])
+					index[key] = [[NSMutableArray alloc] init];
+				[index[key] addObject:[NSNumber numberWithUnsignedLongLong:ctrlIndex]];
+			}
+			ctrlIndex++;
+		}
+	}
+	
+	appendFile(file, @"\n// Controller index section\n\n");
+	
+	auto indexSection = [[NSMutableString alloc] initWithString:@"const ControllerModIndex controllerModIndex[] {\n"];
+	size_t candidateIndex {0};
+	for (auto &entry : index) {
+		appendFile(file, makeStringList(@"controllerCandidates", candidateIndex, entry.second, @"size_t"));
+		[indexSection appendFormat:@"\t{ 0x%08X, controllerCandidates%zu, %lu },\n", entry.first, candidateIndex, [entry.second count]];
+		candidateIndex++;
+	}
+	[indexSection appendString:@"};\n"];
+	[indexSection appendFormat:@"\nconst size_t controllerModIndexSize {%zu};\n", index.size()];
+	appendFile(file, indexSection);
 }
 
 static void generateVendors(NSString *file, NSDictionary *vendors, NSString *path, NSDictionary *kextIndexes) {
@@ -308,11 +377,13 @@ static void generateVendors(NSString *file, NSDictionary *vendors, NSString *pat
 	
 	[vendorSection appendString:@"VendorModInfo vendorMod[] {\n"];
 	
+	size_t vendorIndex {0};
 	for (NSString *dictKey in vendors) {
 		NSNumber *vendorID = [vendors objectForKey:dictKey];
-		size_t num = generateCodecs(file, dictKey, path, kextIndexes);
+		size_t num = generateCodecs(file, dictKey, [vendorID unsignedShortValue], vendorIndex, path, kextIndexes);
 		[vendorSection appendFormat:@"\t{ \"%@\", 0x%X, codecMod%@, %zu },\n",
 			dictKey, [vendorID unsignedShortValue], dictKey, num];
+		vendorIndex++;
 	}
 	
 	[vendorSection appendString:@"};\n"];
@@ -320,6 +391,58 @@ static void generateVendors(NSString *file, NSDictionary *vendors, NSString *pat
 	appendFile(file, vendorSection);
 }
 
+static void generateCodecIndex(NSString *file) {
+	appendFile(file, @"\n// Codec index section\n\n");
+	
+	// Empty slots are marked with an impossible key
+	for (auto &e : codecIndex) {
+		if (e.key == 0xFFFFFFFF)
+			ERROR("Codec 0x%08X of %s cannot be indexed", e.key, e.vendorName.c_str());
+	}
+	
+	// Find the smallest table and multiplier giving no collisions, so that a lookup is a single probe
+	uint32_t bits {1};
+	while ((1U << bits) < codecIndex.size() * 2)
+		bits++;
+	
+	std::vector<const CodecIndexEntry *> table;
+	uint32_t seed {0};
+	bool found {false};
+	while (!found && bits <= 16) {
+		for (uint32_t attempt = 0; attempt < 100000 && !found; attempt++) {
+			seed = static_cast<uint32_t>(0x9E3779B1U * (attempt + 1)) | 1;
+			table.assign(1U << bits, nullptr);
+			found = true;
+			for (auto &e : codecIndex) {
+				auto &slot = table[static_cast<uint32_t>(e.key * seed) >> (32 - bits)];
+				if (slot) {
+					found = false;
+					break;
+				}
+				slot = &e;
+			}
+		}
+		
+		if (!found)
+			bits++;
+	}
+	
+	if (!found)
+		ERROR("Failed to build a perfect hash for %zu codecs", codecIndex.size());
+	
+	auto indexSection = [[NSMutableString alloc] initWithString:@"const CodecModIndex codecModIndex[] {\n"];
+	for (auto e : table) {
+		if (e)
+			[indexSection appendFormat:@"\t{ 0x%08X, &vendorMod[%zu], &codecMod%s[%zu] },\n", e->key, e->vendor, e->vendorName.c_str(), e->codec];
+		else
+			[indexSection appendString:@"\t{ 0xFFFFFFFF, nullptr, nullptr },\n"];
+	}
+	[indexSection appendString:@"};\n"];
+	[indexSection appendFormat:@"const uint32_t codecModIndexSeed {0x%08X};\n", seed];
+	[indexSection appendFormat:@"const uint32_t codecModIndexBits {%u};\n", bits];
+	appendFile(file, indexSection);
+}
+
 static void generateLookup(NSString *file, NSArray *lookup) {
 	appendFile(file, @"\n// Lookup section\n\n");
 
@@ -373,5 +496,6 @@ int main(int argc, const char * argv[]) {
 	generateLookup(outputCpp, lookup);
 	auto kextIndexes = generateKexts(outputCpp, kexts);
 	generateVendors(outputCpp, vendors, basePath, kextIndexes);
+	generateCodecIndex(outputCpp);
 	generateControllers(outputCpp, ctrls, vendors, kextIndexes);
 }
@@ -0,0 +1,150 @@
+//
+//  main.cpp
+//  SymbolCacheGenerator
+//
+//  Copyright © 2016 vit9696. All rights reserved.
+//
+
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <libkern/OSByteOrder.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../AppleALC/kern_symcache.hpp"
+
+#define SYSLOG(str, ...) printf("SymbolCacheGenerator: " str "\n", ## __VA_ARGS__)
+#define ERROR(str, ...) do { SYSLOG(str, ## __VA_ARGS__); exit(1); } while(0)
+
+static std::vector<uint8_t> readFile(const char *path) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh)
+		ERROR("Failed to open %s", path);
+
+	std::vector<uint8_t> data;
+	uint8_t chunk[65536];
+	size_t rd;
+	while ((rd = fread(chunk, 1, sizeof(chunk), fh)) > 0)
+		data.insert(data.end(), chunk, chunk + rd);
+
+	fclose(fh);
+	return data;
+}
+
+static size_t findSlice(const std::vector<uint8_t> &data) {
+	if (data.size() < sizeof(fat_header))
+		ERROR("Binary is too small");
+
+	auto fh = reinterpret_cast<const fat_header *>(data.data());
+	if (fh->magic != FAT_CIGAM)
+		return 0;
+
+	uint32_t num = OSSwapBigToHostInt32(fh->nfat_arch);
+	if (sizeof(fat_header) + static_cast<uint64_t>(num) * sizeof(fat_arch) > data.size())
+		ERROR("Fat header is malformed");
+
+	auto arch = reinterpret_cast<const fat_arch *>(fh + 1);
+	for (uint32_t i = 0; i < num; i++) {
+		if (static_cast<cpu_type_t>(OSSwapBigToHostInt32(arch[i].cputype)) == CPU_TYPE_X86_64)
+			return OSSwapBigToHostInt32(arch[i].offset);
+	}
+
+	ERROR("No x86_64 slice found");
+}
+
+int main(int argc, const char * argv[]) {
+	if (argc < 4)
+		ERROR("Usage: %s <uncompressed binary> <output cache> <symbol> [<symbol> ...]", argv[0]);
+
+	auto data = readFile(argv[1]);
+	size_t off = findSlice(data);
+	if (off + sizeof(mach_header_64) > data.size())
+		ERROR("Binary slice is out of file bounds");
+
+	auto mh = reinterpret_cast<const mach_header_64 *>(data.data() + off);
+	if (mh->magic != MH_MAGIC_64)
+		ERROR("Only 64-bit Mach-O binaries are supported, use a decompressed kernel");
+	if (off + sizeof(mach_header_64) + mh->sizeofcmds > data.size())
+		ERROR("Load commands are out of file bounds");
+
+	const uint8_t *uuid {nullptr};
+	const symtab_command *symtab {nullptr};
+	const segment_command_64 *text {nullptr};
+	auto addr = reinterpret_cast<const uint8_t *>(mh + 1);
+	auto end = addr + mh->sizeofcmds;
+	for (uint32_t i = 0; i < mh->ncmds && addr + sizeof(load_command) <= end; i++) {
+		auto loadCmd = reinterpret_cast<const load_command *>(addr);
+		if (loadCmd->cmdsize < sizeof(load_command) || addr + loadCmd->cmdsize > end)
+			ERROR("Load command %u is malformed", i);
+
+		if (loadCmd->cmd == LC_UUID)
+			uuid = reinterpret_cast<const uuid_command *>(loadCmd)->uuid;
+		else if (loadCmd->cmd == LC_SYMTAB)
+			symtab = reinterpret_cast<const symtab_command *>(loadCmd);
+		else if (loadCmd->cmd == LC_SEGMENT_64 && loadCmd->cmdsize >= sizeof(segment_command_64) &&
+				 strncmp(reinterpret_cast<const segment_command_64 *>(loadCmd)->segname, "__TEXT", 16) == 0)
+			text = reinterpret_cast<const segment_command_64 *>(loadCmd);
+
+		addr += loadCmd->cmdsize;
+	}
+
+	if (!uuid || !symtab || !text)
+		ERROR("Binary has no LC_UUID, LC_SYMTAB or __TEXT segment");
+	if (off + symtab->symoff + static_cast<uint64_t>(symtab->nsyms) * sizeof(nlist_64) > data.size() ||
+		off + symtab->stroff + static_cast<uint64_t>(symtab->strsize) > data.size())
+		ERROR("Symbol tables are out of file bounds");
+
+	auto symbols = reinterpret_cast<const nlist_64 *>(data.data() + off + symtab->symoff);
+	auto strings = reinterpret_cast<const char *>(data.data() + off + symtab->stroff);
+
+	// string pool starts with an empty name like the regular string tables do
+	std::vector<nlist_64> entries;
+	std::vector<char> pool(1, '\0');
+
+	for (int s = 3; s < argc; s++) {
+		// the first match wins, exactly as in MachInfo::solveSymbols
+		const nlist_64 *found {nullptr};
+		for (uint32_t i = 0; i < symtab->nsyms && !found; i++) {
+			uint32_t strx = symbols[i].n_un.n_strx;
+			if (strx < symtab->strsize && strncmp(strings + strx, argv[s], symtab->strsize - strx) == 0)
+				found = &symbols[i];
+		}
+
+		if (!found)
+			ERROR("Symbol %s was not found", argv[s]);
+
+		nlist_64 entry = *found;
+		entry.n_un.n_strx = static_cast<uint32_t>(pool.size());
+		entries.push_back(entry);
+		pool.insert(pool.end(), argv[s], argv[s] + strlen(argv[s]) + 1);
+		SYSLOG("%s -> 0x%llx", argv[s], entry.n_value);
+	}
+
+	SymbolCacheHeader header {};
+	header.magic = SymbolCacheHeader::Magic;
+	header.version = SymbolCacheHeader::Version;
+	memcpy(header.uuid, uuid, sizeof(header.uuid));
+	header.textAddr = text->vmaddr;
+	header.count = static_cast<uint32_t>(entries.size());
+	header.stringsSize = static_cast<uint32_t>(pool.size());
+
+	if (sizeof(header) + entries.size() * sizeof(nlist_64) + pool.size() > SymbolCacheHeader::MaxSize)
+		ERROR("Symbol cache exceeds %u bytes", SymbolCacheHeader::MaxSize);
+
+	FILE *out = fopen(argv[2], "wb");
+	if (!out)
+		ERROR("Failed to open %s for writing", argv[2]);
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+		fwrite(entries.data(), sizeof(nlist_64), entries.size(), out) != entries.size() ||
+		fwrite(pool.data(), 1, pool.size(), out) != pool.size())
+		ERROR("Failed to write %s", argv[2]);
+
+	fclose(out);
+	SYSLOG("Wrote %zu symbols to %s", entries.size(), argv[2]);
+
+	return 0;
+}